@@ -0,0 +1,468 @@
+#define _POSIX_C_SOURCE 200809L  // clock_gettime
+
+#include "bench.h"
+#include "blake3.h"
+#include "cache.h"
+#include "hash.h"
+#include "index.h"
+#include "key.h"
+#include "manifest.h"
+#include "metadata.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <sys/wait.h>
+
+#define BENCH_KEY_ITERATIONS 20
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static const char *find_source(char **argv) {
+    for (int i = 1; argv[i]; i++) {
+        const char *ext = strrchr(argv[i], '.');
+        if (argv[i][0] != '-' && ext && (
+            strcmp(ext, ".c") == 0  ||
+            strcmp(ext, ".cpp") == 0 ||
+            strcmp(ext, ".cc") == 0 ||
+            strcmp(ext, ".cxx") == 0)) {
+            return argv[i];
+        }
+    }
+    return NULL;
+}
+
+/* ---------- KEY MODES ---------- */
+/* Compare the cost of computing a key by scanning includes, by hashing
+ * the preprocessor output, and of confirming a direct-mode manifest. */
+static int bench_key(char **compiler_argv) {
+    const char *source = find_source(compiler_argv);
+    if (!source) {
+        fprintf(stderr, "Usage: quickcache --bench key <compiler> <args...> <source>\n");
+        return 1;
+    }
+
+    hash_t h;
+    double start, dep_ms, pp_ms, direct_ms;
+
+    start = now_ms();
+    for (int i = 0; i < BENCH_KEY_ITERATIONS; i++) {
+        if (key_hash_inputs(KEY_MODE_DEPENDENCIES, source, compiler_argv, h, NULL) == -1) {
+            fprintf(stderr, "Dependency hashing failed\n");
+            return 1;
+        }
+    }
+    dep_ms = (now_ms() - start) / BENCH_KEY_ITERATIONS;
+
+    start = now_ms();
+    for (int i = 0; i < BENCH_KEY_ITERATIONS; i++) {
+        if (key_hash_inputs(KEY_MODE_PREPROCESSOR, source, compiler_argv, h, NULL) == -1) {
+            fprintf(stderr, "Preprocessing failed\n");
+            return 1;
+        }
+    }
+    pp_ms = (now_ms() - start) / BENCH_KEY_ITERATIONS;
+
+    /* Record a manifest under a key no real compile can produce */
+    hash_t h_src, bench_tag, manifest_key;
+    const char *tag = "quickcache-bench";
+    manifest_t m;
+    manifest_init(&m);
+    if (hash_file(source, h_src) == -1 ||
+        key_hash_inputs(KEY_MODE_PREPROCESSOR, source, compiler_argv, m.result, &m) == -1) {
+        manifest_free(&m);
+        return 1;
+    }
+    hash_data(tag, strlen(tag), bench_tag);
+    hash_combine(h_src, bench_tag, manifest_key);
+    int dep_count = m.count;
+    manifest_save(manifest_key, &m);
+    manifest_free(&m);
+
+    start = now_ms();
+    for (int i = 0; i < BENCH_KEY_ITERATIONS; i++) {
+        hash_file(source, h_src);
+        if (manifest_load(manifest_key, &m) == -1 || manifest_verify(&m, NULL) == -1) {
+            fprintf(stderr, "Manifest verification failed\n");
+            manifest_free(&m);
+            return 1;
+        }
+        manifest_free(&m);
+    }
+    direct_ms = (now_ms() - start) / BENCH_KEY_ITERATIONS;
+
+    printf("Key computation (%s, %d iterations)\n", source, BENCH_KEY_ITERATIONS);
+    printf("  dependencies:    %8.3f ms/key\n", dep_ms);
+    printf("  preprocessor:    %8.3f ms/key\n", pp_ms);
+    printf("  direct manifest: %8.3f ms/key (%d files)\n", direct_ms, dep_count);
+    return 0;
+}
+
+/* ---------- HASH THROUGHPUT ---------- */
+/* Hash the same buffer repeatedly with each algorithm. BLAKE3 is measured
+ * on one thread and with its default thread pool for large inputs. */
+static double hash_throughput(hash_algo_t algo, const unsigned char *buf, size_t len,
+                              int iterations) {
+    hash_t h;
+    double start = now_ms();
+    for (int i = 0; i < iterations; i++) {
+        hash_ctx_t *ctx = hash_ctx_new_algo(algo);
+        if (!ctx) return 0;
+        hash_ctx_update(ctx, buf, len);
+        hash_ctx_final(ctx, h);
+        hash_ctx_free(ctx);
+    }
+    double ms = now_ms() - start;
+    return ms > 0 ? (double)len * iterations / (ms / 1000.0) / (1024.0 * 1024.0) : 0;
+}
+
+static int bench_hash(void) {
+    static const struct { const char *label; size_t len; int iterations; } sizes[] = {
+        { "1KB",   1024,             100000 },
+        { "100KB", 100 * 1024,       2000 },
+        { "10MB",  10 * 1024 * 1024, 20 },
+    };
+    size_t max_len = sizes[2].len;
+
+    unsigned char *buf = malloc(max_len);
+    if (!buf) return 1;
+    for (size_t i = 0; i < max_len; i++) buf[i] = (unsigned char)(i * 31 + (i >> 8));
+
+    printf("Hash throughput (MB/s, BLAKE3 lanes: %s x%zu)\n",
+           blake3_simd_name(), blake3_simd_degree());
+    printf("  %-6s %12s %12s %12s\n", "size", "sha256", "blake3-1t", "blake3");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double sha = hash_throughput(HASH_ALGO_SHA256, buf, sizes[i].len, sizes[i].iterations);
+        blake3_set_max_threads(1);
+        double b3_single = hash_throughput(HASH_ALGO_BLAKE3, buf, sizes[i].len, sizes[i].iterations);
+        blake3_set_max_threads(0);
+        double b3 = hash_throughput(HASH_ALGO_BLAKE3, buf, sizes[i].len, sizes[i].iterations);
+        printf("  %-6s %12.1f %12.1f %12.1f\n", sizes[i].label, sha, b3_single, b3);
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* ---------- METADATA ---------- */
+/* Many compiles finishing at once, each its own process with its own
+ * connection. The "per-call" column replays the original metadata layer:
+ * every call prepares and finalizes its statement, on a database with
+ * the default synchronous=FULL. */
+#define BENCH_WRITERS 64
+#define BENCH_METADATA_OPS 200
+
+enum { OP_ADD, OP_GET, OP_TOUCH, OP_DELETE, OP_KINDS };
+static const char *const op_names[OP_KINDS] = { "add", "get", "touch", "delete" };
+
+static int legacy_op(sqlite3 *db, int op, const char *hash) {
+    static const char *const sql[OP_KINDS] = {
+        "INSERT OR REPLACE INTO cache_entries "
+        "(hash, size, compressed_size, created, accessed, compressed, level) "
+        "VALUES (?1, 4096, 1024, ?2, ?2, 1, 3);",
+        "SELECT * FROM cache_entries WHERE hash = ?1;",
+        "UPDATE cache_entries SET accessed = ?2 WHERE hash = ?1;",
+        "DELETE FROM cache_entries WHERE hash = ?1;",
+    };
+
+    hash_t key;
+    sqlite3_stmt *stmt;
+    if (hash_from_hex(hash, key) != 0) return -1;
+    if (sqlite3_prepare_v2(db, sql[op], -1, &stmt, NULL) != SQLITE_OK) return -1;
+    sqlite3_bind_blob(stmt, 1, key, HASH_SIZE, SQLITE_STATIC);
+    if (op != OP_GET && op != OP_DELETE) sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE || rc == SQLITE_ROW ? 0 : -1;
+}
+
+static int current_op(int op, const char *hash) {
+    cache_entry_t entry;
+    switch (op) {
+    case OP_ADD:   return metadata_add(hash, 4096, 1024, 1, 3, "", 0, 0);
+    case OP_GET:   return metadata_get(hash, &entry);
+    case OP_TOUCH: return metadata_update_access(hash, time(NULL), 1);
+    default:       return metadata_delete(hash);
+    }
+}
+
+/* One writer: add, look up, touch and delete its own keys, sending the
+ * latency of every call to the parent. */
+static void metadata_writer(int legacy, int id, int ops, int out_fd) {
+    sqlite3 *db = NULL;
+    if (legacy) {
+        char path[4096];
+        cache_get_base_dir(path, sizeof(path));
+        strncat(path, "/cache.db", sizeof(path) - strlen(path) - 1);
+        if (sqlite3_open(path, &db) != SQLITE_OK) _exit(1);
+        sqlite3_exec(db, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL);
+        sqlite3_busy_timeout(db, 5000);
+    } else if (metadata_init() == -1) {
+        _exit(1);
+    }
+
+    double *lat = malloc(sizeof(double) * OP_KINDS * ops);
+    if (!lat) _exit(1);
+
+    int failed = 0;
+    for (int i = 0; i < ops; i++) {
+        char hash[HASH_HEX_SIZE];
+        snprintf(hash, sizeof(hash), "%08x%056x", (unsigned)id, (unsigned)i);
+        for (int op = 0; op < OP_KINDS; op++) {
+            double start = now_ms();
+            if ((legacy ? legacy_op(db, op, hash) : current_op(op, hash)) != 0) failed = 1;
+            lat[op * ops + i] = now_ms() - start;
+        }
+    }
+
+    if (legacy) sqlite3_close(db);
+    else metadata_close();
+
+    write_all(out_fd, lat, sizeof(double) * OP_KINDS * ops);
+    _exit(failed);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Run all writers at once; fills mean/p99 per op kind and total ops/s */
+static int metadata_round(int legacy, int writers, int ops, double mean[OP_KINDS],
+                          double p99[OP_KINDS], double *ops_per_sec) {
+    size_t per_writer = (size_t)OP_KINDS * ops;
+    double *all = malloc(sizeof(double) * per_writer * writers);
+    int *fds = malloc(sizeof(int) * writers);
+    if (!all || !fds) {
+        free(all);
+        free(fds);
+        return -1;
+    }
+
+    double start = now_ms();
+    int started = 0;
+    for (; started < writers; started++) {
+        int p[2];
+        if (pipe(p) == -1) break;
+        pid_t pid = fork();
+        if (pid == -1) {
+            close(p[0]);
+            close(p[1]);
+            break;
+        }
+        if (pid == 0) {
+            close(p[0]);
+            metadata_writer(legacy, started, ops, p[1]);
+        }
+        close(p[1]);
+        fds[started] = p[0];
+    }
+
+    int rc = started == writers ? 0 : -1;
+    for (int w = 0; w < started; w++) {
+        unsigned char *dst = (unsigned char *)(all + per_writer * w);
+        size_t want = sizeof(double) * per_writer, got = 0;
+        ssize_t n;
+        while (got < want && (n = read(fds[w], dst + got, want - got)) > 0) got += n;
+        close(fds[w]);
+        if (got != want) rc = -1;
+    }
+    for (int w = 0; w < started; w++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = -1;
+    }
+    double elapsed = now_ms() - start;
+
+    if (rc == 0) {
+        size_t n = (size_t)writers * ops;
+        double *samples = malloc(sizeof(double) * n);
+        for (int op = 0; op < OP_KINDS && samples; op++) {
+            double sum = 0;
+            for (int w = 0; w < writers; w++) {
+                memcpy(samples + (size_t)w * ops, all + per_writer * w + (size_t)op * ops,
+                       sizeof(double) * ops);
+            }
+            for (size_t i = 0; i < n; i++) sum += samples[i];
+            qsort(samples, n, sizeof(double), compare_double);
+            mean[op] = sum / n;
+            p99[op] = samples[(size_t)(n * 0.99)];
+        }
+        if (!samples) rc = -1;
+        free(samples);
+        *ops_per_sec = (double)writers * ops * OP_KINDS / (elapsed / 1000.0);
+    }
+
+    free(all);
+    free(fds);
+    return rc;
+}
+
+static int bench_metadata(int argc, char **argv) {
+    int writers = argc >= 1 ? atoi(argv[0]) : BENCH_WRITERS;
+    int ops = argc >= 2 ? atoi(argv[1]) : BENCH_METADATA_OPS;
+    if (writers < 1 || ops < 1) {
+        fprintf(stderr, "Usage: quickcache --bench metadata [writers] [keys per writer]\n");
+        return 1;
+    }
+
+    /* A scratch cache, so the real database is never touched */
+    char home[] = "/tmp/quickcache-bench-XXXXXX";
+    char dir[4096];
+    if (!mkdtemp(home)) return 1;
+    setenv("HOME", home, 1);
+    cache_get_base_dir(dir, sizeof(dir));
+    if (make_dirs(dir) == -1 || metadata_init() == -1) return 1;
+    metadata_close();
+
+    double mean[2][OP_KINDS], p99[2][OP_KINDS], rate[2];
+    int rc = 0;
+    for (int legacy = 1; legacy >= 0 && rc == 0; legacy--) {
+        rc = metadata_round(legacy, writers, ops, mean[!legacy], p99[!legacy], &rate[!legacy]);
+    }
+
+    static const char *const files[] = { "cache.db", "cache.db-wal", "cache.db-shm" };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    rmdir(home);
+
+    if (rc != 0) {
+        fprintf(stderr, "Metadata benchmark failed\n");
+        return 1;
+    }
+
+    printf("Metadata latency (%d writers x %d keys, ms per call)\n", writers, ops);
+    printf("  %-8s %20s %20s\n", "", "per-call prepare", "prepared");
+    printf("  %-8s %9s %10s %9s %10s\n", "op", "mean", "p99", "mean", "p99");
+    for (int op = 0; op < OP_KINDS; op++) {
+        printf("  %-8s %9.3f %10.3f %9.3f %10.3f\n", op_names[op],
+               mean[0][op], p99[0][op], mean[1][op], p99[1][op]);
+    }
+    printf("  %-8s %20.0f %20.0f\n", "calls/s", rate[0], rate[1]);
+    return 0;
+}
+
+/* ---------- INDEX ---------- */
+/* Hit-path lookups against a cache of the given size: through SQLite as
+ * the schema stands, and through the mmap'd index. */
+#define BENCH_INDEX_ENTRIES 1000000
+#define BENCH_INDEX_LOOKUPS 200000
+
+static void bench_hash_hex(uint64_t i, char hex[HASH_HEX_SIZE]) {
+    snprintf(hex, HASH_HEX_SIZE, "%016llx%048llx",
+             (unsigned long long)(i * 0x9E3779B97F4A7C15ULL), (unsigned long long)i);
+}
+
+/* Lookups per second for random existing keys */
+static double index_round(uint64_t entries, int direct, int *failed) {
+    unsigned seed = 1;
+    double start = now_ms();
+    for (int i = 0; i < BENCH_INDEX_LOOKUPS; i++) {
+        char hex[HASH_HEX_SIZE];
+        uint64_t n = ((uint64_t)rand_r(&seed) << 16 ^ (uint64_t)rand_r(&seed)) % entries;
+        bench_hash_hex(n, hex);
+
+        if (direct) {
+            hash_t key;
+            index_record_t rec;
+            if (hash_from_hex(hex, key) != 0 || index_lookup(key, &rec) != 0) *failed = 1;
+        } else {
+            cache_entry_t entry;
+            if (metadata_get(hex, &entry) != 0) *failed = 1;
+        }
+    }
+    return BENCH_INDEX_LOOKUPS / ((now_ms() - start) / 1000.0);
+}
+
+static int bench_index(int argc, char **argv) {
+    long long arg = argc >= 1 ? atoll(argv[0]) : BENCH_INDEX_ENTRIES;
+    if (arg < 1) {
+        fprintf(stderr, "Usage: quickcache --bench index [entries]\n");
+        return 1;
+    }
+    uint64_t entries = (uint64_t)arg;
+
+    char home[] = "/tmp/quickcache-bench-XXXXXX";
+    char dir[4096];
+    if (!mkdtemp(home)) return 1;
+    setenv("HOME", home, 1);
+    cache_get_base_dir(dir, sizeof(dir));
+    if (make_dirs(dir) == -1 || metadata_init() == -1) return 1;
+
+    int failed = 0;
+    double start = now_ms();
+    for (uint64_t i = 0; i < entries && !failed; i++) {
+        char hex[HASH_HEX_SIZE];
+        bench_hash_hex(i, hex);
+        if (i % 10000 == 0 && metadata_begin() != 0) failed = 1;
+        if (metadata_add(hex, 4096 + i % 65536, 1024 + i % 16384, 1, 3, "", 0, 0) != 0) {
+            failed = 1;
+        }
+        if ((i % 10000 == 9999 || i + 1 == entries) && metadata_commit() != 0) failed = 1;
+    }
+    double fill_ms = now_ms() - start;
+
+    double sqlite_rate = 0, index_rate = 0, get_rate = 0, build_ms = 0;
+    if (!failed) {
+        sqlite_rate = index_round(entries, 0, &failed);
+
+        start = now_ms();
+        if (index_open() != 0) failed = 1;
+        build_ms = now_ms() - start;
+    }
+    if (!failed) {
+        index_rate = index_round(entries, 1, &failed);
+        get_rate = index_round(entries, 0, &failed);
+    }
+
+    index_close();
+    metadata_close();
+
+    static const char *const files[] = {
+        "cache.db", "cache.db-wal", "cache.db-shm", INDEX_FILE_NAME, "index.lock"
+    };
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+    rmdir(home);
+
+    if (failed) {
+        fprintf(stderr, "Index benchmark failed\n");
+        return 1;
+    }
+
+    printf("Hit-path lookups (%llu entries, %d random lookups)\n",
+           (unsigned long long)entries, BENCH_INDEX_LOOKUPS);
+    printf("  %-24s %12.0f lookups/s\n", "SQLite", sqlite_rate);
+    printf("  %-24s %12.0f lookups/s\n", "index", index_rate);
+    printf("  %-24s %12.0f lookups/s\n", "metadata_get via index", get_rate);
+    printf("  fill %.0f ms, index build %.0f ms\n", fill_ms, build_ms);
+    return 0;
+}
+
+int bench_main(int argc, char **argv) {
+    if (argc >= 2 && !strcmp(argv[0], "key"))
+        return bench_key(argv + 1);
+    if (argc >= 1 && !strcmp(argv[0], "hash"))
+        return bench_hash();
+    if (argc >= 1 && !strcmp(argv[0], "metadata"))
+        return bench_metadata(argc - 1, argv + 1);
+    if (argc >= 1 && !strcmp(argv[0], "index"))
+        return bench_index(argc - 1, argv + 1);
+
+    fprintf(stderr, "Available benchmarks: key, hash, metadata, index\n");
+    return 1;
+}
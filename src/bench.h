@@ -0,0 +1,6 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int bench_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,584 @@
+#define _DEFAULT_SOURCE  // sysconf(_SC_NPROCESSORS_ONLN)
+
+#include "blake3.h"
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* BLAKE3 (https://github.com/BLAKE3-team/BLAKE3-specs), hash mode only.
+ * Inputs are split into 1 KiB chunks whose chaining values form a binary
+ * tree; chunks and parent nodes are compressed several at a time across
+ * vector lanes, and large subtrees are handed to worker threads. */
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+#define MAX_SIMD_DEGREE 16
+#define MAX_SIMD_DEGREE_OR_2 MAX_SIMD_DEGREE
+
+/* Subtrees at least this large are split across threads */
+#define MT_MIN_SUBTREE (512 * 1024)
+#define MT_MAX_THREADS 8
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t w) {
+    p[0] = (uint8_t)w;
+    p[1] = (uint8_t)(w >> 8);
+    p[2] = (uint8_t)(w >> 16);
+    p[3] = (uint8_t)(w >> 24);
+}
+
+static inline uint32_t rotr32(uint32_t w, int c) {
+    return (w >> c) | (w << (32 - c));
+}
+
+/* ---------- PORTABLE COMPRESSION ---------- */
+
+static inline void g(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+    v[a] = v[a] + v[b] + x;
+    v[d] = rotr32(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = rotr32(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = rotr32(v[b] ^ v[c], 7);
+}
+
+static void compress_pre(uint32_t v[16], const uint32_t cv[8],
+                         const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+                         uint64_t counter, uint8_t flags) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) m[i] = load32(block + 4 * i);
+
+    for (int i = 0; i < 8; i++) v[i] = cv[i];
+    for (int i = 0; i < 4; i++) v[8 + i] = IV[i];
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = block_len;
+    v[15] = flags;
+
+#pragma GCC unroll 7
+    for (int r = 0; r < 7; r++) {
+        const uint8_t *s = MSG_SCHEDULE[r];
+        g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+}
+
+static void compress_in_place(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                              uint8_t block_len, uint64_t counter, uint8_t flags) {
+    uint32_t v[16];
+    compress_pre(v, cv, block, block_len, counter, flags);
+    for (int i = 0; i < 8; i++) cv[i] = v[i] ^ v[i + 8];
+}
+
+static void hash_one_portable(const uint8_t *input, size_t blocks, const uint32_t key[8],
+                              uint64_t counter, uint8_t flags, uint8_t flags_start,
+                              uint8_t flags_end, uint8_t out[BLAKE3_OUT_LEN]) {
+    uint32_t cv[8];
+    memcpy(cv, key, sizeof(cv));
+    uint8_t block_flags = flags | flags_start;
+    while (blocks > 0) {
+        if (blocks == 1) block_flags |= flags_end;
+        compress_in_place(cv, input, BLAKE3_BLOCK_LEN, counter, block_flags);
+        input += BLAKE3_BLOCK_LEN;
+        blocks--;
+        block_flags = flags;
+    }
+    for (int i = 0; i < 8; i++) store32(out + 4 * i, cv[i]);
+}
+
+static void hash_many_portable(const uint8_t *const *inputs, size_t num_inputs, size_t blocks,
+                               const uint32_t key[8], uint64_t counter, int increment_counter,
+                               uint8_t flags, uint8_t flags_start, uint8_t flags_end,
+                               uint8_t *out) {
+    while (num_inputs > 0) {
+        hash_one_portable(inputs[0], blocks, key, counter, flags, flags_start, flags_end, out);
+        if (increment_counter) counter++;
+        inputs++;
+        num_inputs--;
+        out += BLAKE3_OUT_LEN;
+    }
+}
+
+/* ---------- VECTOR LANES ---------- */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+/* 4 lanes: SSE2 is part of the x86-64 baseline, NEON of AArch64 */
+#define B3_LANES 4
+#define B3_VEC b3_vec4
+#define B3_HASH_MANY hash_many_x4
+#define B3_TARGET
+#include "blake3_lanes.h"
+#undef B3_LANES
+#undef B3_VEC
+#undef B3_HASH_MANY
+#undef B3_TARGET
+
+#if defined(__x86_64__)
+#define B3_LANES 8
+#define B3_VEC b3_vec8
+#define B3_HASH_MANY hash_many_avx2
+#define B3_TARGET __attribute__((target("avx2")))
+#include "blake3_lanes.h"
+#undef B3_LANES
+#undef B3_VEC
+#undef B3_HASH_MANY
+#undef B3_TARGET
+
+#define B3_LANES 16
+#define B3_VEC b3_vec16
+#define B3_HASH_MANY hash_many_avx512
+#define B3_TARGET __attribute__((target("avx512f")))
+#include "blake3_lanes.h"
+#undef B3_LANES
+#undef B3_VEC
+#undef B3_HASH_MANY
+#undef B3_TARGET
+#endif
+
+#endif
+
+typedef void (*hash_many_fn)(const uint8_t *const *, size_t, size_t, const uint32_t *,
+                             uint64_t, int, uint8_t, uint8_t, uint8_t, uint8_t *);
+
+static hash_many_fn hash_many_impl = NULL;
+static size_t simd_degree = 1;
+static const char *simd_name = "portable";
+static int max_threads = 0;
+
+/* Pick the widest lane count the CPU supports. Racing callers compute the
+ * same answer, so no locking is needed. */
+static void detect_backend(void) {
+    if (hash_many_impl) return;
+
+    hash_many_fn impl = hash_many_portable;
+    size_t degree = 1;
+    const char *name = "portable";
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        impl = hash_many_avx512; degree = 16; name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        impl = hash_many_avx2; degree = 8; name = "avx2";
+    } else {
+        impl = hash_many_x4; degree = 4; name = "sse2";
+    }
+#elif defined(__GNUC__) && defined(__aarch64__)
+    impl = hash_many_x4; degree = 4; name = "neon";
+#endif
+
+    simd_degree = degree;
+    simd_name = name;
+    hash_many_impl = impl;
+}
+
+size_t blake3_simd_degree(void) {
+    detect_backend();
+    return simd_degree;
+}
+
+const char *blake3_simd_name(void) {
+    detect_backend();
+    return simd_name;
+}
+
+/* 0 picks one thread per online CPU (capped); 1 disables threading */
+void blake3_set_max_threads(int threads) {
+    max_threads = threads;
+}
+
+static int thread_budget(void) {
+    if (max_threads > 0) return max_threads;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > MT_MAX_THREADS ? MT_MAX_THREADS : (int)n;
+}
+
+/* ---------- CHUNKS AND NODES ---------- */
+
+typedef struct {
+    uint32_t input_cv[8];
+    uint64_t counter;
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t flags;
+} output_t;
+
+static void chunk_state_init(blake3_chunk_state *self, const uint32_t key[8], uint8_t flags) {
+    memcpy(self->cv, key, sizeof(self->cv));
+    self->chunk_counter = 0;
+    memset(self->buf, 0, sizeof(self->buf));
+    self->buf_len = 0;
+    self->blocks_compressed = 0;
+    self->flags = flags;
+}
+
+static void chunk_state_reset(blake3_chunk_state *self, const uint32_t key[8], uint64_t counter) {
+    chunk_state_init(self, key, self->flags);
+    self->chunk_counter = counter;
+}
+
+static size_t chunk_state_len(const blake3_chunk_state *self) {
+    return BLAKE3_BLOCK_LEN * (size_t)self->blocks_compressed + self->buf_len;
+}
+
+static uint8_t chunk_state_start_flag(const blake3_chunk_state *self) {
+    return self->blocks_compressed == 0 ? CHUNK_START : 0;
+}
+
+static size_t chunk_state_fill_buf(blake3_chunk_state *self, const uint8_t *input, size_t len) {
+    size_t take = BLAKE3_BLOCK_LEN - self->buf_len;
+    if (take > len) take = len;
+    memcpy(self->buf + self->buf_len, input, take);
+    self->buf_len += (uint8_t)take;
+    return take;
+}
+
+static void chunk_state_update(blake3_chunk_state *self, const uint8_t *input, size_t len) {
+    if (self->buf_len > 0) {
+        size_t take = chunk_state_fill_buf(self, input, len);
+        input += take;
+        len -= take;
+        if (len > 0) {
+            compress_in_place(self->cv, self->buf, BLAKE3_BLOCK_LEN, self->chunk_counter,
+                              self->flags | chunk_state_start_flag(self));
+            self->blocks_compressed++;
+            self->buf_len = 0;
+            memset(self->buf, 0, sizeof(self->buf));
+        }
+    }
+
+    while (len > BLAKE3_BLOCK_LEN) {
+        compress_in_place(self->cv, input, BLAKE3_BLOCK_LEN, self->chunk_counter,
+                          self->flags | chunk_state_start_flag(self));
+        self->blocks_compressed++;
+        input += BLAKE3_BLOCK_LEN;
+        len -= BLAKE3_BLOCK_LEN;
+    }
+
+    chunk_state_fill_buf(self, input, len);
+}
+
+static output_t chunk_state_output(const blake3_chunk_state *self) {
+    output_t o;
+    memcpy(o.input_cv, self->cv, sizeof(o.input_cv));
+    memcpy(o.block, self->buf, sizeof(o.block));
+    o.block_len = self->buf_len;
+    o.counter = self->chunk_counter;
+    o.flags = self->flags | chunk_state_start_flag(self) | CHUNK_END;
+    return o;
+}
+
+static output_t parent_output(const uint8_t block[BLAKE3_BLOCK_LEN], const uint32_t key[8],
+                              uint8_t flags) {
+    output_t o;
+    memcpy(o.input_cv, key, sizeof(o.input_cv));
+    memcpy(o.block, block, sizeof(o.block));
+    o.block_len = BLAKE3_BLOCK_LEN;
+    o.counter = 0;
+    o.flags = flags | PARENT;
+    return o;
+}
+
+static void output_chaining_value(const output_t *o, uint8_t cv[BLAKE3_OUT_LEN]) {
+    uint32_t words[8];
+    memcpy(words, o->input_cv, sizeof(words));
+    compress_in_place(words, o->block, o->block_len, o->counter, o->flags);
+    for (int i = 0; i < 8; i++) store32(cv + 4 * i, words[i]);
+}
+
+static void output_root_bytes(const output_t *o, uint8_t out[BLAKE3_OUT_LEN]) {
+    uint32_t v[16];
+    compress_pre(v, o->input_cv, o->block, o->block_len, 0, o->flags | ROOT);
+    for (int i = 0; i < 8; i++) store32(out + 4 * i, v[i] ^ v[i + 8]);
+}
+
+/* ---------- SUBTREES ---------- */
+
+static size_t round_down_to_power_of_2(uint64_t x) {
+    uint64_t p = 1;
+    while (p <= x / 2) p *= 2;
+    return (size_t)p;
+}
+
+/* Largest power-of-two number of whole chunks strictly less than the input */
+static size_t left_subtree_len(size_t input_len) {
+    size_t full_chunks = (input_len - 1) / BLAKE3_CHUNK_LEN;
+    return round_down_to_power_of_2(full_chunks) * BLAKE3_CHUNK_LEN;
+}
+
+static size_t compress_chunks_parallel(const uint8_t *input, size_t input_len,
+                                       const uint32_t key[8], uint64_t chunk_counter,
+                                       uint8_t flags, uint8_t *out) {
+    const uint8_t *chunks[MAX_SIMD_DEGREE];
+    size_t n = 0;
+    size_t pos = 0;
+    while (input_len - pos >= BLAKE3_CHUNK_LEN) {
+        chunks[n++] = input + pos;
+        pos += BLAKE3_CHUNK_LEN;
+    }
+
+    hash_many_impl(chunks, n, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, key, chunk_counter, 1,
+                   flags, CHUNK_START, CHUNK_END, out);
+
+    if (input_len > pos) {
+        blake3_chunk_state cs;
+        chunk_state_init(&cs, key, flags);
+        cs.chunk_counter = chunk_counter + n;
+        chunk_state_update(&cs, input + pos, input_len - pos);
+        output_t o = chunk_state_output(&cs);
+        output_chaining_value(&o, out + n * BLAKE3_OUT_LEN);
+        return n + 1;
+    }
+    return n;
+}
+
+static size_t compress_parents_parallel(const uint8_t *child_cvs, size_t num_cvs,
+                                        const uint32_t key[8], uint8_t flags, uint8_t *out) {
+    const uint8_t *parents[MAX_SIMD_DEGREE_OR_2];
+    size_t n = 0;
+    while (num_cvs - 2 * n >= 2) {
+        parents[n] = child_cvs + 2 * n * BLAKE3_OUT_LEN;
+        n++;
+    }
+
+    hash_many_impl(parents, n, 1, key, 0, 0, flags | PARENT, 0, 0, out);
+
+    /* An odd child left over passes through to the next level */
+    if (num_cvs > 2 * n) {
+        memcpy(out + n * BLAKE3_OUT_LEN, child_cvs + 2 * n * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+        return n + 1;
+    }
+    return n;
+}
+
+typedef struct {
+    const uint8_t *input;
+    size_t input_len;
+    const uint32_t *key;
+    uint64_t chunk_counter;
+    uint8_t flags;
+    uint8_t *out;
+    int threads;
+    size_t result;
+} subtree_job_t;
+
+static size_t compress_subtree_wide(const uint8_t *input, size_t input_len,
+                                    const uint32_t key[8], uint64_t chunk_counter,
+                                    uint8_t flags, uint8_t *out, int threads);
+
+static void *subtree_thread(void *arg) {
+    subtree_job_t *job = arg;
+    job->result = compress_subtree_wide(job->input, job->input_len, job->key,
+                                        job->chunk_counter, job->flags, job->out, job->threads);
+    return NULL;
+}
+
+/* Hash a whole-chunk-aligned subtree down to at most simd_degree chaining
+ * values (at least 2 when the input spans more than one chunk). Halves of
+ * big subtrees run on separate threads; the result does not depend on how
+ * the work was split. */
+static size_t compress_subtree_wide(const uint8_t *input, size_t input_len,
+                                    const uint32_t key[8], uint64_t chunk_counter,
+                                    uint8_t flags, uint8_t *out, int threads) {
+    if (input_len <= simd_degree * BLAKE3_CHUNK_LEN) {
+        return compress_chunks_parallel(input, input_len, key, chunk_counter, flags, out);
+    }
+
+    size_t left_len = left_subtree_len(input_len);
+    size_t right_len = input_len - left_len;
+    uint64_t right_counter = chunk_counter + left_len / BLAKE3_CHUNK_LEN;
+
+    uint8_t cv_array[2 * MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
+    size_t degree = simd_degree;
+    if (left_len > BLAKE3_CHUNK_LEN && degree == 1) degree = 2;
+    uint8_t *right_cvs = cv_array + degree * BLAKE3_OUT_LEN;
+
+    size_t left_n, right_n;
+    subtree_job_t left = { input, left_len, key, chunk_counter, flags, cv_array, threads / 2, 0 };
+    pthread_t tid;
+
+    if (threads > 1 && left_len >= MT_MIN_SUBTREE &&
+        pthread_create(&tid, NULL, subtree_thread, &left) == 0) {
+        right_n = compress_subtree_wide(input + left_len, right_len, key, right_counter,
+                                        flags, right_cvs, threads - threads / 2);
+        pthread_join(tid, NULL);
+        left_n = left.result;
+    } else {
+        left_n = compress_subtree_wide(input, left_len, key, chunk_counter, flags,
+                                       cv_array, 1);
+        right_n = compress_subtree_wide(input + left_len, right_len, key, right_counter,
+                                        flags, right_cvs, 1);
+    }
+
+    /* With a single lane each side yields one CV; return both unmerged so
+     * the caller always gets a pair. */
+    if (left_n == 1) {
+        memcpy(out, cv_array, 2 * BLAKE3_OUT_LEN);
+        return 2;
+    }
+
+    return compress_parents_parallel(cv_array, left_n + right_n, key, flags, out);
+}
+
+static void compress_subtree_to_parent_node(const uint8_t *input, size_t input_len,
+                                            const uint32_t key[8], uint64_t chunk_counter,
+                                            uint8_t flags, uint8_t out[2 * BLAKE3_OUT_LEN]) {
+    uint8_t cv_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN];
+    int threads = input_len >= 2 * MT_MIN_SUBTREE ? thread_budget() : 1;
+    size_t num_cvs = compress_subtree_wide(input, input_len, key, chunk_counter, flags,
+                                           cv_array, threads);
+
+    uint8_t out_array[MAX_SIMD_DEGREE_OR_2 * BLAKE3_OUT_LEN / 2];
+    while (num_cvs > 2) {
+        num_cvs = compress_parents_parallel(cv_array, num_cvs, key, flags, out_array);
+        memcpy(cv_array, out_array, num_cvs * BLAKE3_OUT_LEN);
+    }
+    memcpy(out, cv_array, 2 * BLAKE3_OUT_LEN);
+}
+
+/* ---------- HASHER ---------- */
+
+/* Merge completed subtrees lazily: after total_chunks chunks the stack
+ * holds one CV per set bit. The newest CV is kept unmerged because it may
+ * turn out to be the root. */
+static void hasher_merge_cv_stack(blake3_hasher *self, uint64_t total_chunks) {
+    size_t post_merge_len = (size_t)__builtin_popcountll(total_chunks);
+    while (self->cv_stack_len > post_merge_len) {
+        uint8_t *parent = self->cv_stack + (self->cv_stack_len - 2) * BLAKE3_OUT_LEN;
+        output_t o = parent_output(parent, self->key, self->chunk.flags);
+        output_chaining_value(&o, parent);
+        self->cv_stack_len--;
+    }
+}
+
+static void hasher_push_cv(blake3_hasher *self, const uint8_t cv[BLAKE3_OUT_LEN],
+                           uint64_t chunk_counter) {
+    hasher_merge_cv_stack(self, chunk_counter);
+    memcpy(self->cv_stack + self->cv_stack_len * BLAKE3_OUT_LEN, cv, BLAKE3_OUT_LEN);
+    self->cv_stack_len++;
+}
+
+void blake3_hasher_init(blake3_hasher *self) {
+    detect_backend();
+    memcpy(self->key, IV, sizeof(self->key));
+    chunk_state_init(&self->chunk, IV, 0);
+    self->cv_stack_len = 0;
+}
+
+void blake3_hasher_update(blake3_hasher *self, const void *input, size_t input_len) {
+    const uint8_t *in = input;
+    if (input_len == 0) return;
+
+    /* Finish a partially filled chunk first */
+    if (chunk_state_len(&self->chunk) > 0) {
+        size_t take = BLAKE3_CHUNK_LEN - chunk_state_len(&self->chunk);
+        if (take > input_len) take = input_len;
+        chunk_state_update(&self->chunk, in, take);
+        in += take;
+        input_len -= take;
+        if (input_len == 0) return;
+
+        output_t o = chunk_state_output(&self->chunk);
+        uint8_t cv[BLAKE3_OUT_LEN];
+        output_chaining_value(&o, cv);
+        hasher_push_cv(self, cv, self->chunk.chunk_counter);
+        chunk_state_reset(&self->chunk, self->key, self->chunk.chunk_counter + 1);
+    }
+
+    /* Hash the largest aligned power-of-two subtrees directly from the
+     * caller's buffer, keeping at least one byte back for the final chunk. */
+    while (input_len > BLAKE3_CHUNK_LEN) {
+        size_t subtree_len = round_down_to_power_of_2(input_len);
+        uint64_t count_so_far = self->chunk.chunk_counter * BLAKE3_CHUNK_LEN;
+        while (((uint64_t)(subtree_len - 1) & count_so_far) != 0) subtree_len /= 2;
+        uint64_t subtree_chunks = subtree_len / BLAKE3_CHUNK_LEN;
+
+        if (subtree_len <= BLAKE3_CHUNK_LEN) {
+            blake3_chunk_state cs;
+            chunk_state_init(&cs, self->key, self->chunk.flags);
+            cs.chunk_counter = self->chunk.chunk_counter;
+            chunk_state_update(&cs, in, subtree_len);
+            output_t o = chunk_state_output(&cs);
+            uint8_t cv[BLAKE3_OUT_LEN];
+            output_chaining_value(&o, cv);
+            hasher_push_cv(self, cv, cs.chunk_counter);
+        } else {
+            uint8_t cv_pair[2 * BLAKE3_OUT_LEN];
+            compress_subtree_to_parent_node(in, subtree_len, self->key,
+                                            self->chunk.chunk_counter, self->chunk.flags,
+                                            cv_pair);
+            hasher_push_cv(self, cv_pair, self->chunk.chunk_counter);
+            hasher_push_cv(self, cv_pair + BLAKE3_OUT_LEN,
+                           self->chunk.chunk_counter + subtree_chunks / 2);
+        }
+        self->chunk.chunk_counter += subtree_chunks;
+        in += subtree_len;
+        input_len -= subtree_len;
+    }
+
+    if (input_len > 0) {
+        chunk_state_update(&self->chunk, in, input_len);
+        hasher_merge_cv_stack(self, self->chunk.chunk_counter);
+    }
+}
+
+void blake3_hasher_finalize(const blake3_hasher *self, uint8_t out[BLAKE3_OUT_LEN]) {
+    if (self->cv_stack_len == 0) {
+        output_t o = chunk_state_output(&self->chunk);
+        output_root_bytes(&o, out);
+        return;
+    }
+
+    /* Roll the final chunk (or the top pair of subtrees, when the input
+     * ended on a subtree boundary) up through every CV left on the stack */
+    output_t o;
+    size_t remaining;
+    if (chunk_state_len(&self->chunk) > 0) {
+        remaining = self->cv_stack_len;
+        o = chunk_state_output(&self->chunk);
+    } else {
+        remaining = self->cv_stack_len - 2;
+        o = parent_output(self->cv_stack + remaining * BLAKE3_OUT_LEN, self->key,
+                          self->chunk.flags);
+    }
+    while (remaining > 0) {
+        remaining--;
+        uint8_t block[BLAKE3_BLOCK_LEN];
+        memcpy(block, self->cv_stack + remaining * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+        output_chaining_value(&o, block + BLAKE3_OUT_LEN);
+        o = parent_output(block, self->key, self->chunk.flags);
+    }
+    output_root_bytes(&o, out);
+}
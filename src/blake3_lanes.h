@@ -0,0 +1,96 @@
+/* Multi-lane BLAKE3 compression, instantiated by blake3.c once per vector
+ * width. Each lane hashes a different input (a whole chunk, or a parent
+ * node) so the 7-round permutation runs on B3_LANES words at a time; GCC
+ * vector extensions lower to SSE2/AVX2/AVX-512/NEON depending on B3_TARGET.
+ *
+ * Expects: B3_LANES, B3_VEC (type name), B3_HASH_MANY (function name),
+ * B3_TARGET (function attribute, may be empty). No include guard. */
+
+typedef uint32_t B3_VEC __attribute__((vector_size(4 * B3_LANES)));
+
+#define B3_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define B3_G(a, b, c, d, mx, my)                                   \
+    do {                                                            \
+        v[a] = v[a] + v[b] + (mx); v[d] = B3_ROTR(v[d] ^ v[a], 16); \
+        v[c] = v[c] + v[d];        v[b] = B3_ROTR(v[b] ^ v[c], 12); \
+        v[a] = v[a] + v[b] + (my); v[d] = B3_ROTR(v[d] ^ v[a], 8);  \
+        v[c] = v[c] + v[d];        v[b] = B3_ROTR(v[b] ^ v[c], 7);  \
+    } while (0)
+
+B3_TARGET
+static void B3_HASH_MANY(const uint8_t *const *inputs, size_t num_inputs, size_t blocks,
+                         const uint32_t key[8], uint64_t counter, int increment_counter,
+                         uint8_t flags, uint8_t flags_start, uint8_t flags_end,
+                         uint8_t *out) {
+    while (num_inputs >= B3_LANES) {
+        B3_VEC h[8];
+        for (int i = 0; i < 8; i++)
+            h[i] = (B3_VEC){0} + key[i];
+
+        uint32_t lo[B3_LANES], hi[B3_LANES];
+        for (int l = 0; l < B3_LANES; l++) {
+            uint64_t c = counter + (increment_counter ? (uint64_t)l : 0);
+            lo[l] = (uint32_t)c;
+            hi[l] = (uint32_t)(c >> 32);
+        }
+        B3_VEC ctr_lo, ctr_hi;
+        memcpy(&ctr_lo, lo, sizeof(ctr_lo));
+        memcpy(&ctr_hi, hi, sizeof(ctr_hi));
+
+        uint8_t block_flags = flags | flags_start;
+        for (size_t b = 0; b < blocks; b++) {
+            if (b + 1 == blocks) block_flags |= flags_end;
+
+            /* Transpose: word j of every lane's block into one vector */
+            B3_VEC m[16];
+            for (int j = 0; j < 16; j++) {
+                uint32_t w[B3_LANES];
+                for (int l = 0; l < B3_LANES; l++)
+                    w[l] = load32(inputs[l] + b * BLAKE3_BLOCK_LEN + 4 * j);
+                memcpy(&m[j], w, sizeof(m[j]));
+            }
+
+            B3_VEC v[16];
+            for (int i = 0; i < 8; i++) v[i] = h[i];
+            for (int i = 0; i < 4; i++) v[8 + i] = (B3_VEC){0} + IV[i];
+            v[12] = ctr_lo;
+            v[13] = ctr_hi;
+            v[14] = (B3_VEC){0} + (uint32_t)BLAKE3_BLOCK_LEN;
+            v[15] = (B3_VEC){0} + (uint32_t)block_flags;
+
+            for (int r = 0; r < 7; r++) {
+                const uint8_t *s = MSG_SCHEDULE[r];
+                B3_G(0, 4, 8, 12, m[s[0]], m[s[1]]);
+                B3_G(1, 5, 9, 13, m[s[2]], m[s[3]]);
+                B3_G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+                B3_G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+                B3_G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+                B3_G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+                B3_G(2, 7, 8, 13, m[s[12]], m[s[13]]);
+                B3_G(3, 4, 9, 14, m[s[14]], m[s[15]]);
+            }
+
+            for (int i = 0; i < 8; i++) h[i] = v[i] ^ v[i + 8];
+            block_flags = flags;
+        }
+
+        for (int i = 0; i < 8; i++) {
+            uint32_t w[B3_LANES];
+            memcpy(w, &h[i], sizeof(w));
+            for (int l = 0; l < B3_LANES; l++)
+                store32(out + l * BLAKE3_OUT_LEN + 4 * i, w[l]);
+        }
+
+        inputs += B3_LANES;
+        num_inputs -= B3_LANES;
+        if (increment_counter) counter += B3_LANES;
+        out += B3_LANES * BLAKE3_OUT_LEN;
+    }
+
+    hash_many_portable(inputs, num_inputs, blocks, key, counter, increment_counter,
+                       flags, flags_start, flags_end, out);
+}
+
+#undef B3_G
+#undef B3_ROTR
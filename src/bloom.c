@@ -0,0 +1,243 @@
+#define _POSIX_C_SOURCE 200809L  // ftruncate, mmap, pthread_rwlock
+
+#include "bloom.h"
+#include "cache.h"
+#include "config.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Keys known to be in the remote cache, as a Bloom filter in one mmap'd
+ * file shared by every process. A key goes in whenever the server shows
+ * it has the object: a GET or HEAD that found it, an accepted PUT, or a
+ * batch answer. Bits are only ever set, with atomic ORs, so nobody
+ * locks. A false positive (about 1 in 2000 at capacity) skips an upload
+ * that was needed. The server may also evict what it once had. So the
+ * filter is started afresh, by the first process to open it, once it is
+ * full, once it is remote_filter_days old, or when remote_url changes.
+ * A process that keeps running, like the daemon, looks again every
+ * minute, and moves to the new file if another process replaced it. */
+
+#define BLOOM_FILE "remote.bloom"
+#define BLOOM_MAGIC 0x4d4c4251u  /* "QBLM" */
+#define BLOOM_VERSION 1
+#define BLOOM_BITS (1u << 23)    /* 1 MB */
+#define BLOOM_PROBES 7
+#define BLOOM_CAPACITY 500000
+#define BLOOM_RECHECK_SECONDS 60
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t created;
+    uint64_t url_id;   /* of the remote_url the keys were seen at */
+    uint64_t keys;     /* distinct keys added, near enough */
+    uint32_t reserved[8];
+} bloom_header_t;
+
+typedef struct {
+    bloom_header_t header;
+    uint64_t words[BLOOM_BITS / 64];
+} bloom_file_t;
+
+static bloom_file_t *bloom_map = NULL;
+static int bloom_unavailable = 0;
+static ino_t bloom_ino = 0;        /* of the file mapped */
+static time_t bloom_checked = 0;
+
+/* Held for reading around each use of bloom_map, and for writing to
+ * swap in a new one */
+static pthread_rwlock_t bloom_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void get_bloom_path(char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/%s", cache_dir, BLOOM_FILE);
+}
+
+static uint64_t url_id(void) {
+    const char *url = config_get()->remote_url;
+    hash_t digest;
+    uint64_t id = 0;
+    if (hash_data(url, strlen(url), digest) == 0) memcpy(&id, digest, sizeof(id));
+    return id;
+}
+
+static int is_current(const bloom_file_t *file, uint64_t url) {
+    int64_t max_age = (int64_t)config_get()->remote_filter_days * 86400;
+    return file->header.magic == BLOOM_MAGIC && file->header.version == BLOOM_VERSION &&
+           file->header.url_id == url && file->header.keys < BLOOM_CAPACITY &&
+           (int64_t)time(NULL) - file->header.created < max_age;
+}
+
+static bloom_file_t *map_file(int fd, ino_t *ino) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bloom_file_t)) return NULL;
+    void *map = mmap(NULL, sizeof(bloom_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return NULL;
+    *ino = st.st_ino;
+    return map;
+}
+
+/* Write an empty filter and rename it over path. Two processes doing
+ * this at once each end up with a filter; the one left on disk wins. */
+static bloom_file_t *bloom_create(const char *path, uint64_t url, ino_t *ino) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        char cache_dir[4096];
+        cache_get_base_dir(cache_dir, sizeof(cache_dir));
+        make_dirs(cache_dir);
+        fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) return NULL;
+
+    bloom_file_t *file = ftruncate(fd, sizeof(bloom_file_t)) == 0 ? map_file(fd, ino) : NULL;
+    close(fd);
+    if (!file) {
+        unlink(tmp);
+        return NULL;
+    }
+
+    file->header.version = BLOOM_VERSION;
+    file->header.created = (int64_t)time(NULL);
+    file->header.url_id = url;
+    file->header.magic = BLOOM_MAGIC;
+    if (rename(tmp, path) != 0) {
+        munmap(file, sizeof(*file));
+        unlink(tmp);
+        return NULL;
+    }
+    return file;
+}
+
+/* Map the filter on disk, or a new one where that is missing or no
+ * longer current */
+static bloom_file_t *open_filter(const char *path, uint64_t url, ino_t *ino) {
+    bloom_file_t *file = NULL;
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd != -1) {
+        file = map_file(fd, ino);
+        close(fd);
+    }
+    if (file && !is_current(file, url)) {
+        munmap(file, sizeof(*file));
+        file = NULL;
+    }
+    if (!file) file = bloom_create(path, url, ino);
+    return file;
+}
+
+int bloom_init(void) {
+    if (bloom_map) return 0;
+    if (bloom_unavailable) return -1;
+    if (config_get()->remote_filter_days <= 0) {
+        bloom_unavailable = 1;
+        return -1;
+    }
+
+    char path[4096];
+    get_bloom_path(path, sizeof(path));
+    bloom_file_t *file = open_filter(path, url_id(), &bloom_ino);
+    if (!file) {
+        bloom_unavailable = 1;
+        return -1;
+    }
+
+    bloom_checked = time(NULL);
+    bloom_map = file;
+    return 0;
+}
+
+/* Every BLOOM_RECHECK_SECONDS, one caller checks that the mapped filter
+ * is still current and still the one on disk, and remaps if not. On
+ * failure the old filter stays in use until the next check. */
+static void bloom_recheck(void) {
+    time_t now = time(NULL);
+    time_t checked = __atomic_load_n(&bloom_checked, __ATOMIC_RELAXED);
+    if (now - checked < BLOOM_RECHECK_SECONDS) return;
+    if (!__atomic_compare_exchange_n(&bloom_checked, &checked, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    /* Only this thread replaces bloom_map, so it reads it unlocked */
+    char path[4096];
+    struct stat st;
+    uint64_t url = url_id();
+    get_bloom_path(path, sizeof(path));
+    if (stat(path, &st) == 0 && st.st_ino == bloom_ino && is_current(bloom_map, url)) return;
+
+    ino_t ino;
+    bloom_file_t *file = open_filter(path, url, &ino);
+    if (!file) return;
+
+    pthread_rwlock_wrlock(&bloom_lock);
+    bloom_file_t *old = bloom_map;
+    bloom_map = file;
+    bloom_ino = ino;
+    pthread_rwlock_unlock(&bloom_lock);
+    munmap(old, sizeof(*old));
+}
+
+/* In a child forked from a threaded process, another thread may have
+ * held the lock at the fork; the child has only this one */
+void bloom_after_fork(void) {
+    pthread_rwlock_init(&bloom_lock, NULL);
+}
+
+/* Keys are cryptographic digests, so their bytes are already uniform
+ * and two words of the key serve as the double-hashing pair */
+static void probes(const hash_t key, uint32_t *bits) {
+    uint64_t h1, h2;
+    memcpy(&h1, key, sizeof(h1));
+    memcpy(&h2, key + sizeof(h1), sizeof(h2));
+    h2 |= 1;
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        bits[i] = (uint32_t)((h1 + (uint64_t)i * h2) % BLOOM_BITS);
+    }
+}
+
+void bloom_add(const hash_t key) {
+    if (bloom_init() == -1) return;
+    bloom_recheck();
+
+    uint32_t bits[BLOOM_PROBES];
+    probes(key, bits);
+    pthread_rwlock_rdlock(&bloom_lock);
+    uint64_t added = 0;
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t mask = 1ull << (bits[i] % 64);
+        added |= ~__atomic_fetch_or(&bloom_map->words[bits[i] / 64], mask, __ATOMIC_RELAXED) & mask;
+    }
+    if (added) __atomic_fetch_add(&bloom_map->header.keys, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&bloom_lock);
+}
+
+/* 1 if the key is (almost certainly) in the remote cache, 0 if it is
+ * not known to be */
+int bloom_contains(const hash_t key) {
+    if (bloom_init() == -1) return 0;
+    bloom_recheck();
+
+    uint32_t bits[BLOOM_PROBES];
+    probes(key, bits);
+    int found = 1;
+    pthread_rwlock_rdlock(&bloom_lock);
+    for (int i = 0; i < BLOOM_PROBES && found; i++) {
+        uint64_t word = __atomic_load_n(&bloom_map->words[bits[i] / 64], __ATOMIC_RELAXED);
+        found = (word & (1ull << (bits[i] % 64))) != 0;
+    }
+    pthread_rwlock_unlock(&bloom_lock);
+    return found;
+}
@@ -0,0 +1,11 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include "hash.h"
+
+int bloom_init(void);
+void bloom_after_fork(void);
+void bloom_add(const hash_t key);
+int bloom_contains(const hash_t key);
+
+#endif
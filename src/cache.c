@@ -1,14 +1,23 @@
+#define _DEFAULT_SOURCE  // utimes
+
 #include <unistd.h>
 #include "cache.h"
+#include "config.h"
 #include "utils.h"
 #include "metadata.h"
 #include <unistd.h>
 #include "compress.h"
+#include "dict.h"
+#include "index.h"
 #include "stats.h"
+#include "trace.h"
 #include "network.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 void cache_get_base_dir(char *buf, size_t len) {
     char home[4096];
@@ -31,6 +40,11 @@ int cache_init(void) {
         return -1;
     }
 
+    /* Optional; without it every lookup goes to SQLite */
+    if (config_get()->index) {
+        index_open();
+    }
+
     if (stats_init() == -1) {
         return -1;
     }
@@ -55,6 +69,185 @@ void cache_get_object_path(const hash_t key, char *buf, size_t len) {
     snprintf(buf, len, "%s/objects/%.2s/%s", cache_dir, hex, hex + 2);
 }
 
+/* Stores fold the access log once it holds about this many bytes */
+#define ACCESS_LOG_FOLD_SIZE (64 * 1024)
+
+/* ---------- OBJECT STORAGE ---------- */
+/* Objects this large are compressed at compression_fast_level while a
+ * build waits on the store, and recompressed later (cache_recompress). */
+#define ADAPTIVE_MIN_SIZE (1024 * 1024)
+
+/* Level for a store on the critical path of a compile */
+static int store_level(size_t original_size) {
+    const quickcache_config_t *cfg = config_get();
+    if (original_size >= ADAPTIVE_MIN_SIZE && cfg->compression_fast_level < cfg->compression_level) {
+        return cfg->compression_fast_level;
+    }
+    return cfg->compression_level;
+}
+
+/* Write src into the store under cache_path: compressed when that saves
+ * at least 10%, otherwise as a plain copy (reflinked when possible) that
+ * later hits can share. Small objects use the toolchain's dictionary when
+ * one has been trained. Objects are made read-only so a hardlinked output
+ * cannot be used to modify them in place. A level of 0 stores
+ * uncompressed. compile_ms is what producing it cost, 0 if unknown. */
+static int store_object(const char *hex, const char *cache_path, const char *src,
+                        size_t original_size, int level, const char *toolchain,
+                        uint32_t compile_ms) {
+    char cache_path_tmp[4096];
+    size_t compressed_size = 0;
+    uint32_t dict = 0;
+
+    temp_path(cache_path, "tmp", cache_path_tmp, sizeof(cache_path_tmp));
+    if (level != 0 && original_size <= DICT_MAX_OBJECT) {
+        dict = dict_for_toolchain(toolchain);
+    }
+
+    if (level != 0 && compress_file(src, cache_path_tmp, level, dict, &compressed_size) == 0) {
+        if (compressed_size < original_size * 0.9) {
+            chmod(cache_path_tmp, 0444);
+            metadata_add(hex, original_size, compressed_size, 1, level, toolchain, dict,
+                         compile_ms);
+            if (rename(cache_path_tmp, cache_path) != 0) {
+                metadata_delete(hex);
+                unlink(cache_path_tmp);
+                return -1;
+            }
+            return 0;
+        }
+        unlink(cache_path_tmp);
+    }
+
+    if (reflink_file(src, cache_path_tmp) != 0 && copy_file(src, cache_path_tmp) != 0) {
+        unlink(cache_path_tmp);
+        return -1;
+    }
+    chmod(cache_path_tmp, 0444);
+    /* The entry goes in before the object appears: a lookup that finds a
+     * plain object without one drops it as unknown */
+    metadata_add(hex, original_size, original_size, 0, 0, toolchain, 0, compile_ms);
+    if (rename(cache_path_tmp, cache_path) != 0) {
+        metadata_delete(hex);
+        unlink(cache_path_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Put an uncompressed object at output_path using the cheapest method
+ * the configuration allows. Returns the method used, or -1. */
+static int materialize(const char *cache_path, const char *output_path) {
+    materialize_t mode = config_get()->materialize;
+
+    /* Never write through an existing file: it may be a link to the store */
+    if (unlink(output_path) != 0 && errno != ENOENT) return -1;
+
+    if (mode != MATERIALIZE_COPY && reflink_file(cache_path, output_path) == 0) {
+        return HIT_REFLINK;
+    }
+
+    if (mode == MATERIALIZE_HARDLINK && link(cache_path, output_path) == 0) {
+        /* The link carries the object's old mtime; make it look freshly
+         * built so make does not consider it stale. */
+        utimes(output_path, NULL);
+        return HIT_HARDLINK;
+    }
+
+    if (copy_file(cache_path, output_path) == 0) {
+        return HIT_COPY;
+    }
+    return -1;
+}
+
+/* Take an object fetched from the remote cache at fetch_path into the
+ * store, writing it to output_path too unless that is NULL. Remote blobs
+ * are whatever the uploader had in its store: a compressed object or the
+ * raw output. A compressed blob is kept as-is as the local object and
+ * decompressed to the output, after fetching its dictionary if it needs
+ * one we do not have; a raw one is moved to the output and stored like
+ * a fresh compile. Returns the uncompressed size, or -1. fetch_path is
+ * gone afterwards either way. */
+static long long ingest_remote(const char *hex, const char *cache_path, const char *fetch_path,
+                               const char *output_path) {
+    struct stat fetched;
+    if (stat(fetch_path, &fetched) != 0) return -1;
+
+    if (compress_is_compressed(fetch_path)) {
+        uint32_t dict_id = compress_dict_id(fetch_path);
+        if (dict_id && dict_fetch_remote(dict_id) != 0) {
+            unlink(fetch_path);
+            return -1;
+        }
+
+        long long size = output_path ? 0 : (long long)compress_uncompressed_size(fetch_path);
+        if (size == 0) {
+            /* Decompress to learn the size, where the header has none */
+            char raw_path[4096];
+            if (!output_path) temp_path(cache_path, "raw", raw_path, sizeof(raw_path));
+            const char *dst = output_path ? output_path : raw_path;
+
+            unlink(dst);
+            struct stat st;
+            if (decompress_file(fetch_path, dst) != 0 || stat(dst, &st) != 0) {
+                unlink(fetch_path);
+                if (!output_path) unlink(raw_path);
+                return -1;
+            }
+            size = st.st_size;
+            if (!output_path) unlink(raw_path);
+        }
+
+        chmod(fetch_path, 0444);
+        /* The uploader's level is unknown; let recompression decide */
+        metadata_add(hex, size, fetched.st_size, 1, 0, NULL, dict_id, 0);
+        if (rename(fetch_path, cache_path) != 0) {
+            metadata_delete(hex);
+            unlink(fetch_path);
+        }
+        return size;
+    }
+
+    if (!output_path) {
+        int r = store_object(hex, cache_path, fetch_path, fetched.st_size,
+                             store_level(fetched.st_size), NULL, 0);
+        unlink(fetch_path);
+        return r == 0 ? fetched.st_size : -1;
+    }
+
+    unlink(output_path);
+    if (rename(fetch_path, output_path) != 0) {
+        /* Output on another filesystem */
+        int r = copy_file(fetch_path, output_path);
+        unlink(fetch_path);
+        if (r != 0) return -1;
+    }
+
+    store_object(hex, cache_path, output_path, fetched.st_size, store_level(fetched.st_size),
+                 NULL, 0);
+    return fetched.st_size;
+}
+
+static int fetch_remote(const hash_t key, const char *hex, const char *cache_path,
+                        const char *output_path) {
+    char fetch_path[4096];
+    temp_path(cache_path, "fetch", fetch_path, sizeof(fetch_path));
+
+    if (!config_get()->remote_enabled) return -1;
+
+    uint64_t t = stats_clock_ns();
+    trace_begin("network_get", key);
+    int r = network_get(key, fetch_path);
+    trace_end("network_get");
+    stats_phase_add(PHASE_NETWORK_GET, stats_clock_ns() - t);
+    if (r != 0) return -1;
+
+    long long size = ingest_remote(hex, cache_path, fetch_path, output_path);
+    if (size < 0) return -1;
+    stats_record_hit(size);
+    return 0;
+}
+
 int cache_lookup(const hash_t key, const char *output_path) {
     char cache_path[4096];
     char hex[HASH_HEX_SIZE];
@@ -65,64 +258,72 @@ int cache_lookup(const hash_t key, const char *output_path) {
     // L1 Cache: Try local first
     if (file_exists(cache_path)) {
         cache_entry_t entry;
-        if (metadata_get(hex, &entry) == 0) {
-            metadata_update_access(hex);
-
-            if (entry.compressed) {
-                if (decompress_file(cache_path, output_path) == 0) {
-                    stats_record_hit(entry.size);
-                    printf("[quickcache] LOCAL HIT\n");
-                    return 0;
+        uint32_t compile_ms = 0;
+        uint64_t t = stats_clock_ns();
+        trace_begin("metadata", key);
+        int found = metadata_get(hex, &entry);
+        trace_end("metadata");
+        stats_phase_add(PHASE_METADATA, stats_clock_ns() - t);
+        if (found == 0) {
+            metadata_record_access(&entry);
+            compile_ms = entry.compile_ms;
+        } else if (compress_is_compressed(cache_path)) {
+            /* The index lost the entry (a power loss drops the last few
+             * writes) but the header says what the object is */
+            memset(&entry, 0, sizeof(entry));
+            entry.compressed = 1;
+            entry.size = compress_uncompressed_size(cache_path);
+        } else {
+            /* A plain file without an entry could be anything; drop it */
+            unlink(cache_path);
+            goto remote;
+        }
+
+        if (entry.compressed) {
+            unlink(output_path);
+            t = stats_clock_ns();
+            trace_begin("decompress", key);
+            int r = decompress_file(cache_path, output_path);
+            trace_end("decompress");
+            stats_phase_add(PHASE_MATERIALIZE, stats_clock_ns() - t);
+            if (r == 0) {
+                if (found != 0) {
+                    struct stat st;
+                    if (stat(output_path, &st) == 0) entry.size = st.st_size;
+                    if (stat(cache_path, &st) == 0) {
+                        metadata_add(hex, entry.size, st.st_size, 1, 0, NULL,
+                                     compress_dict_id(cache_path), 0);
+                    }
                 }
-                return -1;
+                stats_record_local_hit(entry.size, HIT_DECOMPRESS, compile_ms);
+                printf("[quickcache] LOCAL HIT\n");
+                return 0;
             }
+            stats_record_error(STAT_ERROR_LOCAL);
+            return -1;
         }
 
-        if (copy_file(cache_path, output_path) == 0) {
+        t = stats_clock_ns();
+        trace_begin("materialize", key);
+        int method = materialize(cache_path, output_path);
+        trace_end("materialize");
+        stats_phase_add(PHASE_MATERIALIZE, stats_clock_ns() - t);
+        if (method != -1) {
             struct stat st;
             if (stat(output_path, &st) == 0) {
-                stats_record_hit(st.st_size);
+                stats_record_local_hit(st.st_size, (hit_method_t)method, compile_ms);
             }
             printf("[quickcache] LOCAL HIT\n");
             return 0;
         }
+        stats_record_error(STAT_ERROR_LOCAL);
     }
 
+remote:
     // L2 Cache: Try remote
     printf("[quickcache] Checking remote cache...\n");
-    if (network_get(key, output_path) == 0) {
+    if (fetch_remote(key, hex, cache_path, output_path) == 0) {
         printf("[quickcache] REMOTE HIT\n");
-        
-        // Store in local cache for next time
-        struct stat st;
-        if (stat(output_path, &st) == 0) {
-            size_t original_size = st.st_size;
-            size_t compressed_size = 0;
-            int compressed = 0;
-            char cache_path_tmp[4096];
-            
-            snprintf(cache_path_tmp, sizeof(cache_path_tmp), "%s.tmp", cache_path);
-            
-            if (compress_file(output_path, cache_path_tmp, &compressed_size) == 0) {
-                if (compressed_size < original_size * 0.9) {
-                    rename(cache_path_tmp, cache_path);
-                    compressed = 1;
-                    metadata_add(hex, cache_path, original_size, compressed_size, 1);
-                } else {
-                    unlink(cache_path_tmp);
-                }
-            }
-            
-            if (!compressed) {
-                if (copy_file(output_path, cache_path) == 0) {
-                    compressed_size = original_size;
-                    metadata_add(hex, cache_path, original_size, compressed_size, 0);
-                }
-            }
-            
-            stats_record_hit(original_size);
-        }
-        
         return 0;
     }
 
@@ -130,50 +331,141 @@ int cache_lookup(const hash_t key, const char *output_path) {
     return -1;
 }
 
-int cache_store(const hash_t key, const char *file_path) {
+int cache_store(const hash_t key, const char *file_path, const char *toolchain,
+                uint32_t compile_ms) {
     char cache_path[4096];
-    char cache_path_tmp[4096];
     char hex[HASH_HEX_SIZE];
 
     hash_to_hex(key, hex);
     cache_get_object_path(key, cache_path, sizeof(cache_path));
-    snprintf(cache_path_tmp, sizeof(cache_path_tmp), "%s.tmp", cache_path);
 
     struct stat st;
     if (stat(file_path, &st) != 0) {
         return -1;
     }
 
-    size_t original_size = st.st_size;
-    size_t compressed_size = 0;
-    int compressed = 0;
-
     // Store locally with compression
-    if (compress_file(file_path, cache_path_tmp, &compressed_size) == 0) {
-        if (compressed_size < original_size * 0.9) {
-            rename(cache_path_tmp, cache_path);
-            compressed = 1;
-            metadata_add(hex, cache_path, original_size, compressed_size, 1);
-        } else {
-            unlink(cache_path_tmp);
-        }
+    if (store_object(hex, cache_path, file_path, st.st_size, store_level(st.st_size),
+                     toolchain, compile_ms) != 0) {
+        stats_record_error(STAT_ERROR_LOCAL);
+        return -1;
     }
 
-    if (!compressed) {
-        if (copy_file(file_path, cache_path) != 0) {
-            return -1;
-        }
-        compressed_size = original_size;
-        metadata_add(hex, cache_path, original_size, compressed_size, 0);
-    }
+    // A store already writes to the database; apply pending access times
+    // while at it, so the log stays small without a daemon
+    metadata_fold_access(ACCESS_LOG_FOLD_SIZE);
 
     // Upload to remote cache (async)
     printf("[quickcache] Uploading to remote cache...\n");
+    trace_begin("upload_queue", key);
     network_put_async(key, cache_path);
+    trace_end("upload_queue");
 
     return 0;
 }
 
+/* ---------- PREFETCH ---------- */
+/* Keys asked for per batch request */
+#define PREFETCH_BATCH 512
+
+static void prefetch_object(const hash_t key, const char *path, void *arg) {
+    int *fetched = arg;
+    char hex[HASH_HEX_SIZE], cache_path[4096];
+    hash_to_hex(key, hex);
+    cache_get_object_path(key, cache_path, sizeof(cache_path));
+    if (ingest_remote(hex, cache_path, path, NULL) >= 0) (*fetched)++;
+}
+
+/* Pull the given keys from the remote cache into the local one, in
+ * batches, so a build starting afterwards finds them locally. Keys
+ * already stored are skipped. Returns the number fetched, or -1 if the
+ * remote cache is off or unreachable. */
+int cache_prefetch(const hash_t *keys, int count) {
+    if (!config_get()->remote_enabled) return -1;
+
+    char tmp_path[4096], cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(tmp_path, sizeof(tmp_path), "%s/objects/.prefetch.%d", cache_dir, (int)getpid());
+
+    hash_t *missing = malloc((size_t)(count > 0 ? count : 1) * sizeof(hash_t));
+    if (!missing) return -1;
+
+    int wanted = 0;
+    for (int i = 0; i < count; i++) {
+        char cache_path[4096];
+        cache_get_object_path(keys[i], cache_path, sizeof(cache_path));
+        if (!file_exists(cache_path)) memcpy(missing[wanted++], keys[i], HASH_SIZE);
+    }
+
+    int fetched = 0, failed = 0;
+    for (int i = 0; i < wanted; i += PREFETCH_BATCH) {
+        int n = wanted - i < PREFETCH_BATCH ? wanted - i : PREFETCH_BATCH;
+        trace_begin("prefetch_batch", NULL);
+        if (network_get_batch(missing + i, n, tmp_path, prefetch_object, &fetched) < 0) failed = 1;
+        trace_end("prefetch_batch");
+    }
+    free(missing);
+
+    return failed && fetched == 0 && wanted > 0 ? -1 : fetched;
+}
+
+/* ---------- RECOMPRESSION ---------- */
+/* Rewrite one compressed object at the given level, keeping the new copy
+ * only if it is smaller. The level is recorded either way so the entry
+ * is not revisited. */
+static int recompress_object(const cache_entry_t *entry, int level) {
+    char cache_dir[4096];
+    char path[4096], raw_path[4096], new_path[4096];
+
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(path, sizeof(path), "%s/objects/%.2s/%s", cache_dir, entry->hash, entry->hash + 2);
+    temp_path(path, "raw", raw_path, sizeof(raw_path));
+    temp_path(path, "new", new_path, sizeof(new_path));
+
+    size_t new_size = 0;
+    if (decompress_file(path, raw_path) != 0) return -1;
+    int rc = compress_file(raw_path, new_path, level, entry->dict_id, &new_size);
+    unlink(raw_path);
+    if (rc != 0) {
+        unlink(new_path);
+        return -1;
+    }
+
+    if (new_size < entry->compressed_size) {
+        chmod(new_path, 0444);
+        if (rename(new_path, path) != 0) {
+            unlink(new_path);
+            return -1;
+        }
+        return metadata_set_compression(entry->hash, new_size, level);
+    }
+
+    unlink(new_path);
+    return metadata_set_compression(entry->hash, entry->compressed_size, level);
+}
+
+/* Bring up to limit (0 = all) objects stored at a faster level up to
+ * compression_level. Returns how many entries were examined, so callers
+ * know when nothing is left. */
+int cache_recompress(int limit) {
+    int level = config_get()->compression_level;
+    if (level == 0) return 0;
+
+    cache_entry_t *entries;
+    int count;
+    if (metadata_get_recompress_candidates(level, limit, &entries, &count) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        recompress_object(&entries[i], level);
+    }
+
+    free(entries);
+    return count;
+}
+
 void cache_shutdown(void) {
+    index_close();
     network_cleanup();
 }
@@ -1,15 +1,20 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdint.h>
 #include "hash.h"
 
 #define CACHE_DIR_NAME ".quickcache"
+#define DEFAULT_CACHE_LIMIT (1024ULL * 1024 * 1024)
 
 int cache_init(void);
 void cache_get_base_dir(char *buf, size_t len);
 void cache_get_object_path(const hash_t key, char *buf, size_t len);
 int cache_lookup(const hash_t key, const char *output_path);
-int cache_store(const hash_t key, const char *file_path);
+int cache_store(const hash_t key, const char *file_path, const char *toolchain,
+                uint32_t compile_ms);
+int cache_prefetch(const hash_t *keys, int count);
+int cache_recompress(int limit);
 void cache_shutdown(void);
 
 #endif
@@ -1,7 +1,10 @@
 #include "clean.h"
 #include "cache.h"
+#include "config.h"
 #include "metadata.h"
+#include "stats.h"
 #include "utils.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +13,29 @@
 #include <unistd.h>
 #include <time.h>
 
+/* Metadata deletes are committed in batches: one WAL commit per batch
+ * instead of per entry, without holding the write lock long enough to
+ * stall concurrent builds. */
+#define DELETE_BATCH 256
+
+static _Thread_local int batch_pending = 0;  /* on this thread's connection */
+
+static void batch_delete(const char *hash) {
+    if (batch_pending == 0) metadata_begin();
+    metadata_delete(hash);
+    if (++batch_pending == DELETE_BATCH) {
+        metadata_commit();
+        batch_pending = 0;
+    }
+}
+
+static void batch_flush(void) {
+    if (batch_pending > 0) {
+        metadata_commit();
+        batch_pending = 0;
+    }
+}
+
 static int remove_cache_object(const char *hash) {
     char path[4096];
     char cache_dir[4096];
@@ -17,8 +43,9 @@ static int remove_cache_object(const char *hash) {
     cache_get_base_dir(cache_dir, sizeof(cache_dir));
     snprintf(path, sizeof(path), "%s/objects/%.2s/%s", cache_dir, hash, hash + 2);
     
-    if (unlink(path) == 0) {
-        metadata_delete(hash);
+    /* An entry whose object is already gone is dropped all the same */
+    if (unlink(path) == 0 || errno == ENOENT) {
+        batch_delete(hash);
         return 0;
     }
     
@@ -56,7 +83,7 @@ int cache_clean_all(void) {
             snprintf(hash, sizeof(hash), "%s%s", entry->d_name, file->d_name);
             
             if (unlink(filepath) == 0) {
-                metadata_delete(hash);
+                batch_delete(hash);
                 removed++;
             }
         }
@@ -64,6 +91,7 @@ int cache_clean_all(void) {
         rmdir(subdir);
     }
     closedir(d);
+    batch_flush();
     
     printf("Removed %d cache entries\n", removed);
     return 0;
@@ -105,7 +133,7 @@ int cache_clean_old(int days) {
                 snprintf(hash, sizeof(hash), "%s%s", entry->d_name, file->d_name);
                 
                 if (unlink(filepath) == 0) {
-                    metadata_delete(hash);
+                    batch_delete(hash);
                     removed++;
                 }
             }
@@ -113,40 +141,68 @@ int cache_clean_old(int days) {
         closedir(sd);
     }
     closedir(d);
+    batch_flush();
     
     printf("Removed %d old cache entries\n", removed);
     return 0;
 }
 
+/* Entries read per eviction round; bounds memory whatever the cache size */
+#define EVICT_BATCH 256
+
+/* Nothing happens until the cache grows past max_bytes (the high-water
+ * mark, a read of one counter). It is then brought down to
+ * eviction_low_water percent of that, in eviction_policy order, a batch
+ * at a time, so the next few stores do not each evict again. */
 int cache_enforce_limit(size_t max_bytes) {
     uint64_t total = metadata_total_size();
     
     if (total <= max_bytes) {
         return 0;
     }
+
+    /* Evict by up-to-date access times */
+    metadata_fold_access(0);
     
-    size_t to_free = total - max_bytes;
-    
-    cache_entry_t *entries;
-    int count;
-    
-    if (metadata_get_lru_entries(&entries, &count, total) != 0) {
-        return -1;
-    }
+    eviction_policy_t policy = config_get()->eviction_policy;
+    int low_water = config_get()->eviction_low_water;
+    if (low_water < 1 || low_water > 100) low_water = 90;
+    uint64_t target = (uint64_t)max_bytes / 100 * low_water;
     
-    size_t freed = 0;
+    uint64_t freed = 0;
     int removed = 0;
     
-    for (int i = 0; i < count && freed < to_free; i++) {
-        if (remove_cache_object(entries[i].hash) == 0) {
-            freed += entries[i].compressed_size;
-            removed++;
+    while (total > target) {
+        cache_entry_t *entries;
+        int count;
+        
+        if (metadata_get_eviction_candidates(policy, EVICT_BATCH, &entries, &count) != 0) {
+            return -1;
+        }
+        
+        int batch_removed = 0;
+        const cache_entry_t *last = NULL;
+        for (int i = 0; i < count && total > target; i++) {
+            if (remove_cache_object(entries[i].hash) == 0) {
+                freed += entries[i].compressed_size;
+                total -= entries[i].compressed_size < total ? entries[i].compressed_size : total;
+                batch_removed++;
+                last = &entries[i];
+            }
         }
+        
+        if (policy == EVICT_GDSF && last) metadata_advance_clock(last);
+        batch_flush();
+        free(entries);
+        removed += batch_removed;
+        
+        /* Empty, or only objects that cannot be removed are left */
+        if (batch_removed == 0) break;
+        total = metadata_total_size();
     }
     
-    free(entries);
-    
     if (removed > 0) {
+        stats_record_eviction(removed, freed);
         printf("Evicted %d entries to enforce size limit (%.2f MB freed)\n", 
                removed, freed / (1024.0 * 1024.0));
     }
@@ -1,107 +1,294 @@
+#define _DEFAULT_SOURCE  // O_CLOEXEC, posix_fallocate, sysconf(_SC_NPROCESSORS_ONLN)
+
 #include "compress.h"
+#include "config.h"
+#include "dict.h"
+#include "hash.h"
+#include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <zstd.h>
 
-#define CHUNK_SIZE (128 * 1024)
+#define ZSTD_FRAME_MAGIC 0xFD2FB528u
+#define COMPRESS_MAX_THREADS 8
+
+static int read_header(const file_view_t *in, object_header_t *header) {
+    if (in->len < sizeof(*header)) return -1;
+    memcpy(header, in->data, sizeof(*header));
+    return header->magic == OBJECT_MAGIC ? 0 : -1;
+}
 
-int compress_file(const char *src, const char *dst, size_t *compressed_size) {
-    FILE *fin = fopen(src, "rb");
-    if (!fin) return -1;
+static int worker_count(void) {
+    int threads = config_get()->compression_threads;
+    if (threads > 0) return threads;
 
-    FILE *fout = fopen(dst, "wb");
-    if (!fout) {
-        fclose(fin);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    return n > COMPRESS_MAX_THREADS ? COMPRESS_MAX_THREADS : (int)n;
+}
+
+int compress_file(const char *src, const char *dst, int level, uint32_t dict_id,
+                  size_t *compressed_size) {
+    file_view_t in;
+    if (file_view_open(src, &in) == -1) return -1;
+
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        file_view_close(&in);
         return -1;
     }
 
+    ZSTD_CDict *cdict = dict_id ? dict_cdict(dict_id, level) : NULL;
     ZSTD_CCtx *cctx = ZSTD_createCCtx();
-    if (!cctx) {
-        fclose(fin);
-        fclose(fout);
+    size_t out_cap = ZSTD_CStreamOutSize();
+    unsigned char *out_buf = malloc(out_cap);
+    if (!cctx || !out_buf || (dict_id && !cdict)) {
+        ZSTD_freeCCtx(cctx);
+        free(out_buf);
+        file_view_close(&in);
+        close(fd);
         return -1;
     }
 
-    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, in.len);
+    if (cdict) ZSTD_CCtx_refCDict(cctx, cdict);
+
+    /* Big debug objects are split into jobs compressed in parallel. This
+     * fails harmlessly on a libzstd built without threading. */
+    if (in.len >= COMPRESS_MT_THRESHOLD && worker_count() > 1) {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, worker_count());
+    }
 
-    size_t total_compressed = 0;
-    unsigned char in_buf[CHUNK_SIZE];
-    unsigned char out_buf[ZSTD_compressBound(CHUNK_SIZE)];
+    object_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = OBJECT_MAGIC;
+    header.version = OBJECT_VERSION;
+    header.hash_algo = (uint8_t)hash_get_algorithm();
+    header.flags = OBJECT_FLAG_CHECKSUM;
+    header.uncompressed_size = in.len;
+    header.dict_id = dict_id;
 
-    size_t n;
-    while ((n = fread(in_buf, 1, sizeof(in_buf), fin)) > 0) {
-        size_t compressed = ZSTD_compressCCtx(cctx, out_buf, sizeof(out_buf), in_buf, n, 3);
-        
-        if (ZSTD_isError(compressed)) {
-            ZSTD_freeCCtx(cctx);
-            fclose(fin);
-            fclose(fout);
-            return -1;
-        }
+    size_t total_compressed = sizeof(header);
+    int rc = write_all(fd, &header, sizeof(header));
 
-        if (fwrite(out_buf, 1, compressed, fout) != compressed) {
-            ZSTD_freeCCtx(cctx);
-            fclose(fin);
-            fclose(fout);
-            return -1;
+    /* The whole input is one frame, so later blocks can reference
+     * matches anywhere earlier in the object. */
+    ZSTD_inBuffer input = { in.data, in.len, 0 };
+    size_t remaining = 1;
+    while (rc == 0 && remaining != 0) {
+        ZSTD_outBuffer output = { out_buf, out_cap, 0 };
+        remaining = ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_end);
+        if (ZSTD_isError(remaining) || write_all(fd, out_buf, output.pos) == -1) {
+            rc = -1;
+            break;
         }
-
-        total_compressed += compressed;
+        total_compressed += output.pos;
     }
 
     ZSTD_freeCCtx(cctx);
-    fclose(fin);
-    fclose(fout);
+    free(out_buf);
+    file_view_close(&in);
+    if (close(fd) != 0) rc = -1;
 
-    if (compressed_size) {
+    if (rc == 0 && compressed_size) {
         *compressed_size = total_compressed;
     }
 
-    return 0;
+    return rc;
 }
 
-int decompress_file(const char *src, const char *dst) {
-    FILE *fin = fopen(src, "rb");
-    if (!fin) return -1;
+typedef int (*decode_sink_t)(const void *data, size_t len, void *arg);
 
-    FILE *fout = fopen(dst, "wb");
-    if (!fout) {
-        fclose(fin);
-        return -1;
+/* Decode the frames of an object into sink. header is NULL for legacy
+ * objects, which are bare frames without a dictionary. */
+static int decode_frames(const file_view_t *in, const object_header_t *header,
+                         decode_sink_t sink, void *arg) {
+    ZSTD_DDict *ddict = NULL;
+    if (header && header->dict_id) {
+        ddict = dict_ddict(header->dict_id);
+        if (!ddict) return -1;  /* dictionary not in this store */
     }
 
     ZSTD_DCtx *dctx = ZSTD_createDCtx();
-    if (!dctx) {
-        fclose(fin);
-        fclose(fout);
+    size_t out_cap = ZSTD_DStreamOutSize();
+    unsigned char *out_buf = malloc(out_cap);
+    if (!dctx || !out_buf) {
+        ZSTD_freeDCtx(dctx);
+        free(out_buf);
         return -1;
     }
+    if (ddict) ZSTD_DCtx_refDDict(dctx, ddict);
 
-    unsigned char in_buf[CHUNK_SIZE];
-    unsigned char out_buf[CHUNK_SIZE];
+    ZSTD_inBuffer input = { in->data, in->len, header ? sizeof(*header) : 0 };
+    uint64_t produced = 0;
+    size_t last = 0;
+    int rc = 0;
 
-    size_t n;
-    while ((n = fread(in_buf, 1, sizeof(in_buf), fin)) > 0) {
-        size_t decompressed = ZSTD_decompressDCtx(dctx, out_buf, sizeof(out_buf), in_buf, n);
-        
-        if (ZSTD_isError(decompressed)) {
-            ZSTD_freeDCtx(dctx);
-            fclose(fin);
-            fclose(fout);
-            return -1;
+    /* zstd checks the frame checksum itself when the frame has one */
+    while (input.pos < input.size) {
+        ZSTD_outBuffer output = { out_buf, out_cap, 0 };
+        last = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(last) || sink(out_buf, output.pos, arg) == -1) {
+            rc = -1;
+            break;
         }
+        produced += output.pos;
+    }
 
-        if (fwrite(out_buf, 1, decompressed, fout) != decompressed) {
-            ZSTD_freeDCtx(dctx);
-            fclose(fin);
-            fclose(fout);
-            return -1;
+    /* Flush output still buffered inside the last frame */
+    while (rc == 0 && last != 0) {
+        ZSTD_outBuffer output = { out_buf, out_cap, 0 };
+        last = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(last) || sink(out_buf, output.pos, arg) == -1 || output.pos == 0) {
+            rc = -1;
+            break;
         }
+        produced += output.pos;
+    }
+
+    if (rc == 0 && header && produced != header->uncompressed_size) {
+        rc = -1;
     }
 
     ZSTD_freeDCtx(dctx);
-    fclose(fin);
-    fclose(fout);
+    free(out_buf);
+    return rc;
+}
+
+static int fd_sink(const void *data, size_t len, void *arg) {
+    return write_all(*(int *)arg, data, len);
+}
+
+int decompress_file(const char *src, const char *dst) {
+    file_view_t in;
+    if (file_view_open(src, &in) == -1) return -1;
 
+    object_header_t header;
+    int has_header = read_header(&in, &header) == 0;
+    if (has_header && header.version != OBJECT_VERSION) {
+        file_view_close(&in);
+        return -1;
+    }
+
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        file_view_close(&in);
+        return -1;
+    }
+
+    /* Reserve the whole output up front so it is laid out contiguously */
+    if (has_header && header.uncompressed_size > 0) {
+        posix_fallocate(fd, 0, (off_t)header.uncompressed_size);
+    }
+
+    int rc = decode_frames(&in, has_header ? &header : NULL, fd_sink, &fd);
+
+    file_view_close(&in);
+    if (close(fd) != 0) rc = -1;
+    if (rc == -1) unlink(dst);
+
+    return rc;
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} mem_sink_t;
+
+static int mem_sink(const void *data, size_t len, void *arg) {
+    mem_sink_t *m = arg;
+    if (m->len + len > m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 64 * 1024;
+        while (cap < m->len + len) cap *= 2;
+        unsigned char *p = realloc(m->data, cap);
+        if (!p) return -1;
+        m->data = p;
+        m->cap = cap;
+    }
+    memcpy(m->data + m->len, data, len);
+    m->len += len;
     return 0;
 }
+
+/* The original contents of a stored object, whether it was stored
+ * compressed or not. Returns a malloc'd buffer, or NULL. */
+void *compress_load(const char *path, size_t *len) {
+    file_view_t in;
+    if (file_view_open(path, &in) == -1) return NULL;
+
+    object_header_t header;
+    int has_header = read_header(&in, &header) == 0;
+    uint32_t magic = 0;
+    if (in.len >= sizeof(magic)) memcpy(&magic, in.data, sizeof(magic));
+
+    mem_sink_t out = { NULL, 0, 0 };
+    int rc;
+    if (has_header) {
+        rc = header.version == OBJECT_VERSION ? 0 : -1;
+        if (rc == 0 && header.uncompressed_size > 0) {
+            out.cap = header.uncompressed_size;
+            out.data = malloc(out.cap);
+            if (!out.data) rc = -1;
+        }
+        if (rc == 0) rc = decode_frames(&in, &header, mem_sink, &out);
+    } else if (magic == ZSTD_FRAME_MAGIC) {
+        rc = decode_frames(&in, NULL, mem_sink, &out);
+    } else {
+        rc = mem_sink(in.data, in.len, &out);
+    }
+    file_view_close(&in);
+
+    if (rc == 0 && !out.data) out.data = malloc(1);  /* empty object */
+    if (rc != 0 || !out.data) {
+        free(out.data);
+        return NULL;
+    }
+    *len = out.len;
+    return out.data;
+}
+
+/* Whether a file is in the store's compressed format, either with an
+ * object header or as legacy bare zstd frames. */
+int compress_is_compressed(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    uint32_t magic = 0;
+    ssize_t n = read(fd, &magic, sizeof(magic));
+    close(fd);
+
+    return n == sizeof(magic) && (magic == OBJECT_MAGIC || magic == ZSTD_FRAME_MAGIC);
+}
+
+/* The dictionary a compressed object needs, or 0 */
+uint32_t compress_dict_id(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    object_header_t header;
+    ssize_t n = read(fd, &header, sizeof(header));
+    close(fd);
+
+    if (n != sizeof(header) || header.magic != OBJECT_MAGIC) return 0;
+    return header.dict_id;
+}
+
+/* The size an object decompresses to, from its header; 0 for objects
+ * written before the header existed */
+uint64_t compress_uncompressed_size(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    object_header_t header;
+    ssize_t n = read(fd, &header, sizeof(header));
+    close(fd);
+
+    if (n != sizeof(header) || header.magic != OBJECT_MAGIC) return 0;
+    return header.uncompressed_size;
+}
@@ -2,8 +2,35 @@
 #define COMPRESS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
-int compress_file(const char *src, const char *dst, size_t *compressed_size);
+/* Compressed objects start with this header, followed by one zstd frame
+ * holding the whole file. Objects written before the header existed are
+ * bare concatenated frames and are still decoded. */
+#define OBJECT_MAGIC 0x4a424f51u  /* "QOBJ" */
+#define OBJECT_VERSION 1
+
+#define OBJECT_FLAG_CHECKSUM 0x1  /* frame carries a content checksum */
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t hash_algo;      /* hash_algo_t the entry was keyed with */
+    uint8_t flags;
+    uint64_t uncompressed_size;
+    uint32_t dict_id;       /* zstd dictionary the frame needs, or 0 */
+    uint32_t reserved;
+} object_header_t;
+
+/* Objects at least this large are compressed with zstd worker threads */
+#define COMPRESS_MT_THRESHOLD (4 * 1024 * 1024)
+
+int compress_file(const char *src, const char *dst, int level, uint32_t dict_id,
+                  size_t *compressed_size);
 int decompress_file(const char *src, const char *dst);
+void *compress_load(const char *path, size_t *len);
+int compress_is_compressed(const char *path);
+uint32_t compress_dict_id(const char *path);
+uint64_t compress_uncompressed_size(const char *path);
 
 #endif
@@ -88,6 +88,84 @@ static void parse_line(char *line) {
              strcmp(value, "1") == 0 ||
              strcmp(value, "yes") == 0 ||
              strcmp(value, "on") == 0);
+
+    } else if (strcmp(key, "daemon") == 0) {
+        global_config.daemon_enabled =
+            (strcmp(value, "true") == 0 ||
+             strcmp(value, "1") == 0 ||
+             strcmp(value, "yes") == 0 ||
+             strcmp(value, "on") == 0);
+
+    } else if (strcmp(key, "daemon_idle_timeout") == 0) {
+        global_config.daemon_idle_timeout = atoi(value);
+
+    } else if (strcmp(key, "direct_mode") == 0) {
+        global_config.direct_mode =
+            (strcmp(value, "true") == 0 ||
+             strcmp(value, "1") == 0 ||
+             strcmp(value, "yes") == 0 ||
+             strcmp(value, "on") == 0);
+
+    } else if (strcmp(key, "key_mode") == 0) {
+        global_config.key_mode = strcmp(value, "preprocessor") == 0
+            ? KEY_MODE_PREPROCESSOR : KEY_MODE_DEPENDENCIES;
+
+    } else if (strcmp(key, "hash_algorithm") == 0) {
+        global_config.hash_algorithm = strcmp(value, "sha256") == 0
+            ? HASH_ALGO_SHA256 : HASH_ALGO_BLAKE3;
+
+    } else if (strcmp(key, "materialize") == 0) {
+        if (strcmp(value, "copy") == 0)
+            global_config.materialize = MATERIALIZE_COPY;
+        else if (strcmp(value, "hardlink") == 0)
+            global_config.materialize = MATERIALIZE_HARDLINK;
+        else
+            global_config.materialize = MATERIALIZE_REFLINK;
+
+    } else if (strcmp(key, "compression_level") == 0) {
+        global_config.compression_level = atoi(value);
+
+    } else if (strcmp(key, "compression_fast_level") == 0) {
+        global_config.compression_fast_level = atoi(value);
+
+    } else if (strcmp(key, "compression_threads") == 0) {
+        global_config.compression_threads = atoi(value);
+
+    } else if (strcmp(key, "index") == 0) {
+        global_config.index =
+            (strcmp(value, "true") == 0 ||
+             strcmp(value, "1") == 0 ||
+             strcmp(value, "yes") == 0 ||
+             strcmp(value, "on") == 0);
+
+    } else if (strcmp(key, "eviction_policy") == 0) {
+        if (strcmp(value, "gdsf") == 0)
+            global_config.eviction_policy = EVICT_GDSF;
+        else if (strcmp(value, "cost") == 0)
+            global_config.eviction_policy = EVICT_COST;
+        else
+            global_config.eviction_policy = EVICT_LRU;
+
+    } else if (strcmp(key, "eviction_low_water") == 0) {
+        global_config.eviction_low_water = atoi(value);
+
+    } else if (strcmp(key, "access_granularity") == 0) {
+        global_config.access_granularity = atoi(value);
+
+    } else if (strcmp(key, "upload_concurrency") == 0) {
+        global_config.upload_concurrency = atoi(value);
+
+    } else if (strcmp(key, "upload_queue_size") == 0) {
+        global_config.upload_queue_size = atoi(value);
+
+    } else if (strcmp(key, "upload_queue_full") == 0) {
+        global_config.upload_queue_block = strcmp(value, "block") == 0;
+
+    } else if (strcmp(key, "upload_drain_ms") == 0) {
+        global_config.upload_drain_ms = atoi(value);
+
+    } else if (strcmp(key, "remote_filter_days") == 0) {
+        global_config.remote_filter_days = atoi(value);
     }
 }
 
@@ -102,6 +180,24 @@ int config_load(void) {
     global_config.timeout_seconds = 10;
     global_config.async_upload = 1;
     global_config.ignore_output_path = 0;
+    global_config.daemon_enabled = 0;
+    global_config.daemon_idle_timeout = 300;
+    global_config.direct_mode = 1;
+    global_config.key_mode = KEY_MODE_DEPENDENCIES;
+    global_config.hash_algorithm = HASH_ALGO_BLAKE3;
+    global_config.materialize = MATERIALIZE_REFLINK;
+    global_config.compression_level = 3;
+    global_config.compression_fast_level = 1;
+    global_config.compression_threads = 0;
+    global_config.index = 0;
+    global_config.eviction_policy = EVICT_LRU;
+    global_config.eviction_low_water = 90;
+    global_config.access_granularity = 3600;
+    global_config.upload_concurrency = 4;
+    global_config.upload_queue_size = 256;
+    global_config.upload_queue_block = 0;
+    global_config.upload_drain_ms = 1000;
+    global_config.remote_filter_days = 7;
 
     char config_path[4096];
     get_config_path(config_path, sizeof(config_path));
@@ -109,6 +205,7 @@ int config_load(void) {
     FILE *f = fopen(config_path, "r");
     if (!f) {
         config_loaded = 1;
+        hash_set_algorithm(global_config.hash_algorithm);
         return 0; /* Config optional */
     }
 
@@ -119,6 +216,7 @@ int config_load(void) {
 
     fclose(f);
     config_loaded = 1;
+    hash_set_algorithm(global_config.hash_algorithm);
     return 0;
 }
 
@@ -144,6 +242,24 @@ int config_create_example(void) {
     fprintf(f, "# timeout=10\n");
     fprintf(f, "# async_upload=true\n");
     fprintf(f, "# ignore_output_path=true\n");
+    fprintf(f, "# daemon=true\n");
+    fprintf(f, "# daemon_idle_timeout=300\n");
+    fprintf(f, "# direct_mode=true\n");
+    fprintf(f, "# key_mode=dependencies\n");
+    fprintf(f, "# hash_algorithm=blake3\n");
+    fprintf(f, "# materialize=reflink\n");
+    fprintf(f, "# compression_level=3\n");
+    fprintf(f, "# compression_fast_level=1\n");
+    fprintf(f, "# compression_threads=0\n");
+    fprintf(f, "# index=false\n");
+    fprintf(f, "# eviction_policy=lru\n");
+    fprintf(f, "# eviction_low_water=90\n");
+    fprintf(f, "# access_granularity=3600\n");
+    fprintf(f, "# upload_concurrency=4\n");
+    fprintf(f, "# upload_queue_size=256\n");
+    fprintf(f, "# upload_queue_full=drop\n");
+    fprintf(f, "# upload_drain_ms=1000\n");
+    fprintf(f, "# remote_filter_days=7\n");
 
     fclose(f);
     printf("Created example config at: %s\n", config_path);
@@ -1,6 +1,25 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include "hash.h"
+
+typedef enum {
+    KEY_MODE_DEPENDENCIES = 0,  /* hash the source and the headers it names */
+    KEY_MODE_PREPROCESSOR       /* hash the compiler's -E output */
+} key_mode_t;
+
+typedef enum {
+    MATERIALIZE_COPY = 0,   /* always write a private copy */
+    MATERIALIZE_REFLINK,    /* share extents when the filesystem can, else copy */
+    MATERIALIZE_HARDLINK    /* reflink, else hardlink the read-only object, else copy */
+} materialize_t;
+
+typedef enum {
+    EVICT_LRU = 0,  /* least recently used first */
+    EVICT_GDSF,     /* greedy-dual-size-frequency: small, often-hit entries stay */
+    EVICT_COST      /* least compile time saved per byte first */
+} eviction_policy_t;
+
 typedef struct {
     int remote_enabled;
     char remote_url[512];
@@ -8,6 +27,24 @@ typedef struct {
     int timeout_seconds;
     int async_upload;
     int ignore_output_path;
+    int daemon_enabled;
+    int daemon_idle_timeout;
+    int direct_mode;
+    key_mode_t key_mode;
+    hash_algo_t hash_algorithm;
+    materialize_t materialize;
+    int compression_level;
+    int compression_fast_level;
+    int compression_threads;
+    int index;  /* answer hits from the mmap'd index instead of SQLite */
+    eviction_policy_t eviction_policy;
+    int eviction_low_water;  /* percent of the limit an eviction brings the cache down to */
+    int access_granularity;  /* seconds; hits within this of the last recorded access are not logged */
+    int upload_concurrency;  /* async uploads in flight at once */
+    int upload_queue_size;   /* async uploads waiting; more are dropped or wait */
+    int upload_queue_block;  /* wait for room in a full queue instead of dropping */
+    int upload_drain_ms;     /* how long exit waits for queued uploads */
+    int remote_filter_days;  /* age at which the known-remote filter restarts; 0 turns it off */
 } quickcache_config_t;
 
 int config_load(void);
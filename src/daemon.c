@@ -0,0 +1,488 @@
+#define _DEFAULT_SOURCE  // flock(), setsid() and friends under -std=c11
+
+#include "daemon.h"
+#include "cache.h"
+#include "clean.h"
+#include "config.h"
+#include "dict.h"
+#include "metadata.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DAEMON_MAGIC 0x51434433u  /* "QCD3" */
+#define DAEMON_CONNECT_RETRIES 8
+
+/* Background maintenance starts after this long without a request */
+#define DAEMON_QUIET_MS 2000
+
+/* Requests are served by a fixed pool of threads, so a slow remote fetch
+ * or compression holds up only its own client. Connections wait in a
+ * queue for a free thread; one that finds the queue full is closed, and
+ * its client falls back to caching in-process. */
+#define DAEMON_WORKERS 16
+#define DAEMON_QUEUE 256
+
+/* A client that sends nothing, or stops reading, for this long is
+ * dropped; the client in turn waits this long beyond the remote
+ * timeouts before giving up on the server */
+#define DAEMON_IO_TIMEOUT_S 5
+
+typedef struct {
+    uint32_t magic;
+    uint32_t op;
+    hash_t key;
+    char path[4096];
+    char toolchain[DICT_TOOLCHAIN_SIZE];
+    uint32_t compile_ms;
+} daemon_request_t;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;
+} daemon_response_t;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;  /* a client, or stopping */
+static pthread_cond_t quiet_check = PTHREAD_COND_INITIALIZER;  /* for the maintenance thread */
+static int queue_fds[DAEMON_QUEUE];
+static int queue_head = 0;
+static int queue_count = 0;
+static int busy_workers = 0;
+static long last_request = 0;
+static int maintenance_pending = 1;
+
+/* Shutdown requests wake the accept loop through this pipe */
+static int wake_fds[2] = { -1, -1 };
+
+/* One eviction at a time; the others skip it */
+static pthread_mutex_t evict_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void get_daemon_path(const char *name, char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/%s", cache_dir, name);
+}
+
+static int fill_sockaddr(struct sockaddr_un *addr) {
+    char path[4096];
+    get_daemon_path(DAEMON_SOCKET_NAME, path, sizeof(path));
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void set_timeouts(int fd, int seconds) {
+    struct timeval tv = { seconds, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* ---------- SERVER ---------- */
+
+static void stop_handler(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static void handle_client(int fd) {
+    daemon_request_t req;
+    daemon_response_t resp = { DAEMON_MAGIC, -1 };
+
+    if (read_full(fd, &req, sizeof(req)) == -1 || req.magic != DAEMON_MAGIC) {
+        return;
+    }
+    req.path[sizeof(req.path) - 1] = '\0';
+    req.toolchain[sizeof(req.toolchain) - 1] = '\0';
+
+    switch (req.op) {
+    case DAEMON_OP_PING:
+        resp.status = 0;
+        break;
+    case DAEMON_OP_LOOKUP: {
+        /* A client that gives up waiting falls back to looking up or
+         * compiling in-process, so never write its output in place:
+         * finish next to it and rename it over whatever is there */
+        char tmp_path[sizeof(req.path) + 64];
+        temp_path(req.path, "daemon", tmp_path, sizeof(tmp_path));
+        trace_begin("daemon_lookup", req.key);
+        resp.status = cache_lookup(req.key, tmp_path);
+        if (resp.status == 0 && rename(tmp_path, req.path) != 0) {
+            resp.status = -1;
+        }
+        if (resp.status != 0) unlink(tmp_path);
+        trace_end("daemon_lookup");
+        stats_phase_commit(resp.status == 0 ? CLASS_HIT : CLASS_MISS);
+        break;
+    }
+    case DAEMON_OP_STORE:
+        trace_begin("daemon_store", req.key);
+        resp.status = cache_store(req.key, req.path, req.toolchain, req.compile_ms);
+        if (pthread_mutex_trylock(&evict_mutex) == 0) {
+            cache_enforce_limit(DEFAULT_CACHE_LIMIT);
+            pthread_mutex_unlock(&evict_mutex);
+        }
+        trace_end("daemon_store");
+        stats_phase_commit(CLASS_MISS);
+        break;
+    case DAEMON_OP_SHUTDOWN:
+        resp.status = 0;
+        daemon_stop = 1;
+        if (write(wake_fds[1], "", 1) == -1) {
+            /* The accept loop still notices at its next wakeup */
+        }
+        break;
+    default:
+        break;
+    }
+
+    write_full(fd, &resp, sizeof(resp));
+}
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Each worker has its own SQLite connection (see metadata.c), opened on
+ * its first request and closed when the daemon stops */
+static void *worker_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_mutex);
+    for (;;) {
+        while (queue_count == 0 && !daemon_stop) pthread_cond_wait(&queue_ready, &queue_mutex);
+        if (queue_count == 0) break;
+
+        int fd = queue_fds[queue_head];
+        queue_head = (queue_head + 1) % DAEMON_QUEUE;
+        queue_count--;
+        busy_workers++;
+        pthread_mutex_unlock(&queue_mutex);
+
+        /* Without a connection the client reads EOF and falls back */
+        if (metadata_init() == 0) handle_client(fd);
+        close(fd);
+
+        pthread_mutex_lock(&queue_mutex);
+        busy_workers--;
+        last_request = now_ms();
+        maintenance_pending = 1;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    metadata_close();
+    return NULL;
+}
+
+/* Once requests pause, spend the quiet time folding the access log and
+ * recompressing objects stored at the fast level, one per round so the
+ * connection is free again soon. This thread never serves clients, so
+ * a request arriving meanwhile goes straight to a worker. */
+static void *maintenance_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_mutex);
+    while (!daemon_stop) {
+        long quiet_for = now_ms() - last_request;
+        if (!maintenance_pending || busy_workers > 0 || queue_count > 0 ||
+            quiet_for < DAEMON_QUIET_MS) {
+            long wait_ms = quiet_for < DAEMON_QUIET_MS ? DAEMON_QUIET_MS - quiet_for : DAEMON_QUIET_MS;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += wait_ms / 1000;
+            until.tv_nsec += (wait_ms % 1000) * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&quiet_check, &queue_mutex, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        int more = 0;
+        if (metadata_init() == 0) {
+            metadata_fold_access(0);
+            more = cache_recompress(1) > 0;
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        if (!more) maintenance_pending = 0;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    metadata_close();
+    return NULL;
+}
+
+/* Serve cache requests over a Unix socket until idle for daemon_idle_timeout
+ * seconds. The server owns the SQLite database, stats and curl state for
+ * its whole lifetime so individual compiles skip cache_init() entirely.
+ * This thread only accepts connections and hands them to the workers. */
+int daemon_run(void) {
+    char cache_dir[4096];
+    char lock_path[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    get_daemon_path(DAEMON_LOCK_NAME, lock_path, sizeof(lock_path));
+
+    if (make_dirs(cache_dir) == -1) {
+        return -1;
+    }
+
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1) {
+        return -1;
+    }
+
+    /* Another server already owns the socket */
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        close(lock_fd);
+        return 0;
+    }
+
+    if (cache_init() == -1) {
+        close(lock_fd);
+        return -1;
+    }
+
+    trace_init();
+    trace_process_name("quickcache daemon");
+
+    struct sockaddr_un addr;
+    int listen_fd = -1;
+    if (fill_sockaddr(&addr) == 0 && pipe(wake_fds) == 0) {
+        unlink(addr.sun_path);
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 128) == -1) {
+        if (listen_fd != -1) close(listen_fd);
+        close(lock_fd);
+        cache_shutdown();
+        metadata_close();
+        return -1;
+    }
+    fcntl(wake_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(wake_fds[1], F_SETFD, FD_CLOEXEC);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    /* Signals are left to this thread, so they interrupt its poll() */
+    sigset_t blocked, saved;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &saved);
+
+    last_request = now_ms();
+    pthread_t workers[DAEMON_WORKERS], maintenance;
+    int started = 0;
+    while (started < DAEMON_WORKERS &&
+           pthread_create(&workers[started], NULL, worker_main, NULL) == 0) {
+        started++;
+    }
+    int maintenance_started = pthread_create(&maintenance, NULL, maintenance_main, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    const quickcache_config_t *cfg = config_get();
+    long idle_ms = cfg->daemon_idle_timeout > 0 ? cfg->daemon_idle_timeout * 1000L : -1;
+
+    while (!daemon_stop && started > 0) {
+        long timeout = -1;
+        if (idle_ms >= 0) {
+            pthread_mutex_lock(&queue_mutex);
+            long idle_for = busy_workers > 0 || queue_count > 0 ? 0 : now_ms() - last_request;
+            pthread_mutex_unlock(&queue_mutex);
+            if (idle_for >= idle_ms) break;  /* idle timeout */
+            timeout = idle_ms - idle_for;
+        }
+
+        struct pollfd pfds[2] = { { listen_fd, POLLIN, 0 }, { wake_fds[0], POLLIN, 0 } };
+        int ready = poll(pfds, 2, (int)timeout);
+        if (ready == 0) continue;
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents) break;  /* a shutdown request */
+
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1) continue;
+        set_timeouts(client_fd, DAEMON_IO_TIMEOUT_S);
+
+        pthread_mutex_lock(&queue_mutex);
+        if (queue_count < DAEMON_QUEUE) {
+            queue_fds[(queue_head + queue_count) % DAEMON_QUEUE] = client_fd;
+            queue_count++;
+            last_request = now_ms();
+            pthread_cond_signal(&queue_ready);
+            client_fd = -1;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+        if (client_fd != -1) close(client_fd);
+    }
+
+    /* Stop taking connections, then let the workers finish the queue */
+    unlink(addr.sun_path);
+    close(listen_fd);
+
+    pthread_mutex_lock(&queue_mutex);
+    daemon_stop = 1;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_cond_broadcast(&quiet_check);
+    pthread_mutex_unlock(&queue_mutex);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    if (maintenance_started) pthread_join(maintenance, NULL);
+
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    cache_shutdown();
+    metadata_close();
+    close(lock_fd);
+    return 0;
+}
+
+/* ---------- CLIENT ---------- */
+
+static int daemon_connect(void) {
+    struct sockaddr_un addr;
+    if (fill_sockaddr(&addr) == -1) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Start a detached server; the intermediate child exits at once so the
+ * server is reparented to init and never becomes our zombie. */
+static void daemon_spawn(void) {
+    fflush(NULL);
+
+    pid_t pid = fork();
+    if (pid == -1) return;
+
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) _exit(0);
+        if (chdir("/") == -1) _exit(1);
+
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull != -1) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+        _exit(daemon_run() == 0 ? 0 : 1);
+    }
+
+    waitpid(pid, NULL, 0);
+}
+
+int daemon_request(daemon_op_t op, const hash_t key, const char *path, const char *toolchain,
+                   uint32_t compile_ms) {
+    int fd = daemon_connect();
+
+    if (fd == -1 && op != DAEMON_OP_SHUTDOWN) {
+        daemon_spawn();
+
+        int delay_ms = 5;
+        for (int i = 0; i < DAEMON_CONNECT_RETRIES && fd == -1; i++) {
+            struct timespec ts = {0, delay_ms * 1000000L};
+            nanosleep(&ts, NULL);
+            delay_ms *= 2; /* Exponential backoff */
+            fd = daemon_connect();
+        }
+    }
+
+    if (fd == -1) return DAEMON_UNAVAILABLE;
+
+    /* A lookup may wait on two remote fetches (the object and its
+     * dictionary); past that the server is taken to be stuck, and the
+     * read fails so the caller falls back to caching in-process */
+    set_timeouts(fd, config_get()->timeout_seconds * 2 + DAEMON_IO_TIMEOUT_S);
+
+    daemon_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.magic = DAEMON_MAGIC;
+    req.op = op;
+    if (key) memcpy(req.key, key, HASH_SIZE);
+    if (toolchain) snprintf(req.toolchain, sizeof(req.toolchain), "%s", toolchain);
+    req.compile_ms = compile_ms;
+
+    /* The server has its own working directory, so send absolute paths */
+    if (path && path[0] != '/') {
+        char cwd[2048];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            close(fd);
+            return DAEMON_UNAVAILABLE;
+        }
+        snprintf(req.path, sizeof(req.path), "%s/%s", cwd, path);
+    } else if (path) {
+        snprintf(req.path, sizeof(req.path), "%s", path);
+    }
+
+    daemon_response_t resp;
+    if (write_full(fd, &req, sizeof(req)) == -1 ||
+        read_full(fd, &resp, sizeof(resp)) == -1 ||
+        resp.magic != DAEMON_MAGIC) {
+        close(fd);
+        return DAEMON_UNAVAILABLE;
+    }
+
+    close(fd);
+    return resp.status;
+}
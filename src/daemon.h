@@ -0,0 +1,24 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include "hash.h"
+
+#define DAEMON_SOCKET_NAME "daemon.sock"
+#define DAEMON_LOCK_NAME "daemon.lock"
+
+/* Status returned by daemon_request() when no server could be reached */
+#define DAEMON_UNAVAILABLE -2
+
+typedef enum {
+    DAEMON_OP_PING = 1,
+    DAEMON_OP_LOOKUP,
+    DAEMON_OP_STORE,
+    DAEMON_OP_SHUTDOWN
+} daemon_op_t;
+
+int daemon_run(void);
+int daemon_request(daemon_op_t op, const hash_t key, const char *path, const char *toolchain,
+                   uint32_t compile_ms);
+
+#endif
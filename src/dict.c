@@ -0,0 +1,410 @@
+#include "dict.h"
+#include "cache.h"
+#include "compress.h"
+#include "config.h"
+#include "exec.h"
+#include "hash.h"
+#include "metadata.h"
+#include "network.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zdict.h>
+
+#define DICT_SIZE (112 * 1024)                 /* zstd's default dictionary size */
+#define DICT_MIN_SAMPLES 32
+#define DICT_MAX_SAMPLES 10000
+#define DICT_SAMPLE_BUDGET (100 * DICT_SIZE)   /* bytes fed to the trainer */
+#define DICT_CACHE_SLOTS 8
+
+/* ---------- TOOLCHAIN ---------- */
+typedef struct {
+    char text[256];
+    size_t len;
+} line_buf_t;
+
+static int line_sink(const void *data, size_t len, void *arg) {
+    line_buf_t *l = arg;
+    size_t room = sizeof(l->text) - 1 - l->len;
+    if (len > room) len = room;
+    memcpy(l->text + l->len, data, len);
+    l->len += len;
+    l->text[l->len] = '\0';
+    return 0;
+}
+
+/* The compiler's default target triple from -dumpmachine, probed once per
+ * compiler binary and cached next to the include directory probes. */
+static int default_target(const char *compiler_name, char *buf, size_t len) {
+    char compiler[4096];
+    struct stat st;
+    if (resolve_compiler(compiler_name, compiler, sizeof(compiler), &st) == -1) {
+        return -1;
+    }
+
+    char ident[4200];
+    hash_t id;
+    char hex[HASH_HEX_SIZE];
+    snprintf(ident, sizeof(ident), "%s|%lld|%lld|dumpmachine", compiler,
+             (long long)st.st_size, (long long)st.st_mtime);
+    hash_data(ident, strlen(ident), id);
+    hash_to_hex(id, hex);
+
+    char cache_dir[4096];
+    char cache_path[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(cache_path, sizeof(cache_path), "%s/compilers/%s", cache_dir, hex);
+
+    char *cached = read_file(cache_path, NULL);
+    if (cached) {
+        snprintf(buf, len, "%s", cached);
+        free(cached);
+        return buf[0] ? 0 : -1;
+    }
+
+    char *probe[] = { (char *)compiler_name, "-dumpmachine", NULL };
+    line_buf_t out = { "", 0 };
+    if (execute_compiler_stream(probe, STDOUT_FILENO, line_sink, &out) != 0) {
+        return -1;
+    }
+    out.text[strcspn(out.text, "\r\n")] = '\0';
+    if (!out.text[0]) return -1;
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/compilers", cache_dir);
+    make_dirs(tmp_path);
+    temp_path(cache_path, "tmp", tmp_path, sizeof(tmp_path));
+    if (write_file(tmp_path, out.text, strlen(out.text)) == 0) {
+        rename(tmp_path, cache_path);
+    } else {
+        unlink(tmp_path);
+    }
+
+    snprintf(buf, len, "%s", out.text);
+    return 0;
+}
+
+/* "<compiler>/<target triple>", the unit dictionaries are trained for. An
+ * explicit --target or -target wins over the compiler's default. */
+int dict_toolchain(char **compiler_argv, char *buf, size_t len) {
+    const char *name = strrchr(compiler_argv[0], '/');
+    name = name ? name + 1 : compiler_argv[0];
+
+    const char *target = NULL;
+    for (int i = 1; compiler_argv[i]; i++) {
+        if (!strncmp(compiler_argv[i], "--target=", 9)) {
+            target = compiler_argv[i] + 9;
+        } else if (!strcmp(compiler_argv[i], "-target") && compiler_argv[i + 1]) {
+            target = compiler_argv[++i];
+        }
+    }
+
+    char machine[256];
+    if (!target) {
+        if (default_target(compiler_argv[0], machine, sizeof(machine)) == -1) return -1;
+        target = machine;
+    }
+
+    snprintf(buf, len, "%s/%s", name, target);
+    return 0;
+}
+
+/* ---------- DICTIONARY FILES ---------- */
+/* Dictionaries are immutable once written, so a process (the daemon in
+ * particular) keeps the few it uses loaded along with their digested
+ * zstd forms. */
+typedef struct {
+    uint32_t id;
+    void *data;
+    size_t len;
+    ZSTD_CDict *cdict;
+    int cdict_level;
+    ZSTD_DDict *ddict;
+} loaded_dict_t;
+
+/* Per thread, so a daemon thread never frees a dictionary another one
+ * is compressing with */
+static _Thread_local loaded_dict_t loaded[DICT_CACHE_SLOTS];
+static _Thread_local int next_slot = 0;
+
+static void dict_path(uint32_t id, char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/dicts/%08x.zdict", cache_dir, id);
+}
+
+static loaded_dict_t *load_dict(uint32_t id) {
+    for (int i = 0; i < DICT_CACHE_SLOTS; i++) {
+        if (loaded[i].id == id && loaded[i].data) return &loaded[i];
+    }
+
+    char path[4096];
+    size_t len = 0;
+    dict_path(id, path, sizeof(path));
+    void *data = read_file(path, &len);
+    if (!data) return NULL;
+    if (ZDICT_getDictID(data, len) != id) {
+        free(data);
+        return NULL;
+    }
+
+    loaded_dict_t *d = &loaded[next_slot];
+    next_slot = (next_slot + 1) % DICT_CACHE_SLOTS;
+    free(d->data);
+    ZSTD_freeCDict(d->cdict);
+    ZSTD_freeDDict(d->ddict);
+
+    d->id = id;
+    d->data = data;
+    d->len = len;
+    d->cdict = NULL;
+    d->cdict_level = 0;
+    d->ddict = NULL;
+    return d;
+}
+
+ZSTD_CDict *dict_cdict(uint32_t id, int level) {
+    loaded_dict_t *d = load_dict(id);
+    if (!d) return NULL;
+
+    if (d->cdict && d->cdict_level != level) {
+        ZSTD_freeCDict(d->cdict);
+        d->cdict = NULL;
+    }
+    if (!d->cdict) {
+        d->cdict = ZSTD_createCDict(d->data, d->len, level);
+        d->cdict_level = level;
+    }
+    return d->cdict;
+}
+
+ZSTD_DDict *dict_ddict(uint32_t id) {
+    loaded_dict_t *d = load_dict(id);
+    if (!d) return NULL;
+
+    if (!d->ddict) d->ddict = ZSTD_createDDict(d->data, d->len);
+    return d->ddict;
+}
+
+/* The dictionary new objects from this toolchain are compressed with, or 0 */
+uint32_t dict_for_toolchain(const char *toolchain) {
+    uint32_t id;
+    if (!toolchain || !toolchain[0] || metadata_get_dictionary(toolchain, &id) != 0) {
+        return 0;
+    }
+    return load_dict(id) ? id : 0;
+}
+
+/* ---------- REMOTE ---------- */
+/* Dictionaries are shared through the remote cache under a key derived
+ * from their ID, so a machine can decode objects compressed with a
+ * dictionary it did not train itself. */
+static void remote_key(uint32_t id, hash_t key) {
+    char name[64];
+    snprintf(name, sizeof(name), "quickcache-dict-%08x", id);
+    hash_data(name, strlen(name), key);
+}
+
+/* Make sure dictionary id is in the local store */
+int dict_fetch_remote(uint32_t id) {
+    char path[4096];
+    dict_path(id, path, sizeof(path));
+    if (file_exists(path)) return 0;
+
+    char fetch_path[4096];
+    snprintf(fetch_path, sizeof(fetch_path), "%s", path);
+    *strrchr(fetch_path, '/') = '\0';
+    make_dirs(fetch_path);
+    temp_path(path, "fetch", fetch_path, sizeof(fetch_path));
+
+    hash_t key;
+    remote_key(id, key);
+    if (network_get(key, fetch_path) != 0) return -1;
+
+    size_t len = 0;
+    void *data = read_file(fetch_path, &len);
+    int ok = data && ZDICT_getDictID(data, len) == id;
+    free(data);
+
+    chmod(fetch_path, 0444);
+    if (!ok || rename(fetch_path, path) != 0) {
+        unlink(fetch_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* ---------- TRAINING ---------- */
+typedef struct {
+    unsigned char *data;
+    size_t *sizes;
+    unsigned count;
+    size_t total;
+} sample_set_t;
+
+static int collect_samples(const char *toolchain, sample_set_t *set) {
+    cache_entry_t *entries;
+    int count;
+    if (metadata_get_dict_samples(toolchain, DICT_MAX_OBJECT, DICT_MAX_SAMPLES,
+                                  &entries, &count) != 0) {
+        return -1;
+    }
+
+    set->data = malloc(DICT_SAMPLE_BUDGET);
+    set->sizes = malloc((count > 0 ? count : 1) * sizeof(size_t));
+    set->count = 0;
+    set->total = 0;
+    if (!set->data || !set->sizes) {
+        free(entries);
+        return -1;
+    }
+
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+
+    for (int i = 0; i < count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/objects/%.2s/%s", cache_dir,
+                 entries[i].hash, entries[i].hash + 2);
+
+        size_t len;
+        void *object = compress_load(path, &len);
+        if (!object) continue;
+
+        if (len > 0 && set->total + len <= DICT_SAMPLE_BUDGET) {
+            memcpy(set->data + set->total, object, len);
+            set->sizes[set->count++] = len;
+            set->total += len;
+        }
+        free(object);
+        if (set->total + 4096 > DICT_SAMPLE_BUDGET) break;
+    }
+
+    free(entries);
+    return 0;
+}
+
+/* Compressed size of every sample, with and without the dictionary */
+static void measure(const sample_set_t *set, const void *dict, size_t dict_len, int level,
+                    size_t *plain, size_t *with_dict) {
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, dict_len, level);
+    size_t cap = ZSTD_compressBound(DICT_MAX_OBJECT);
+    void *out = malloc(cap);
+
+    *plain = 0;
+    *with_dict = 0;
+    if (cctx && cdict && out) {
+        size_t offset = 0;
+        for (unsigned i = 0; i < set->count; i++) {
+            const unsigned char *sample = set->data + offset;
+            size_t r = ZSTD_compressCCtx(cctx, out, cap, sample, set->sizes[i], level);
+            *plain += ZSTD_isError(r) ? set->sizes[i] : r;
+            r = ZSTD_compress_usingCDict(cctx, out, cap, sample, set->sizes[i], cdict);
+            *with_dict += ZSTD_isError(r) ? set->sizes[i] : r;
+            offset += set->sizes[i];
+        }
+    }
+
+    free(out);
+    ZSTD_freeCDict(cdict);
+    ZSTD_freeCCtx(cctx);
+}
+
+static int write_dict(uint32_t id, const void *dict, size_t len) {
+    char path[4096];
+    char tmp_path[4096];
+
+    dict_path(id, path, sizeof(path));
+    temp_path(path, "tmp", tmp_path, sizeof(tmp_path));
+
+    if (write_file(tmp_path, dict, len) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    chmod(tmp_path, 0444);
+    if (rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Train and install a dictionary for one toolchain. Returns 1 if one was
+ * installed, 0 if there was not enough data or it did not help. */
+static int train_toolchain(const char *toolchain, int level) {
+    sample_set_t set;
+    if (collect_samples(toolchain, &set) != 0) return -1;
+
+    int rc = 0;
+    void *dict = malloc(DICT_SIZE);
+
+    if (set.count < DICT_MIN_SAMPLES) {
+        printf("  %s: %u objects, need at least %d\n", toolchain, set.count, DICT_MIN_SAMPLES);
+    } else if (!dict) {
+        rc = -1;
+    } else {
+        size_t dict_len = ZDICT_trainFromBuffer(dict, DICT_SIZE, set.data, set.sizes, set.count);
+        if (ZDICT_isError(dict_len)) {
+            printf("  %s: training failed: %s\n", toolchain, ZDICT_getErrorName(dict_len));
+            rc = -1;
+        } else {
+            uint32_t id = ZDICT_getDictID(dict, dict_len);
+            size_t plain, with_dict;
+            measure(&set, dict, dict_len, level, &plain, &with_dict);
+
+            printf("  %s: %u objects, %.1f KB -> %.1f KB plain, %.1f KB with dictionary %08x\n",
+                   toolchain, set.count, set.total / 1024.0, plain / 1024.0,
+                   with_dict / 1024.0, id);
+
+            if (with_dict >= plain) {
+                printf("  %s: dictionary does not help, not installed\n", toolchain);
+            } else if (write_dict(id, dict, dict_len) == 0 &&
+                       metadata_set_dictionary(toolchain, id) == 0) {
+                /* Publish it before any object that needs it is uploaded */
+                char path[4096];
+                hash_t key;
+                dict_path(id, path, sizeof(path));
+                remote_key(id, key);
+                network_put(key, path);
+                rc = 1;
+            } else {
+                rc = -1;
+            }
+        }
+    }
+
+    free(dict);
+    free(set.data);
+    free(set.sizes);
+    return rc;
+}
+
+/* --train-dictionary: one dictionary per toolchain, from the most recently
+ * used small objects in the store. Objects stored from then on use it;
+ * existing objects keep whatever they were stored with. */
+int dict_train(void) {
+    char dicts_dir[4096];
+    cache_get_base_dir(dicts_dir, sizeof(dicts_dir));
+    strncat(dicts_dir, "/dicts", sizeof(dicts_dir) - strlen(dicts_dir) - 1);
+    if (make_dirs(dicts_dir) == -1) return -1;
+
+    char **toolchains;
+    int count;
+    if (metadata_get_toolchains(DICT_MAX_OBJECT, &toolchains, &count) != 0) return -1;
+
+    int level = config_get()->compression_level;
+    if (level == 0) level = ZSTD_CLEVEL_DEFAULT;
+
+    int trained = 0;
+    for (int i = 0; i < count; i++) {
+        if (train_toolchain(toolchains[i], level) == 1) trained++;
+        free(toolchains[i]);
+    }
+    free(toolchains);
+
+    return trained;
+}
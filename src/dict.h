@@ -0,0 +1,27 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zstd.h>
+
+/* Trained zstd dictionaries, one per toolchain ("<compiler>/<target
+ * triple>"). Small objects share most of their ELF headers, section names
+ * and symbol table layout with other objects from the same toolchain, so
+ * a dictionary lets them compress where they otherwise would not.
+ * Dictionaries live in the store as dicts/<id>.zdict and are never
+ * modified; retraining writes a new ID. */
+
+/* Objects larger than this gain nothing from a dictionary */
+#define DICT_MAX_OBJECT (256 * 1024)
+
+#define DICT_TOOLCHAIN_SIZE 256
+
+int dict_toolchain(char **compiler_argv, char *buf, size_t len);
+uint32_t dict_for_toolchain(const char *toolchain);
+ZSTD_CDict *dict_cdict(uint32_t id, int level);
+ZSTD_DDict *dict_ddict(uint32_t id);
+int dict_fetch_remote(uint32_t id);
+int dict_train(void);
+
+#endif
@@ -3,10 +3,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 
 #define MAX_ARGS 512
 
+/* Locate a compiler on PATH so probe caches are tied to the real binary */
+int resolve_compiler(const char *name, char *buf, size_t len, struct stat *st) {
+    if (strchr(name, '/')) {
+        snprintf(buf, len, "%s", name);
+        return stat(buf, st);
+    }
+
+    const char *path = getenv("PATH");
+    if (!path) return -1;
+
+    while (*path) {
+        const char *sep = strchr(path, ':');
+        size_t dlen = sep ? (size_t)(sep - path) : strlen(path);
+        snprintf(buf, len, "%.*s/%s", (int)dlen, path, name);
+        if (stat(buf, st) == 0 && S_ISREG(st->st_mode)) return 0;
+        if (!sep) break;
+        path = sep + 1;
+    }
+    return -1;
+}
+
 // Simple scan to see if any source file uses math functions
 static int needs_math_lib(char **argv) {
     for (int i = 1; argv[i]; i++) {
@@ -29,7 +52,9 @@ static int needs_math_lib(char **argv) {
     return 0;
 }
 
-int execute_compiler(char **argv) {
+/* Fork and exec the compiler, optionally redirecting its stdout/stderr.
+ * A negative fd leaves the corresponding stream untouched. */
+static pid_t spawn_compiler(char **argv, int stdout_fd, int stderr_fd) {
     // Check if we need -lm
     int add_math = needs_math_lib(argv);
 
@@ -51,13 +76,20 @@ int execute_compiler(char **argv) {
     }
 
     if (pid == 0) {
+        if (stdout_fd >= 0) dup2(stdout_fd, STDOUT_FILENO);
+        if (stderr_fd >= 0) dup2(stderr_fd, STDERR_FILENO);
         execvp(final_args[0], final_args);
         perror("execvp");
         exit(1);
     }
 
+    return pid;
+}
+
+static int wait_compiler(pid_t pid) {
     int status;
-    if (waitpid(pid, &status, 0) == -1) {
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno == EINTR) continue;
         perror("waitpid");
         return -1;
     }
@@ -68,3 +100,47 @@ int execute_compiler(char **argv) {
 
     return -1;
 }
+
+int execute_compiler(char **argv) {
+    pid_t pid = spawn_compiler(argv, -1, -1);
+    if (pid == -1) return -1;
+    return wait_compiler(pid);
+}
+
+/* Run the compiler and hand one of its output streams (STDOUT_FILENO or
+ * STDERR_FILENO) to sink as it arrives, without staging it in a temporary
+ * file. The other stream is discarded; callers that need diagnostics are
+ * expected to rerun the real compile to surface them. */
+int execute_compiler_stream(char **argv, int stream, exec_sink_t sink, void *arg) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    int devnull = open("/dev/null", O_WRONLY);
+    pid_t pid = stream == STDERR_FILENO
+        ? spawn_compiler(argv, devnull, fds[1])
+        : spawn_compiler(argv, fds[1], devnull);
+    close(fds[1]);
+    if (devnull != -1) close(devnull);
+
+    if (pid == -1) {
+        close(fds[0]);
+        return -1;
+    }
+
+    unsigned char buf[65536];
+    int sink_ok = 1;
+    for (;;) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        /* Keep draining after a sink error so the child never blocks */
+        if (sink_ok && sink(buf, (size_t)n, arg) == -1) sink_ok = 0;
+    }
+    close(fds[0]);
+
+    int r = wait_compiler(pid);
+    return sink_ok ? r : -1;
+}
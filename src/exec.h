@@ -1,6 +1,13 @@
 #ifndef EXEC_H
 #define EXEC_H
 
+#include <stddef.h>
+#include <sys/stat.h>
+
+typedef int (*exec_sink_t)(const void *data, size_t len, void *arg);
+
 int execute_compiler(char **argv);
+int execute_compiler_stream(char **argv, int stream, exec_sink_t sink, void *arg);
+int resolve_compiler(const char *name, char *buf, size_t len, struct stat *st);
 
 #endif
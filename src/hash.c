@@ -1,93 +1,144 @@
 #include "hash.h"
+#include "blake3.h"
+#include "utils.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
 
-int hash_file(const char *filename, hash_t out) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) return -1;
-    
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx) {
-        fclose(f);
-        return -1;
-    }
-    
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
-        EVP_MD_CTX_free(ctx);
-        fclose(f);
-        return -1;
-    }
-    
-    unsigned char buf[8192];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
-        if (!EVP_DigestUpdate(ctx, buf, n)) {
-            EVP_MD_CTX_free(ctx);
-            fclose(f);
-            return -1;
-        }
+struct hash_ctx {
+    hash_algo_t algo;
+    EVP_MD_CTX *md;
+    blake3_hasher b3;
+};
+
+static hash_algo_t current_algo = HASH_ALGO_BLAKE3;
+
+void hash_set_algorithm(hash_algo_t algo) {
+    current_algo = algo;
+}
+
+hash_algo_t hash_get_algorithm(void) {
+    return current_algo;
+}
+
+const char *hash_algorithm_name(hash_algo_t algo) {
+    return algo == HASH_ALGO_SHA256 ? "sha256" : "blake3";
+}
+
+/* ---------- BACKEND DISPATCH ---------- */
+/* Contexts live on the caller's stack; only SHA-256 needs an allocation. */
+
+static int ctx_init(struct hash_ctx *ctx, hash_algo_t algo) {
+    ctx->algo = algo;
+    ctx->md = NULL;
+
+    if (algo == HASH_ALGO_BLAKE3) {
+        blake3_hasher_init(&ctx->b3);
+        return 0;
     }
-    
-    unsigned int len;
-    if (!EVP_DigestFinal_ex(ctx, out, &len) || len != HASH_SIZE) {
-        EVP_MD_CTX_free(ctx);
-        fclose(f);
+
+    ctx->md = EVP_MD_CTX_new();
+    if (!ctx->md || !EVP_DigestInit_ex(ctx->md, EVP_sha256(), NULL)) {
+        EVP_MD_CTX_free(ctx->md);
+        ctx->md = NULL;
         return -1;
     }
-    
-    EVP_MD_CTX_free(ctx);
-    fclose(f);
     return 0;
 }
 
-int hash_data(const void *data, size_t len, hash_t out) {
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx) return -1;
-    
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
-        EVP_MD_CTX_free(ctx);
-        return -1;
+static int ctx_update(struct hash_ctx *ctx, const void *data, size_t len) {
+    if (ctx->algo == HASH_ALGO_BLAKE3) {
+        blake3_hasher_update(&ctx->b3, data, len);
+        return 0;
     }
-    
-    if (!EVP_DigestUpdate(ctx, data, len)) {
-        EVP_MD_CTX_free(ctx);
-        return -1;
+    return EVP_DigestUpdate(ctx->md, data, len) ? 0 : -1;
+}
+
+static int ctx_final(struct hash_ctx *ctx, hash_t out) {
+    if (ctx->algo == HASH_ALGO_BLAKE3) {
+        blake3_hasher_finalize(&ctx->b3, out);
+        return 0;
     }
-    
+
     unsigned int out_len;
-    if (!EVP_DigestFinal_ex(ctx, out, &out_len) || out_len != HASH_SIZE) {
-        EVP_MD_CTX_free(ctx);
+    if (!EVP_DigestFinal_ex(ctx->md, out, &out_len) || out_len != HASH_SIZE) {
         return -1;
     }
-    
-    EVP_MD_CTX_free(ctx);
     return 0;
 }
 
+static void ctx_cleanup(struct hash_ctx *ctx) {
+    EVP_MD_CTX_free(ctx->md);
+    ctx->md = NULL;
+}
+
+/* ---------- ONE-SHOT HASHING ---------- */
+
+int hash_file(const char *filename, hash_t out) {
+    file_view_t view;
+    if (file_view_open(filename, &view) == -1) return -1;
+
+    /* One update over the whole file lets BLAKE3 split it into subtrees */
+    struct hash_ctx ctx;
+    int ok = ctx_init(&ctx, current_algo) == 0 &&
+             ctx_update(&ctx, view.data, view.len) == 0 &&
+             ctx_final(&ctx, out) == 0;
+
+    ctx_cleanup(&ctx);
+    file_view_close(&view);
+    return ok ? 0 : -1;
+}
+
+int hash_data(const void *data, size_t len, hash_t out) {
+    struct hash_ctx ctx;
+    if (ctx_init(&ctx, current_algo) == -1) return -1;
+
+    int ok = ctx_update(&ctx, data, len) == 0 && ctx_final(&ctx, out) == 0;
+    ctx_cleanup(&ctx);
+    return ok ? 0 : -1;
+}
+
 int hash_combine(const hash_t h1, const hash_t h2, hash_t out) {
-    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
-    if (!ctx) return -1;
-    
-    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
-        EVP_MD_CTX_free(ctx);
-        return -1;
-    }
-    
-    if (!EVP_DigestUpdate(ctx, h1, HASH_SIZE) ||
-        !EVP_DigestUpdate(ctx, h2, HASH_SIZE)) {
-        EVP_MD_CTX_free(ctx);
-        return -1;
-    }
-    
-    unsigned int out_len;
-    if (!EVP_DigestFinal_ex(ctx, out, &out_len) || out_len != HASH_SIZE) {
-        EVP_MD_CTX_free(ctx);
-        return -1;
+    struct hash_ctx ctx;
+    if (ctx_init(&ctx, current_algo) == -1) return -1;
+
+    int ok = ctx_update(&ctx, h1, HASH_SIZE) == 0 &&
+             ctx_update(&ctx, h2, HASH_SIZE) == 0 &&
+             ctx_final(&ctx, out) == 0;
+    ctx_cleanup(&ctx);
+    return ok ? 0 : -1;
+}
+
+/* ---------- INCREMENTAL HASHING ---------- */
+
+hash_ctx_t *hash_ctx_new_algo(hash_algo_t algo) {
+    hash_ctx_t *ctx = malloc(sizeof(hash_ctx_t));
+    if (!ctx) return NULL;
+
+    if (ctx_init(ctx, algo) == -1) {
+        free(ctx);
+        return NULL;
     }
-    
-    EVP_MD_CTX_free(ctx);
-    return 0;
+    return ctx;
+}
+
+hash_ctx_t *hash_ctx_new(void) {
+    return hash_ctx_new_algo(current_algo);
+}
+
+int hash_ctx_update(hash_ctx_t *ctx, const void *data, size_t len) {
+    return ctx_update(ctx, data, len);
+}
+
+int hash_ctx_final(hash_ctx_t *ctx, hash_t out) {
+    return ctx_final(ctx, out);
+}
+
+void hash_ctx_free(hash_ctx_t *ctx) {
+    if (!ctx) return;
+    ctx_cleanup(ctx);
+    free(ctx);
 }
 
 void hash_to_hex(const hash_t hash, char *hex) {
@@ -96,3 +147,20 @@ void hash_to_hex(const hash_t hash, char *hex) {
     }
     hex[HASH_HEX_SIZE - 1] = '\0';
 }
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+int hash_from_hex(const char *hex, hash_t out) {
+    for (int i = 0; i < HASH_SIZE; i++) {
+        int hi = hex_digit(hex[2 * i]);
+        int lo = hi < 0 ? -1 : hex_digit(hex[2 * i + 1]);
+        if (lo < 0) return -1;
+        out[i] = (unsigned char)(hi << 4 | lo);
+    }
+    return hex[HASH_HEX_SIZE - 1] == '\0' ? 0 : -1;
+}
@@ -8,9 +8,30 @@
 
 typedef unsigned char hash_t[HASH_SIZE];
 
+/* Both algorithms produce 32-byte digests; entries made with one are
+ * never looked up with the other (see key_compute). */
+typedef enum {
+    HASH_ALGO_BLAKE3 = 0,
+    HASH_ALGO_SHA256
+} hash_algo_t;
+
+/* Incremental hashing for data that arrives in pieces */
+typedef struct hash_ctx hash_ctx_t;
+
+void hash_set_algorithm(hash_algo_t algo);
+hash_algo_t hash_get_algorithm(void);
+const char *hash_algorithm_name(hash_algo_t algo);
+
 int hash_file(const char *path, hash_t out);
 int hash_data(const void *data, size_t len, hash_t out);
 void hash_to_hex(const hash_t hash, char *hex);
+int hash_from_hex(const char *hex, hash_t out);
 int hash_combine(const hash_t h1, const hash_t h2, hash_t out);
 
+hash_ctx_t *hash_ctx_new(void);
+hash_ctx_t *hash_ctx_new_algo(hash_algo_t algo);
+int hash_ctx_update(hash_ctx_t *ctx, const void *data, size_t len);
+int hash_ctx_final(hash_ctx_t *ctx, hash_t out);
+void hash_ctx_free(hash_ctx_t *ctx);
+
 #endif
@@ -0,0 +1,458 @@
+#define _DEFAULT_SOURCE  // flock
+
+#include "index.h"
+#include "cache.h"
+#include "metadata.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Open-addressing hash table of store entries in one mmap'd file, keyed
+ * by the binary 32-byte cache key with linear probing. Any number of
+ * processes read it without locking: every slot carries a sequence
+ * number that is odd while it is being written, and a reader that sees
+ * it change retries. Writers serialize on index.lock. When the table
+ * fills up, the writer builds a larger copy, renames it over the old
+ * file and marks the old one retired so other processes remap.
+ *
+ * SQLite stays the source of truth. The index is rebuilt from it when
+ * missing or unreadable, and a key not found here is looked up there. */
+
+#define INDEX_MAGIC 0x58444951u  /* "QIDX" */
+#define INDEX_VERSION 2
+#define INDEX_MIN_SLOTS 4096
+#define INDEX_MAX_LOAD_PCT 70
+#define INDEX_READ_RETRIES 1000
+#define INDEX_ATIME_UNIT 60   /* access times are kept in minutes */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t slots;       /* power of two */
+    uint64_t used;
+    uint64_t deleted;
+    uint32_t retired;     /* a resize has replaced this file */
+    uint32_t reserved[7];
+} index_header_t;
+
+enum { SLOT_EMPTY = 0, SLOT_USED, SLOT_DELETED };
+
+typedef struct {
+    uint32_t seq;
+    uint8_t state;
+    uint8_t compressed;
+    uint8_t level;
+    uint8_t reserved;
+    hash_t key;
+    uint64_t size;
+    uint32_t compile_ms;  /* what a hit saves, for the statistics */
+    uint32_t reserved2;
+    uint32_t dict_id;
+    uint32_t atime;
+} index_slot_t;
+
+_Static_assert(sizeof(index_header_t) == 64, "index header must stay 64 bytes");
+_Static_assert(sizeof(index_slot_t) == 64, "index slots must stay one cache line");
+
+static index_header_t *index_map = NULL;
+static size_t index_map_size = 0;
+static int lock_fd = -1;
+
+/* The daemon's threads share the mapping: the lock file only excludes
+ * other processes, and a remap must not pull it from under a reader.
+ * Lookups and touches hold it shared, so hits do not serialize;
+ * anything that maps, unmaps or writes a slot holds it exclusively. */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void get_index_path(const char *name, char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/%s", cache_dir, name);
+}
+
+static index_slot_t *slots_of(index_header_t *header) {
+    return (index_slot_t *)(header + 1);
+}
+
+static uint64_t home_slot(const hash_t key, uint64_t slots) {
+    uint64_t h;
+    memcpy(&h, key, sizeof(h));
+    return h & (slots - 1);
+}
+
+/* Room for entries at no more than half load, so a rebuilt table does
+ * not have to grow again right away */
+static uint64_t slots_for(uint64_t entries) {
+    uint64_t slots = INDEX_MIN_SLOTS;
+    while (slots < entries * 2) slots *= 2;
+    return slots;
+}
+
+/* ---------- SLOT ACCESS ---------- */
+static int read_slot(const index_slot_t *slot, index_slot_t *out) {
+    for (int i = 0; i < INDEX_READ_RETRIES; i++) {
+        uint32_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) continue;
+        memcpy(out, slot, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == before) return 0;
+    }
+    return -1;  /* a writer died mid-update; let SQLite answer */
+}
+
+/* Only called with the writer lock held. A slot left odd by a crashed
+ * writer is simply completed. */
+static void write_slot(index_slot_t *slot, const index_slot_t *value) {
+    uint32_t seq = slot->seq | 1;
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->seq), (const char *)value + sizeof(value->seq),
+           sizeof(*slot) - sizeof(slot->seq));
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Slot holding key, or -1 */
+static int64_t find_slot(index_header_t *header, const hash_t key, index_slot_t *out) {
+    index_slot_t *slots = slots_of(header);
+    uint64_t mask = header->slots - 1;
+    uint64_t i = home_slot(key, header->slots);
+
+    for (uint64_t n = 0; n < header->slots; n++, i = (i + 1) & mask) {
+        if (read_slot(&slots[i], out) == -1) return -1;
+        if (out->state == SLOT_EMPTY) return -1;
+        if (out->state == SLOT_USED && memcmp(out->key, key, HASH_SIZE) == 0) return (int64_t)i;
+    }
+    return -1;
+}
+
+/* ---------- FILE ---------- */
+static index_header_t *map_file(size_t *map_size) {
+    char path[4096];
+    get_index_path(INDEX_FILE_NAME, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(index_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    index_header_t *header = map;
+    uint64_t slots = header->slots;
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+        slots < INDEX_MIN_SLOTS || (slots & (slots - 1)) != 0 ||
+        (size_t)st.st_size != sizeof(index_header_t) + slots * sizeof(index_slot_t)) {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+
+    *map_size = (size_t)st.st_size;
+    return header;
+}
+
+static void insert_new(index_header_t *header, const index_slot_t *value) {
+    index_slot_t *slots = slots_of(header);
+    uint64_t mask = header->slots - 1;
+    uint64_t i = home_slot(value->key, header->slots);
+    while (slots[i].state != SLOT_EMPTY) i = (i + 1) & mask;
+    slots[i] = *value;
+    slots[i].seq = 0;
+    header->used++;
+}
+
+static int insert_entry(const cache_entry_t *entry, void *arg) {
+    index_slot_t value;
+    memset(&value, 0, sizeof(value));
+    if (hash_from_hex(entry->hash, value.key) == -1) return 0;
+    value.state = SLOT_USED;
+    value.compressed = (uint8_t)entry->compressed;
+    value.level = (uint8_t)entry->level;
+    value.size = entry->size;
+    value.compile_ms = entry->compile_ms;
+    value.dict_id = entry->dict_id;
+    value.atime = (uint32_t)(entry->accessed / INDEX_ATIME_UNIT);
+    insert_new(arg, &value);
+    return 0;
+}
+
+/* Write a fresh table with the given number of slots, filled from the
+ * current map or, without one, from SQLite, and rename it into place.
+ * Called with the writer lock held. */
+static int build_file(uint64_t slots) {
+    char path[4096];
+    char tmp_path[4200];
+    get_index_path(INDEX_FILE_NAME, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    size_t size = sizeof(index_header_t) + slots * sizeof(index_slot_t);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    if (ftruncate(fd, (off_t)size) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    index_header_t *header = map;
+    header->slots = slots;
+
+    int rc = 0;
+    if (index_map) {
+        index_slot_t *old = slots_of(index_map);
+        for (uint64_t i = 0; i < index_map->slots; i++) {
+            if (old[i].state == SLOT_USED) insert_new(header, &old[i]);
+        }
+    } else {
+        rc = metadata_for_each(insert_entry, header);
+    }
+
+    header->version = INDEX_VERSION;
+    header->magic = INDEX_MAGIC;
+    munmap(map, size);
+
+    if (rc != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (index_map) {
+        __atomic_store_n(&index_map->retired, 1, __ATOMIC_RELEASE);
+        munmap(index_map, index_map_size);
+        index_map = NULL;
+    }
+    index_map = map_file(&index_map_size);
+    return index_map ? 0 : -1;
+}
+
+/* Follow a resize done by another process. Called with index_lock held
+ * exclusively. */
+static int remap_if_retired(void) {
+    if (!index_map) return -1;
+    if (!__atomic_load_n(&index_map->retired, __ATOMIC_ACQUIRE)) return 0;
+
+    munmap(index_map, index_map_size);
+    index_map = map_file(&index_map_size);
+    return index_map ? 0 : -1;
+}
+
+static int lock_writer(void) {
+    while (flock(lock_fd, LOCK_EX) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    if (remap_if_retired() == -1) {
+        flock(lock_fd, LOCK_UN);
+        return -1;
+    }
+    return 0;
+}
+
+static void unlock_writer(void) {
+    flock(lock_fd, LOCK_UN);
+}
+
+/* ---------- TABLE ---------- */
+static int open_unlocked(void) {
+    if (index_map) return 0;
+
+    char lock_path[4096];
+    get_index_path("index.lock", lock_path, sizeof(lock_path));
+    lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1) return -1;
+
+    index_map = map_file(&index_map_size);
+    if (index_map) return 0;
+
+    /* Missing or unreadable: build it from SQLite, unless another
+     * process did while we waited for the lock */
+    while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR) {}
+    index_map = map_file(&index_map_size);
+    if (!index_map) build_file(slots_for(metadata_entry_count()));
+    flock(lock_fd, LOCK_UN);
+
+    if (!index_map) {
+        close(lock_fd);
+        lock_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int lookup_unlocked(const hash_t key, index_record_t *rec) {
+    index_slot_t slot;
+    if (find_slot(index_map, key, &slot) == -1) return -1;
+
+    rec->size = slot.size;
+    rec->compile_ms = slot.compile_ms;
+    rec->dict_id = slot.dict_id;
+    rec->accessed = (time_t)slot.atime * INDEX_ATIME_UNIT;
+    rec->compressed = slot.compressed;
+    rec->level = slot.level;
+    return 0;
+}
+
+static int put_unlocked(const hash_t key, const index_record_t *rec) {
+    if (!index_map || lock_writer() == -1) return -1;
+
+    /* Grow (or just clear out tombstones) before the table gets crowded */
+    if ((index_map->used + index_map->deleted + 1) * 100 > index_map->slots * INDEX_MAX_LOAD_PCT &&
+        build_file(slots_for(index_map->used + 1)) == -1) {
+        unlock_writer();
+        return -1;
+    }
+
+    index_slot_t value;
+    memset(&value, 0, sizeof(value));
+    memcpy(value.key, key, HASH_SIZE);
+    value.state = SLOT_USED;
+    value.compressed = (uint8_t)rec->compressed;
+    value.level = (uint8_t)rec->level;
+    value.size = rec->size;
+    value.compile_ms = rec->compile_ms;
+    value.dict_id = rec->dict_id;
+    value.atime = (uint32_t)(rec->accessed / INDEX_ATIME_UNIT);
+
+    index_slot_t *slots = slots_of(index_map);
+    uint64_t mask = index_map->slots - 1;
+    uint64_t i = home_slot(key, index_map->slots);
+    int64_t reuse = -1;
+
+    for (uint64_t n = 0; n < index_map->slots; n++, i = (i + 1) & mask) {
+        index_slot_t *slot = &slots[i];
+        if (slot->state == SLOT_USED && memcmp(slot->key, key, HASH_SIZE) == 0) {
+            write_slot(slot, &value);
+            unlock_writer();
+            return 0;
+        }
+        if (slot->state == SLOT_DELETED && reuse == -1) reuse = (int64_t)i;
+        if (slot->state == SLOT_EMPTY) break;
+    }
+
+    if (reuse != -1) {
+        i = (uint64_t)reuse;
+        index_map->deleted--;
+    }
+    write_slot(&slots[i], &value);
+    index_map->used++;
+
+    unlock_writer();
+    return 0;
+}
+
+static int remove_unlocked(const hash_t key) {
+    if (!index_map || lock_writer() == -1) return -1;
+
+    index_slot_t slot;
+    int64_t i = find_slot(index_map, key, &slot);
+    if (i != -1) {
+        slot.state = SLOT_DELETED;
+        write_slot(&slots_of(index_map)[i], &slot);
+        index_map->used--;
+        index_map->deleted++;
+    }
+
+    unlock_writer();
+    return i != -1 ? 0 : -1;
+}
+
+/* Record a hit. The access time is one word written without the lock: a
+ * lost race only makes an entry look a minute older. */
+static void touch_unlocked(const hash_t key, time_t accessed) {
+    index_slot_t slot;
+    int64_t i = find_slot(index_map, key, &slot);
+    if (i != -1) {
+        __atomic_store_n(&slots_of(index_map)[i].atime, (uint32_t)(accessed / INDEX_ATIME_UNIT),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+static void close_unlocked(void) {
+    if (index_map) {
+        munmap(index_map, index_map_size);
+        index_map = NULL;
+    }
+    if (lock_fd != -1) {
+        close(lock_fd);
+        lock_fd = -1;
+    }
+}
+
+/* Take index_lock shared over a current mapping, first following a
+ * resize by another process under the exclusive lock if there was one.
+ * Returns -1, with the lock released, when there is no mapping. */
+static int lock_reader(void) {
+    for (;;) {
+        pthread_rwlock_rdlock(&index_lock);
+        if (!index_map) break;
+        if (!__atomic_load_n(&index_map->retired, __ATOMIC_ACQUIRE)) return 0;
+        pthread_rwlock_unlock(&index_lock);
+
+        pthread_rwlock_wrlock(&index_lock);
+        int r = remap_if_retired();
+        pthread_rwlock_unlock(&index_lock);
+        if (r == -1) return -1;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return -1;
+}
+
+/* ---------- API ---------- */
+int index_open(void) {
+    pthread_rwlock_wrlock(&index_lock);
+    int r = open_unlocked();
+    pthread_rwlock_unlock(&index_lock);
+    return r;
+}
+
+int index_lookup(const hash_t key, index_record_t *rec) {
+    if (lock_reader() == -1) return -1;
+    int r = lookup_unlocked(key, rec);
+    pthread_rwlock_unlock(&index_lock);
+    return r;
+}
+
+int index_put(const hash_t key, const index_record_t *rec) {
+    pthread_rwlock_wrlock(&index_lock);
+    int r = put_unlocked(key, rec);
+    pthread_rwlock_unlock(&index_lock);
+    return r;
+}
+
+int index_remove(const hash_t key) {
+    pthread_rwlock_wrlock(&index_lock);
+    int r = remove_unlocked(key);
+    pthread_rwlock_unlock(&index_lock);
+    return r;
+}
+
+void index_touch(const hash_t key, time_t accessed) {
+    if (lock_reader() == -1) return;
+    touch_unlocked(key, accessed);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void index_close(void) {
+    pthread_rwlock_wrlock(&index_lock);
+    close_unlocked();
+    pthread_rwlock_unlock(&index_lock);
+}
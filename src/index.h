@@ -0,0 +1,27 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <time.h>
+#include "hash.h"
+
+#define INDEX_FILE_NAME "index.bin"
+
+/* What the hit path needs to know about an object, without SQLite */
+typedef struct {
+    uint64_t size;
+    uint32_t compile_ms;
+    uint32_t dict_id;
+    time_t accessed;    /* to the minute */
+    int compressed;
+    int level;
+} index_record_t;
+
+int index_open(void);
+int index_lookup(const hash_t key, index_record_t *rec);
+int index_put(const hash_t key, const index_record_t *rec);
+int index_remove(const hash_t key);
+void index_touch(const hash_t key, time_t accessed);
+void index_close(void);
+
+#endif
@@ -0,0 +1,106 @@
+#include "key.h"
+#include "config.h"
+#include "memo.h"
+#include "preprocess.h"
+#include "scan.h"
+#include <stdio.h>
+#include <string.h>
+
+/* ---------- HEADER DEPENDENCY TRACKING ---------- */
+/* Hash the source together with every header reachable from it through
+ * #include, resolved against the command line's search paths (scan.c).
+ * Every header that was hashed is recorded in deps when it is non-NULL. */
+int hash_with_dependencies(const char *source_file, char **compiler_argv,
+                           hash_t out, manifest_t *deps) {
+    hash_t file_hash;
+    if (memo_hash_file(source_file, file_hash) == -1) return -1;
+
+    manifest_t found;
+    manifest_init(&found);
+    if (scan_includes(source_file, compiler_argv, &found) == -1) {
+        manifest_free(&found);
+        return -1;
+    }
+
+    hash_ctx_t *ctx = hash_ctx_new();
+    int ok = ctx && hash_ctx_update(ctx, file_hash, HASH_SIZE) == 0;
+    for (int i = 0; ok && i < found.count; i++) {
+        ok = hash_ctx_update(ctx, found.deps[i].hash, HASH_SIZE) == 0;
+    }
+    ok = ok && hash_ctx_final(ctx, out) == 0;
+    hash_ctx_free(ctx);
+
+    if (ok && deps) {
+        manifest_free(deps);
+        *deps = found;
+    } else {
+        manifest_free(&found);
+    }
+    return ok ? 0 : -1;
+}
+
+/* ---------- INPUT HASHING ---------- */
+/* Hash everything the compile reads, either by scanning #include lines
+ * ourselves or by letting the compiler preprocess the source. */
+int key_hash_inputs(key_mode_t mode, const char *source_file, char **compiler_argv,
+                    hash_t out, manifest_t *deps) {
+    if (mode == KEY_MODE_PREPROCESSOR)
+        return preprocess_hash(compiler_argv, out, deps);
+    return hash_with_dependencies(source_file, compiler_argv, out, deps);
+}
+
+/* ---------- CACHE KEY ---------- */
+/* Fold the content hash algorithm into the command hash, so entries and
+ * manifests written under one algorithm are never found under another. */
+static int key_namespace(const hash_t h_cmd, hash_t out) {
+    const char *algo = hash_algorithm_name(hash_get_algorithm());
+    hash_t h_algo;
+    if (hash_data(algo, strlen(algo), h_algo) == -1) return -1;
+    return hash_combine(h_algo, h_cmd, out);
+}
+
+/* In direct mode a manifest keyed by (source hash + command hash) lists the
+ * headers seen last time with their stat data. If none of them changed the
+ * recorded key is reused without re-reading the include graph. */
+int key_compute(const char *source_file, char **compiler_argv, const hash_t h_cmd_raw, hash_t key) {
+    const quickcache_config_t *cfg = config_get();
+    hash_t h_file, h_cmd;
+
+    if (key_namespace(h_cmd_raw, h_cmd) == -1)
+        return -1;
+
+    if (!cfg->direct_mode) {
+        if (key_hash_inputs(cfg->key_mode, source_file, compiler_argv, h_file, NULL) == -1)
+            return -1;
+        return hash_combine(h_file, h_cmd, key);
+    }
+
+    hash_t h_src, manifest_key;
+    if (memo_hash_file(source_file, h_src) == -1)
+        return -1;
+    hash_combine(h_src, h_cmd, manifest_key);
+
+    manifest_t m;
+    if (manifest_load(manifest_key, &m) == 0) {
+        int refreshed;
+        if (manifest_verify(&m, &refreshed) == 0) {
+            memcpy(key, m.result, HASH_SIZE);
+            if (refreshed) manifest_save(manifest_key, &m);
+            manifest_free(&m);
+            return 0;
+        }
+        manifest_free(&m);
+    }
+
+    manifest_init(&m);
+    if (key_hash_inputs(cfg->key_mode, source_file, compiler_argv, h_file, &m) == -1) {
+        manifest_free(&m);
+        return -1;
+    }
+    hash_combine(h_file, h_cmd, key);
+
+    memcpy(m.result, key, HASH_SIZE);
+    manifest_save(manifest_key, &m);
+    manifest_free(&m);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef KEY_H
+#define KEY_H
+
+#include "hash.h"
+#include "config.h"
+#include "manifest.h"
+
+int hash_with_dependencies(const char *source_file, char **compiler_argv,
+                           hash_t out, manifest_t *deps);
+int key_hash_inputs(key_mode_t mode, const char *source_file, char **compiler_argv,
+                    hash_t out, manifest_t *deps);
+int key_compute(const char *source_file, char **compiler_argv, const hash_t h_cmd, hash_t key);
+
+#endif
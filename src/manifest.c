@@ -0,0 +1,229 @@
+#define _POSIX_C_SOURCE 200809L  // st_mtim
+
+#include "manifest.h"
+#include "cache.h"
+#include "memo.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MANIFEST_MAGIC 0x514d4631u  /* "QMF1" */
+#define MANIFEST_VERSION 1
+
+/* Files modified this recently may still change within the filesystem's
+ * timestamp granularity, so their stat data is never trusted on its own. */
+#define MANIFEST_DEP_TRUSTED 0x1
+#define MANIFEST_RACY_SECONDS 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    hash_t result;
+} manifest_header_t;
+
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint32_t flags;
+    uint32_t path_len;
+    hash_t hash;
+} manifest_record_t;
+
+static void get_manifest_path(const hash_t key, char *buf, size_t len) {
+    char hex[HASH_HEX_SIZE];
+    char cache_dir[4096];
+
+    hash_to_hex(key, hex);
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/manifests/%.2s/%s", cache_dir, hex, hex + 2);
+}
+
+static void fill_stat(manifest_dep_t *dep, const struct stat *st) {
+    dep->size = (uint64_t)st->st_size;
+    dep->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    dep->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    dep->ino = (uint64_t)st->st_ino;
+    dep->flags = 0;
+    if (time(NULL) - st->st_mtim.tv_sec >= MANIFEST_RACY_SECONDS &&
+        time(NULL) - st->st_ctim.tv_sec >= MANIFEST_RACY_SECONDS) {
+        dep->flags |= MANIFEST_DEP_TRUSTED;
+    }
+}
+
+static int stat_matches(const manifest_dep_t *dep, const struct stat *st) {
+    return (dep->flags & MANIFEST_DEP_TRUSTED) &&
+           dep->size == (uint64_t)st->st_size &&
+           dep->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           dep->mtime_nsec == (int64_t)st->st_mtim.tv_nsec &&
+           dep->ino == (uint64_t)st->st_ino;
+}
+
+void manifest_init(manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void manifest_free(manifest_t *m) {
+    for (int i = 0; i < m->count; i++) {
+        free(m->deps[i].path);
+    }
+    free(m->deps);
+    manifest_init(m);
+}
+
+int manifest_add_dep(manifest_t *m, const char *path, const hash_t hash) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+
+    if (m->count >= m->capacity) {
+        int capacity = m->capacity == 0 ? 32 : m->capacity * 2;
+        manifest_dep_t *deps = realloc(m->deps, capacity * sizeof(manifest_dep_t));
+        if (!deps) return -1;
+        m->deps = deps;
+        m->capacity = capacity;
+    }
+
+    manifest_dep_t *dep = &m->deps[m->count];
+    dep->path = strdup(path);
+    if (!dep->path) return -1;
+
+    fill_stat(dep, &st);
+    memcpy(dep->hash, hash, HASH_SIZE);
+    m->count++;
+    return 0;
+}
+
+int manifest_load(const hash_t manifest_key, manifest_t *m) {
+    char path[4096];
+    get_manifest_path(manifest_key, path, sizeof(path));
+
+    size_t len;
+    char *data = read_file(path, &len);
+    if (!data) return -1;
+
+    manifest_init(m);
+
+    manifest_header_t header;
+    if (len < sizeof(header)) goto corrupt;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != MANIFEST_MAGIC || header.version != MANIFEST_VERSION) goto corrupt;
+    memcpy(m->result, header.result, HASH_SIZE);
+
+    size_t off = sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++) {
+        manifest_record_t rec;
+        if (len - off < sizeof(rec)) goto corrupt;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+
+        if (rec.path_len == 0 || len - off < rec.path_len) goto corrupt;
+
+        if (m->count >= m->capacity) {
+            int capacity = m->capacity == 0 ? 32 : m->capacity * 2;
+            manifest_dep_t *deps = realloc(m->deps, capacity * sizeof(manifest_dep_t));
+            if (!deps) goto corrupt;
+            m->deps = deps;
+            m->capacity = capacity;
+        }
+
+        manifest_dep_t *dep = &m->deps[m->count];
+        dep->path = strndup(data + off, rec.path_len);
+        if (!dep->path) goto corrupt;
+        off += rec.path_len;
+
+        dep->size = rec.size;
+        dep->mtime_sec = rec.mtime_sec;
+        dep->mtime_nsec = rec.mtime_nsec;
+        dep->ino = rec.ino;
+        dep->flags = rec.flags;
+        memcpy(dep->hash, rec.hash, HASH_SIZE);
+        m->count++;
+    }
+
+    free(data);
+    return 0;
+
+corrupt:
+    free(data);
+    manifest_free(m);
+    return -1;
+}
+
+int manifest_save(const hash_t manifest_key, const manifest_t *m) {
+    char path[4096];
+    char tmp_path[4096];
+    get_manifest_path(manifest_key, path, sizeof(path));
+
+    /* Create the fan-out directory */
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    make_dirs(path);
+    *slash = '/';
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f) return -1;
+
+    manifest_header_t header = { MANIFEST_MAGIC, MANIFEST_VERSION, (uint32_t)m->count, 0, {0} };
+    memcpy(header.result, m->result, HASH_SIZE);
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+    for (int i = 0; ok && i < m->count; i++) {
+        const manifest_dep_t *dep = &m->deps[i];
+        manifest_record_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.size = dep->size;
+        rec.mtime_sec = dep->mtime_sec;
+        rec.mtime_nsec = dep->mtime_nsec;
+        rec.ino = dep->ino;
+        rec.flags = dep->flags;
+        rec.path_len = (uint32_t)strlen(dep->path);
+        memcpy(rec.hash, dep->hash, HASH_SIZE);
+
+        ok = fwrite(&rec, sizeof(rec), 1, f) == 1 &&
+             fwrite(dep->path, 1, rec.path_len, f) == rec.path_len;
+    }
+
+    if (fclose(f) != 0) ok = 0;
+
+    /* Atomic replace so concurrent readers never see a partial manifest */
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Check every recorded dependency against the filesystem. Unchanged stat
+ * data is trusted; anything else falls back to re-hashing the content.
+ * Sets *refreshed when stat data changed but content did not, so the
+ * caller can save the manifest and keep the next lookup stat-only. */
+int manifest_verify(manifest_t *m, int *refreshed) {
+    if (refreshed) *refreshed = 0;
+
+    for (int i = 0; i < m->count; i++) {
+        manifest_dep_t *dep = &m->deps[i];
+        struct stat st;
+
+        if (stat(dep->path, &st) != 0) return -1;
+        if (stat_matches(dep, &st)) continue;
+
+        hash_t current;
+        if (memo_hash_file(dep->path, current) == -1) return -1;
+        if (memcmp(current, dep->hash, HASH_SIZE) != 0) return -1;
+
+        fill_stat(dep, &st);
+        if (refreshed) *refreshed = 1;
+    }
+
+    return 0;
+}
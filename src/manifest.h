@@ -0,0 +1,35 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include "hash.h"
+
+/* A dependency recorded in a manifest together with the stat data it had
+ * when its content hash was taken. */
+typedef struct {
+    char *path;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t ino;
+    uint32_t flags;
+    hash_t hash;
+} manifest_dep_t;
+
+/* Maps (source hash + command hash) to the include files the compile
+ * depended on and the cache key they produced. */
+typedef struct {
+    manifest_dep_t *deps;
+    int count;
+    int capacity;
+    hash_t result;
+} manifest_t;
+
+void manifest_init(manifest_t *m);
+void manifest_free(manifest_t *m);
+int manifest_add_dep(manifest_t *m, const char *path, const hash_t hash);
+int manifest_load(const hash_t manifest_key, manifest_t *m);
+int manifest_save(const hash_t manifest_key, const manifest_t *m);
+int manifest_verify(manifest_t *m, int *refreshed);
+
+#endif
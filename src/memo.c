@@ -0,0 +1,188 @@
+#define _POSIX_C_SOURCE 200809L  // st_mtim
+
+#include "memo.h"
+#include "cache.h"
+#include "pathset.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Persistent table of file content hashes keyed by path + stat data, so a
+ * header shared by thousands of translation units is hashed once per
+ * change rather than once per compile. The table is a fixed-size mmap'd
+ * file written without locks: every record carries a check word over its
+ * fields, and a torn or racing write simply reads back as a miss. */
+
+#define MEMO_MAGIC 0x514d454du  /* "QMEM" */
+#define MEMO_VERSION 2
+#define MEMO_SLOTS 65536
+#define MEMO_PROBE 8
+
+/* Files changed this recently could change again without their stat data
+ * moving, so they are hashed but never memoized. */
+#define MEMO_RACY_SECONDS 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+} memo_header_t;
+
+typedef struct {
+    uint64_t path_hash;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_ns;
+    uint64_t size;
+    hash_t hash;
+    uint64_t check;
+} memo_record_t;
+
+static memo_record_t *memo_slots = NULL;
+static size_t memo_map_size = 0;
+static int memo_unavailable = 0;
+
+static void get_memo_path(char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/%s", cache_dir, MEMO_FILE_NAME);
+}
+
+static uint64_t record_check(const memo_record_t *r) {
+    uint64_t c = r->path_hash ^ 0x9e3779b97f4a7c15ULL;
+    c = (c ^ r->dev) * 0xff51afd7ed558ccdULL;
+    c = (c ^ r->ino) * 0xc4ceb9fe1a85ec53ULL;
+    c = (c ^ (uint64_t)r->mtime_ns) * 0xff51afd7ed558ccdULL;
+    c = (c ^ r->size) * 0xc4ceb9fe1a85ec53ULL;
+    for (int i = 0; i < HASH_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, r->hash + i, sizeof(w));
+        c = (c ^ w) * 0xff51afd7ed558ccdULL;
+    }
+    return c ? c : 1;
+}
+
+static int memo_open(void) {
+    if (memo_slots) return 0;
+    if (memo_unavailable) return -1;
+
+    char path[4096];
+    get_memo_path(path, sizeof(path));
+
+    memo_map_size = sizeof(memo_header_t) + (size_t)MEMO_SLOTS * sizeof(memo_record_t);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        char cache_dir[4096];
+        cache_get_base_dir(cache_dir, sizeof(cache_dir));
+        make_dirs(cache_dir);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        memo_unavailable = 1;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        ((size_t)st.st_size < memo_map_size && ftruncate(fd, memo_map_size) == -1)) {
+        close(fd);
+        memo_unavailable = 1;
+        return -1;
+    }
+
+    void *map = mmap(NULL, memo_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        memo_unavailable = 1;
+        return -1;
+    }
+
+    /* A fresh (zero-filled) or foreign file is claimed by stamping the
+     * header; concurrent openers write identical bytes. */
+    memo_header_t *header = map;
+    if (header->magic != MEMO_MAGIC || header->version != MEMO_VERSION ||
+        header->slots != MEMO_SLOTS) {
+        memset((char *)map + sizeof(memo_header_t), 0, memo_map_size - sizeof(memo_header_t));
+        header->slots = MEMO_SLOTS;
+        header->version = MEMO_VERSION;
+        header->reserved = 0;
+        header->magic = MEMO_MAGIC;
+    }
+
+    memo_slots = (memo_record_t *)((char *)map + sizeof(memo_header_t));
+    return 0;
+}
+
+/* Hash a file, reusing the stored result when its path and stat data are
+ * unchanged since it was last hashed by any process. */
+int memo_hash_file(const char *path, hash_t out) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+
+    if (memo_open() == -1) {
+        return hash_file(path, out);
+    }
+
+    memo_record_t want;
+    memset(&want, 0, sizeof(want));
+    /* Salted by algorithm so switching hash_algorithm never returns a
+     * digest computed by the other one */
+    want.path_hash = fnv1a(path) ^ ((uint64_t)(hash_get_algorithm() + 1) * 0x9e3779b97f4a7c15ULL);
+    want.dev = (uint64_t)st.st_dev;
+    want.ino = (uint64_t)st.st_ino;
+    want.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    want.size = (uint64_t)st.st_size;
+
+    uint32_t base = (uint32_t)(want.path_hash % MEMO_SLOTS);
+    for (int i = 0; i < MEMO_PROBE; i++) {
+        memo_record_t rec;
+        memcpy(&rec, &memo_slots[(base + i) % MEMO_SLOTS], sizeof(rec));
+
+        if (rec.path_hash == want.path_hash && rec.dev == want.dev &&
+            rec.ino == want.ino && rec.mtime_ns == want.mtime_ns &&
+            rec.size == want.size && rec.check == record_check(&rec)) {
+            memcpy(out, rec.hash, HASH_SIZE);
+            return 0;
+        }
+    }
+
+    if (hash_file(path, out) == -1) return -1;
+
+    time_t now = time(NULL);
+    if (now - st.st_mtim.tv_sec < MEMO_RACY_SECONDS ||
+        now - st.st_ctim.tv_sec < MEMO_RACY_SECONDS) {
+        return 0;
+    }
+
+    memcpy(want.hash, out, HASH_SIZE);
+    want.check = record_check(&want);
+
+    /* Reuse this path's slot (stale version) or an empty one; otherwise
+     * evict a probe slot chosen by inode so hot entries spread out. */
+    uint32_t victim = (base + (uint32_t)(want.ino % MEMO_PROBE)) % MEMO_SLOTS;
+    for (int i = 0; i < MEMO_PROBE; i++) {
+        const memo_record_t *rec = &memo_slots[(base + i) % MEMO_SLOTS];
+        if (rec->path_hash == want.path_hash || rec->check == 0) {
+            victim = (base + i) % MEMO_SLOTS;
+            break;
+        }
+    }
+    memcpy(&memo_slots[victim], &want, sizeof(want));
+    return 0;
+}
+
+void memo_close(void) {
+    if (memo_slots) {
+        munmap((char *)memo_slots - sizeof(memo_header_t), memo_map_size);
+        memo_slots = NULL;
+    }
+}
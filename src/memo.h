@@ -0,0 +1,11 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "hash.h"
+
+#define MEMO_FILE_NAME "headers.bin"
+
+int memo_hash_file(const char *path, hash_t out);
+void memo_close(void);
+
+#endif
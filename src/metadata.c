@@ -1,6 +1,8 @@
 #define _POSIX_C_SOURCE 200809L
 #include "metadata.h"
 #include "cache.h"
+#include "config.h"
+#include "index.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,8 +10,183 @@
 #include <sqlite3.h>
 #include <unistd.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* One connection per thread: the daemon serves requests on several
+ * threads, and a connection's prepared statements cannot be shared */
+static _Thread_local sqlite3 *db = NULL;
+
+/* ---------- EVICTION ORDER ---------- */
+/* GDSF (greedy-dual-size-frequency): priority = clock + frequency / size,
+ * in fixed point. The clock is raised to the priority of each evicted
+ * entry, so entries that stop being hit age out. */
+#define GDSF_VALUE(hits, size) "(" hits " + 1) * 1000000000 / MAX(" size ", 1)"
+
+/* Compile milliseconds saved per stored byte, counting the miss that
+ * stored the entry. Entries fetched from the remote cache have no
+ * compile time and go first. */
+#define COST_VALUE "compile_ms * (hits + 1.0) / MAX(compressed_size, 1)"
+
+/* ---------- STATEMENTS ---------- */
+/* Every query is prepared once by metadata_init() and reset after each
+ * use, so a call costs a bind and a step instead of a parse and plan. */
+enum {
+    STMT_ADD,
+    STMT_GET,
+    STMT_TOUCH,
+    STMT_DELETE,
+    STMT_SET_COMPRESSION,
+    STMT_RECOMPRESS_CANDIDATES,
+    STMT_GET_DICTIONARY,
+    STMT_SET_DICTIONARY,
+    STMT_TOOLCHAINS,
+    STMT_DICT_SAMPLES,
+    STMT_TOTAL_SIZE,
+    STMT_EVICT_LRU,
+    STMT_EVICT_GDSF,
+    STMT_EVICT_COST,
+    STMT_ADVANCE_CLOCK,
+    STMT_TIME_SAVED,
+    STMT_OLD,
+    STMT_ALL,
+    STMT_EACH,
+    STMT_ENTRY_COUNT,
+    STMT_COUNT
+};
+
+static const char *const statement_sql[STMT_COUNT] = {
+    /* An upsert rather than INSERT OR REPLACE, so the counter triggers
+     * see a replaced entry as an update */
+    [STMT_ADD] =
+        "INSERT INTO cache_entries "
+        "(hash, size, compressed_size, created, accessed, compressed, level, "
+        "toolchain, dict_id, compile_ms, priority) "
+        "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, "
+        "(SELECT value FROM counters WHERE name = 'gdsf_clock') + "
+        GDSF_VALUE("0", "?3") ") "
+        "ON CONFLICT(hash) DO UPDATE SET size = excluded.size, "
+        "compressed_size = excluded.compressed_size, created = excluded.created, "
+        "accessed = excluded.accessed, compressed = excluded.compressed, "
+        "level = excluded.level, toolchain = excluded.toolchain, "
+        "dict_id = excluded.dict_id, priority = excluded.priority, "
+        "compile_ms = MAX(compile_ms, excluded.compile_ms);",
+    [STMT_GET] =
+        "SELECT hash, size, compressed_size, accessed, compressed, level, dict_id, "
+        "compile_ms FROM cache_entries WHERE hash = ?;",
+    [STMT_TOUCH] =
+        "UPDATE cache_entries SET accessed = MAX(accessed, ?1), hits = hits + ?3, "
+        "priority = (SELECT value FROM counters WHERE name = 'gdsf_clock') + "
+        GDSF_VALUE("hits + ?3", "compressed_size") " "
+        "WHERE hash = ?2;",
+    [STMT_DELETE] =
+        "DELETE FROM cache_entries WHERE hash = ?;",
+    [STMT_SET_COMPRESSION] =
+        "UPDATE cache_entries SET compressed_size = ?, level = ? WHERE hash = ?;",
+    [STMT_RECOMPRESS_CANDIDATES] =
+        "SELECT hash, size, compressed_size, level, dict_id FROM cache_entries "
+        "WHERE compressed = 1 AND level < ? ORDER BY accessed DESC LIMIT ?;",
+    [STMT_GET_DICTIONARY] =
+        "SELECT dict_id FROM dictionaries WHERE toolchain = ?;",
+    [STMT_SET_DICTIONARY] =
+        "INSERT OR REPLACE INTO dictionaries (toolchain, dict_id, created) "
+        "VALUES (?, ?, ?);",
+    [STMT_TOOLCHAINS] =
+        "SELECT DISTINCT toolchain FROM cache_entries "
+        "WHERE toolchain != '' AND size <= ? ORDER BY toolchain;",
+    [STMT_DICT_SAMPLES] =
+        "SELECT hash, size FROM cache_entries "
+        "WHERE toolchain = ? AND size <= ? ORDER BY accessed DESC LIMIT ?;",
+    [STMT_TOTAL_SIZE] =
+        "SELECT value FROM counters WHERE name = 'total_size';",
+    [STMT_EVICT_LRU] =
+        "SELECT hash, size, compressed_size, accessed, compressed, level, dict_id, "
+        "compile_ms, hits, accessed "
+        "FROM cache_entries ORDER BY accessed ASC LIMIT ?;",
+    [STMT_EVICT_GDSF] =
+        "SELECT hash, size, compressed_size, accessed, compressed, level, dict_id, "
+        "compile_ms, hits, priority "
+        "FROM cache_entries ORDER BY priority ASC LIMIT ?;",
+    [STMT_EVICT_COST] =
+        "SELECT hash, size, compressed_size, accessed, compressed, level, dict_id, "
+        "compile_ms, hits, " COST_VALUE " "
+        "FROM cache_entries ORDER BY " COST_VALUE ", accessed LIMIT ?;",
+    [STMT_ADVANCE_CLOCK] =
+        "UPDATE counters SET value = MAX(value, ?) WHERE name = 'gdsf_clock';",
+    [STMT_TIME_SAVED] =
+        "SELECT COALESCE(SUM(compile_ms * hits), 0) FROM cache_entries;",
+    [STMT_OLD] =
+        "SELECT hash, size FROM cache_entries WHERE accessed < ? ORDER BY accessed ASC;",
+    [STMT_ALL] =
+        "SELECT hash, size FROM cache_entries ORDER BY accessed ASC;",
+    [STMT_EACH] =
+        "SELECT hash, size, compressed_size, accessed, compressed, level, dict_id, "
+        "compile_ms FROM cache_entries;",
+    [STMT_ENTRY_COUNT] =
+        "SELECT value FROM counters WHERE name = 'entries';",
+};
+
+static _Thread_local sqlite3_stmt *statements[STMT_COUNT];
+
+static int prepare_statements(void) {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        if (sqlite3_prepare_v3(db, statement_sql[i], -1, SQLITE_PREPARE_PERSISTENT,
+                               &statements[i], NULL) != SQLITE_OK) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void finalize_statements(void) {
+    for (int i = 0; i < STMT_COUNT; i++) {
+        sqlite3_finalize(statements[i]);
+        statements[i] = NULL;
+    }
+}
+
+/* ---------- KEYS ---------- */
+/* Keys are stored as 32-byte BLOBs; the API speaks hex. */
+static int bind_key(sqlite3_stmt *stmt, int index, const char *hex) {
+    hash_t key;
+    if (hash_from_hex(hex, key) != 0) return -1;
+    return sqlite3_bind_blob(stmt, index, key, HASH_SIZE, SQLITE_TRANSIENT) == SQLITE_OK ? 0 : -1;
+}
+
+static void column_key(sqlite3_stmt *stmt, int col, char hex[HASH_HEX_SIZE]) {
+    if (sqlite3_column_bytes(stmt, col) == HASH_SIZE) {
+        hash_to_hex(sqlite3_column_blob(stmt, col), hex);
+    } else {
+        hex[0] = '\0';
+    }
+}
+
+/* Columns hash, size, compressed_size, accessed, compressed, level,
+ * dict_id, compile_ms, as selected by STMT_GET, STMT_EACH and
+ * STMT_EVICT_* */
+static void column_entry(sqlite3_stmt *stmt, cache_entry_t *entry) {
+    column_key(stmt, 0, entry->hash);
+    entry->size = sqlite3_column_int64(stmt, 1);
+    entry->compressed_size = sqlite3_column_int64(stmt, 2);
+    entry->accessed = sqlite3_column_int64(stmt, 3);
+    entry->compressed = sqlite3_column_int(stmt, 4);
+    entry->level = sqlite3_column_int(stmt, 5);
+    entry->dict_id = (uint32_t)sqlite3_column_int64(stmt, 6);
+    entry->compile_ms = (uint32_t)sqlite3_column_int64(stmt, 7);
+}
 
-static sqlite3 *db = NULL;
+/* qc_unhex(text): the BLOB key for a hex key, or NULL. SQLite only has
+ * unhex() from 3.41, and migration step 3 needs it. */
+static void sql_unhex(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+    (void)argc;
+    const char *hex = (const char *)sqlite3_value_text(argv[0]);
+    hash_t key;
+    if (hex && hash_from_hex(hex, key) == 0) {
+        sqlite3_result_blob(ctx, key, HASH_SIZE, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_null(ctx);
+    }
+}
 
 void get_db_path(char *buf, size_t len) {
     char home[4096];
@@ -17,7 +194,112 @@ void get_db_path(char *buf, size_t len) {
     snprintf(buf, len, "%s/%s/cache.db", home, CACHE_DIR_NAME);
 }
 
+static int get_user_version(void) {
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    int version = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+/* Bring an existing database up to the current schema. Each step runs in
+ * its own transaction together with the user_version bump, so a crash or
+ * a concurrent process never leaves a half-migrated table. */
+static int migrate_schema(void) {
+    static const char *steps[] = {
+        /* 1: zstd level per object, for background recompression.
+         * Every object before this was written at level 3. */
+        "ALTER TABLE cache_entries ADD COLUMN level INTEGER NOT NULL DEFAULT 3;",
+        /* 2: toolchain and zstd dictionary per object, and the current
+         * dictionary of each toolchain */
+        "ALTER TABLE cache_entries ADD COLUMN toolchain TEXT NOT NULL DEFAULT '';"
+        "ALTER TABLE cache_entries ADD COLUMN dict_id INTEGER NOT NULL DEFAULT 0;"
+        "CREATE TABLE IF NOT EXISTS dictionaries ("
+        "toolchain TEXT PRIMARY KEY,"
+        "dict_id INTEGER NOT NULL,"
+        "created INTEGER NOT NULL"
+        ");",
+        /* 3: 32-byte BLOB keys in a WITHOUT ROWID table, and no path
+         * column: it is always cache_get_object_path() of the key */
+        "CREATE TABLE cache_entries_new ("
+        "hash BLOB PRIMARY KEY,"
+        "size INTEGER NOT NULL,"
+        "compressed_size INTEGER NOT NULL,"
+        "created INTEGER NOT NULL,"
+        "accessed INTEGER NOT NULL,"
+        "compressed INTEGER NOT NULL,"
+        "level INTEGER NOT NULL DEFAULT 3,"
+        "toolchain TEXT NOT NULL DEFAULT '',"
+        "dict_id INTEGER NOT NULL DEFAULT 0"
+        ") WITHOUT ROWID;"
+        "INSERT OR IGNORE INTO cache_entries_new "
+        "SELECT qc_unhex(hash), size, compressed_size, created, accessed, compressed, "
+        "level, toolchain, dict_id FROM cache_entries WHERE qc_unhex(hash) IS NOT NULL;"
+        "DROP TABLE cache_entries;"
+        "ALTER TABLE cache_entries_new RENAME TO cache_entries;"
+        "CREATE INDEX idx_accessed ON cache_entries(accessed);",
+        /* 4: running totals, kept by triggers so that checking the size
+         * limit does not scan the table */
+        "CREATE TABLE counters ("
+        "name TEXT PRIMARY KEY,"
+        "value INTEGER NOT NULL"
+        ") WITHOUT ROWID;"
+        "INSERT INTO counters SELECT 'total_size', COALESCE(SUM(compressed_size), 0) "
+        "FROM cache_entries;"
+        "INSERT INTO counters SELECT 'entries', COUNT(*) FROM cache_entries;"
+        "CREATE TRIGGER entries_insert AFTER INSERT ON cache_entries BEGIN "
+        "UPDATE counters SET value = value + NEW.compressed_size WHERE name = 'total_size';"
+        "UPDATE counters SET value = value + 1 WHERE name = 'entries';"
+        "END;"
+        "CREATE TRIGGER entries_delete AFTER DELETE ON cache_entries BEGIN "
+        "UPDATE counters SET value = value - OLD.compressed_size WHERE name = 'total_size';"
+        "UPDATE counters SET value = value - 1 WHERE name = 'entries';"
+        "END;"
+        "CREATE TRIGGER entries_resize AFTER UPDATE OF compressed_size ON cache_entries BEGIN "
+        "UPDATE counters SET value = value + NEW.compressed_size - OLD.compressed_size "
+        "WHERE name = 'total_size';"
+        "END;",
+        /* 5: what an entry is worth keeping, for the eviction policies:
+         * its compile time, its hits, and its GDSF priority */
+        "ALTER TABLE cache_entries ADD COLUMN compile_ms INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE cache_entries ADD COLUMN hits INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE cache_entries ADD COLUMN priority INTEGER NOT NULL DEFAULT 0;"
+        "UPDATE cache_entries SET priority = " GDSF_VALUE("0", "compressed_size") ";"
+        "CREATE INDEX idx_priority ON cache_entries(priority);"
+        "CREATE INDEX idx_cost ON cache_entries(" COST_VALUE ", accessed);"
+        "INSERT INTO counters VALUES ('gdsf_clock', 0);",
+    };
+    int target = (int)(sizeof(steps) / sizeof(steps[0]));
+
+    for (int version = get_user_version(); version >= 0 && version < target;
+         version = get_user_version()) {
+        char sql[4096];
+        snprintf(sql, sizeof(sql), "BEGIN IMMEDIATE; %s PRAGMA user_version = %d; COMMIT;",
+                 steps[version], version + 1);
+
+        char *err = NULL;
+        if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+            sqlite3_free(err);
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            /* Another process may have migrated first */
+            if (get_user_version() > version) continue;
+            return -1;
+        }
+    }
+
+    return get_user_version() >= target ? 0 : -1;
+}
+
 int metadata_init(void) {
+    if (db) return 0;
+
     char db_path[4096];
     get_db_path(db_path, sizeof(db_path));
 
@@ -29,9 +311,17 @@ int metadata_init(void) {
         int rc = sqlite3_open(db_path, &db);
         
         if (rc == SQLITE_OK) {
-            /* Enable WAL mode for better concurrent access */
+            /* Enable WAL mode for better concurrent access. With WAL,
+             * synchronous=NORMAL only syncs at checkpoints: a power loss
+             * can drop the last few entries but never corrupts the
+             * database. A lookup that finds an object without its entry
+             * re-adds a compressed one from its header and deletes a
+             * plain one (see cache_lookup). */
             char *err = NULL;
-            sqlite3_exec(db, "PRAGMA journal_mode=WAL;", NULL, NULL, &err);
+            sqlite3_exec(db, "PRAGMA journal_mode=WAL;"
+                             "PRAGMA synchronous=NORMAL;"
+                             "PRAGMA temp_store=MEMORY;"
+                             "PRAGMA mmap_size=268435456;", NULL, NULL, &err);
             if (err) sqlite3_free(err);
             
             /* Set busy timeout */
@@ -53,6 +343,7 @@ int metadata_init(void) {
     
     if (!db) return -1;
 
+    /* The original schema; migrate_schema() brings it up to date */
     const char *schema =
         "CREATE TABLE IF NOT EXISTS cache_entries ("
         "hash TEXT PRIMARY KEY,"
@@ -67,186 +358,501 @@ int metadata_init(void) {
     char *err = NULL;
     if (sqlite3_exec(db, schema, NULL, NULL, &err) != SQLITE_OK) {
         sqlite3_free(err);
+        metadata_close();
         return -1;
     }
 
     const char *index = "CREATE INDEX IF NOT EXISTS idx_accessed ON cache_entries(accessed);";
     if (sqlite3_exec(db, index, NULL, NULL, &err) != SQLITE_OK) {
         sqlite3_free(err);
+        metadata_close();
+        return -1;
+    }
+
+    if (sqlite3_create_function(db, "qc_unhex", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                sql_unhex, NULL, NULL) != SQLITE_OK ||
+        migrate_schema() == -1 || prepare_statements() == -1) {
+        metadata_close();
         return -1;
     }
 
     return 0;
 }
 
-int metadata_add(const char *hash, const char *path, size_t size, size_t compressed_size, int compressed) {
+/* ---------- TRANSACTIONS ---------- */
+/* Group many writes (an eviction or clean pass) into one transaction and
+ * one WAL commit. Without an open database, or if another writer holds
+ * the lock past the busy timeout, the writes run in autocommit instead. */
+int metadata_begin(void) {
+    if (!db) return -1;
+    return sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+int metadata_commit(void) {
     if (!db) return -1;
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK) return 0;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -1;
+}
 
-    const char *sql = "INSERT OR REPLACE INTO cache_entries "
-                      "(hash, path, size, compressed_size, created, accessed, compressed) "
-                      "VALUES (?, ?, ?, ?, ?, ?, ?);";
+int metadata_add(const char *hash, size_t size, size_t compressed_size,
+                 int compressed, int level, const char *toolchain, uint32_t dict_id,
+                 uint32_t compile_ms) {
+    if (!db) return -1;
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
-    }
+    hash_t key;
+    if (hash_from_hex(hash, key) != 0) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_ADD];
 
     time_t now = time(NULL);
 
-    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)size);
-    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)compressed_size);
+    sqlite3_bind_blob(stmt, 1, key, HASH_SIZE, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)size);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)compressed_size);
+    sqlite3_bind_int64(stmt, 4, (sqlite3_int64)now);
     sqlite3_bind_int64(stmt, 5, (sqlite3_int64)now);
-    sqlite3_bind_int64(stmt, 6, (sqlite3_int64)now);
-    sqlite3_bind_int(stmt, 7, compressed);
+    sqlite3_bind_int(stmt, 6, compressed);
+    sqlite3_bind_int(stmt, 7, level);
+    sqlite3_bind_text(stmt, 8, toolchain ? toolchain : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 9, (sqlite3_int64)dict_id);
+    sqlite3_bind_int64(stmt, 10, (sqlite3_int64)compile_ms);
 
     int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) return -1;
 
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    index_record_t rec = { size, compile_ms, dict_id, now, compressed, level };
+    index_put(key, &rec);
+    return 0;
 }
 
 int metadata_get(const char *hash, cache_entry_t *entry) {
     if (!db) return -1;
 
-    const char *sql = "SELECT * FROM cache_entries WHERE hash = ?;";
-
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
+    /* The index answers the hit path; SQLite only what it does not have */
+    hash_t key;
+    index_record_t rec;
+    if (hash_from_hex(hash, key) == 0 && index_lookup(key, &rec) == 0) {
+        memcpy(entry->hash, hash, HASH_HEX_SIZE);
+        entry->size = rec.size;
+        entry->compressed_size = 0;  /* not needed on the hit path */
+        entry->compile_ms = rec.compile_ms;
+        entry->accessed = rec.accessed;
+        entry->compressed = rec.compressed;
+        entry->level = rec.level;
+        entry->dict_id = rec.dict_id;
+        return 0;
     }
 
-    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_stmt *stmt = statements[STMT_GET];
 
-    if (sqlite3_step(stmt) != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
+    if (bind_key(stmt, 1, hash) != 0 || sqlite3_step(stmt) != SQLITE_ROW) {
+        sqlite3_reset(stmt);
         return -1;
     }
 
-    strncpy(entry->hash, (const char *)sqlite3_column_text(stmt, 0), HASH_HEX_SIZE);
-    strncpy(entry->path, (const char *)sqlite3_column_text(stmt, 1), 4096);
-    entry->size = sqlite3_column_int64(stmt, 2);
-    entry->compressed_size = sqlite3_column_int64(stmt, 3);
-    entry->created = sqlite3_column_int64(stmt, 4);
-    entry->accessed = sqlite3_column_int64(stmt, 5);
-    entry->compressed = sqlite3_column_int(stmt, 6);
+    column_entry(stmt, entry);
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 0;
 }
 
-int metadata_update_access(const char *hash) {
+/* Move an entry's access time forward to accessed (never backwards) and
+ * add hits to its hit count */
+int metadata_update_access(const char *hash, time_t accessed, int hits) {
     if (!db) return -1;
 
-    const char *sql = "UPDATE cache_entries SET accessed = ? WHERE hash = ?;";
+    sqlite3_stmt *stmt = statements[STMT_TOUCH];
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
-    }
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)accessed);
+    sqlite3_bind_int(stmt, 3, hits);
+    int rc = bind_key(stmt, 2, hash) == 0 ? sqlite3_step(stmt) : SQLITE_MISUSE;
+    sqlite3_reset(stmt);
 
-    time_t now = time(NULL);
-    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)now);
-    sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
 
-    int rc = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+int metadata_delete(const char *hash) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_DELETE];
+
+    int result = bind_key(stmt, 1, hash) == 0 ? sqlite3_step(stmt) : SQLITE_MISUSE;
+    sqlite3_reset(stmt);
+
+    hash_t key;
+    if (hash_from_hex(hash, key) == 0) index_remove(key);
+
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+int metadata_set_compression(const char *hash, size_t compressed_size, int level) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_SET_COMPRESSION];
+
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)compressed_size);
+    sqlite3_bind_int(stmt, 2, level);
+    int rc = bind_key(stmt, 3, hash) == 0 ? sqlite3_step(stmt) : SQLITE_MISUSE;
+    sqlite3_reset(stmt);
+
+    hash_t key;
+    index_record_t rec;
+    if (hash_from_hex(hash, key) == 0 && index_lookup(key, &rec) == 0) {
+        rec.level = level;
+        index_put(key, &rec);
+    }
 
     return (rc == SQLITE_DONE) ? 0 : -1;
 }
 
-int metadata_delete(const char *hash) {
+/* Compressed objects written below the given level, most recently used
+ * first so the entries likely to be hit again shrink first. */
+int metadata_get_recompress_candidates(int level, int limit, cache_entry_t **entries, int *count) {
     if (!db) return -1;
 
-    const char *sql = "DELETE FROM cache_entries WHERE hash = ?;";
+    sqlite3_stmt *stmt = statements[STMT_RECOMPRESS_CANDIDATES];
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
+    sqlite3_bind_int(stmt, 1, level);
+    sqlite3_bind_int(stmt, 2, limit > 0 ? limit : -1);
+
+    *entries = NULL;
+    *count = 0;
+    int capacity = 0;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (*count >= capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            *entries = realloc(*entries, capacity * sizeof(cache_entry_t));
+        }
+
+        cache_entry_t *entry = &(*entries)[*count];
+        memset(entry, 0, sizeof(*entry));
+        column_key(stmt, 0, entry->hash);
+        entry->size = sqlite3_column_int64(stmt, 1);
+        entry->compressed_size = sqlite3_column_int64(stmt, 2);
+        entry->compressed = 1;
+        entry->level = sqlite3_column_int(stmt, 3);
+        entry->dict_id = (uint32_t)sqlite3_column_int64(stmt, 4);
+        (*count)++;
     }
 
-    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_reset(stmt);
+    return 0;
+}
 
-    int result = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+/* ---------- ACCESS LOG ---------- */
+/* A hit only reads the database. Its access time is appended to
+ * access.log as one short line; O_APPEND writes that small are atomic,
+ * so concurrent compiles need no lock. metadata_fold_access() later
+ * applies the log in one transaction. Hits within access_granularity of
+ * the access time already in the database are not logged at all. */
+typedef struct {
+    char hash[HASH_HEX_SIZE];
+    time_t accessed;
+} access_record_t;
+
+static void access_log_path(char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/access.log", cache_dir);
+}
 
-    return result == SQLITE_DONE ? 0 : -1;
+int metadata_record_access(const cache_entry_t *entry) {
+    time_t now = time(NULL);
+    if (now - entry->accessed < config_get()->access_granularity) return 0;
+
+    char path[4096];
+    char line[HASH_HEX_SIZE + 32];
+    access_log_path(path, sizeof(path));
+    int n = snprintf(line, sizeof(line), "%s %lld\n", entry->hash, (long long)now);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    int rc = write(fd, line, n) == n ? 0 : -1;
+    close(fd);
+
+    /* Keeps the granularity check working between folds */
+    hash_t key;
+    if (hash_from_hex(entry->hash, key) == 0) index_touch(key, now);
+    return rc;
 }
 
-uint64_t metadata_total_size(void) {
-    if (!db) return 0;
+static int compare_records(const void *a, const void *b) {
+    const access_record_t *x = a, *y = b;
+    int c = strcmp(x->hash, y->hash);
+    if (c != 0) return c;
+    return (x->accessed > y->accessed) - (x->accessed < y->accessed);
+}
 
-    const char *sql = "SELECT SUM(compressed_size) FROM cache_entries;";
+/* Apply the access log to cache_entries once it has reached min_size
+ * bytes (0: whenever it is not empty). The log is renamed away first, so
+ * hits keep appending to a fresh one and concurrent folds never apply
+ * the same records. Returns the number of entries updated. */
+int metadata_fold_access(size_t min_size) {
+    if (!db) return -1;
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    char path[4096];
+    char fold_path[4200];
+    struct stat st;
+    access_log_path(path, sizeof(path));
+    if (stat(path, &st) != 0 || st.st_size == 0 || (size_t)st.st_size < min_size) {
         return 0;
     }
 
-    uint64_t total = 0;
+    snprintf(fold_path, sizeof(fold_path), "%s.%d", path, (int)getpid());
+    if (rename(path, fold_path) != 0) return 0;  /* another process took it */
+
+    size_t len;
+    char *data = read_file(fold_path, &len);
+    unlink(fold_path);
+    if (!data) return -1;
+
+    size_t capacity = len / (HASH_HEX_SIZE + 1) + 1;
+    access_record_t *records = malloc(capacity * sizeof(access_record_t));
+    size_t count = 0;
+
+    for (char *line = data; records && line < data + len; ) {
+        char *nl = memchr(line, '\n', data + len - line);
+        if (!nl) break;  /* torn last line */
+        *nl = '\0';
+
+        access_record_t *r = &records[count];
+        long long t;
+        if (count < capacity && sscanf(line, "%64s %lld", r->hash, &t) == 2 &&
+            strlen(r->hash) == HASH_HEX_SIZE - 1) {
+            r->accessed = (time_t)t;
+            count++;
+        }
+        line = nl + 1;
+    }
+    free(data);
+    if (!records) return -1;
+
+    /* Coalesce: each entry gets its latest access and one hit per record */
+    qsort(records, count, sizeof(access_record_t), compare_records);
+
+    int updated = 0;
+    int hits = 0;
+    int in_txn = metadata_begin() == 0;
+    for (size_t i = 0; i < count; i++) {
+        hits++;
+        if (i + 1 < count && strcmp(records[i].hash, records[i + 1].hash) == 0) continue;
+        if (metadata_update_access(records[i].hash, records[i].accessed, hits) == 0) updated++;
+        hits = 0;
+    }
+    if (in_txn) metadata_commit();
+
+    free(records);
+    return updated;
+}
+
+/* ---------- BULK ---------- */
+uint64_t metadata_entry_count(void) {
+    if (!db) return 0;
+
+    sqlite3_stmt *stmt = statements[STMT_ENTRY_COUNT];
+
+    uint64_t count = 0;
     if (sqlite3_step(stmt) == SQLITE_ROW) {
-        total = sqlite3_column_int64(stmt, 0);
+        count = sqlite3_column_int64(stmt, 0);
     }
 
-    sqlite3_finalize(stmt);
-    return total;
+    sqlite3_reset(stmt);
+    return count;
 }
 
-int metadata_get_lru_entries(cache_entry_t **entries, int *count, size_t limit) {
+/* Call fn for every entry. Stops
+ * early and returns fn's result if it is non-zero. */
+int metadata_for_each(int (*fn)(const cache_entry_t *entry, void *arg), void *arg) {
     if (!db) return -1;
 
-    const char *sql = "SELECT * FROM cache_entries ORDER BY accessed ASC;";
+    sqlite3_stmt *stmt = statements[STMT_EACH];
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
+    int rc = 0;
+    cache_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+
+    while (rc == 0 && sqlite3_step(stmt) == SQLITE_ROW) {
+        column_entry(stmt, &entry);
+        rc = fn(&entry, arg);
+    }
+
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+/* ---------- DICTIONARIES ---------- */
+int metadata_get_dictionary(const char *toolchain, uint32_t *dict_id) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_GET_DICTIONARY];
+
+    sqlite3_bind_text(stmt, 1, toolchain, -1, SQLITE_STATIC);
+
+    int rc = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *dict_id = (uint32_t)sqlite3_column_int64(stmt, 0);
+        rc = 0;
+    }
+
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+int metadata_set_dictionary(const char *toolchain, uint32_t dict_id) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_SET_DICTIONARY];
+
+    sqlite3_bind_text(stmt, 1, toolchain, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)dict_id);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL));
+
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/* Toolchains that have stored at least one object of at most max_size */
+int metadata_get_toolchains(size_t max_size, char ***toolchains, int *count) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_TOOLCHAINS];
+
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)max_size);
+
+    *toolchains = NULL;
+    *count = 0;
+    int capacity = 0;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (*count >= capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            *toolchains = realloc(*toolchains, capacity * sizeof(char *));
+        }
+        (*toolchains)[(*count)++] = strdup((const char *)sqlite3_column_text(stmt, 0));
     }
 
-    int capacity = 100;
-    *entries = malloc(capacity * sizeof(cache_entry_t));
+    sqlite3_reset(stmt);
+    return 0;
+}
+
+/* Training samples for a toolchain: its objects of at most max_size,
+ * most recently used first. */
+int metadata_get_dict_samples(const char *toolchain, size_t max_size, int limit,
+                              cache_entry_t **entries, int *count) {
+    if (!db) return -1;
+
+    sqlite3_stmt *stmt = statements[STMT_DICT_SAMPLES];
+
+    sqlite3_bind_text(stmt, 1, toolchain, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)max_size);
+    sqlite3_bind_int(stmt, 3, limit);
+
+    *entries = NULL;
     *count = 0;
+    int capacity = 0;
 
-    uint64_t total = 0;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         if (*count >= capacity) {
-            capacity *= 2;
+            capacity = capacity == 0 ? 64 : capacity * 2;
             *entries = realloc(*entries, capacity * sizeof(cache_entry_t));
         }
 
         cache_entry_t *entry = &(*entries)[*count];
-        strncpy(entry->hash, (const char *)sqlite3_column_text(stmt, 0), HASH_HEX_SIZE);
-        strncpy(entry->path, (const char *)sqlite3_column_text(stmt, 1), 4096);
-        entry->size = sqlite3_column_int64(stmt, 2);
-        entry->compressed_size = sqlite3_column_int64(stmt, 3);
-        entry->created = sqlite3_column_int64(stmt, 4);
-        entry->accessed = sqlite3_column_int64(stmt, 5);
-        entry->compressed = sqlite3_column_int(stmt, 6);
-
-        total += entry->compressed_size;
+        memset(entry, 0, sizeof(*entry));
+        column_key(stmt, 0, entry->hash);
+        entry->size = sqlite3_column_int64(stmt, 1);
         (*count)++;
+    }
 
-        if (total > limit) {
-            break;
-        }
+    sqlite3_reset(stmt);
+    return 0;
+}
+
+uint64_t metadata_total_size(void) {
+    if (!db) return 0;
+
+    sqlite3_stmt *stmt = statements[STMT_TOTAL_SIZE];
+
+    uint64_t total = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        total = sqlite3_column_int64(stmt, 0);
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    return total;
+}
+
+/* The first limit entries to evict under a policy, in order. Each
+ * entry's rank is its position in that order (access time, GDSF
+ * priority, or compile time saved per byte). */
+int metadata_get_eviction_candidates(eviction_policy_t policy, int limit,
+                                     cache_entry_t **entries, int *count) {
+    if (!db) return -1;
+
+    *count = 0;
+    *entries = malloc(limit * sizeof(cache_entry_t));
+    if (!*entries) return -1;
+
+    sqlite3_stmt *stmt = statements[policy == EVICT_GDSF ? STMT_EVICT_GDSF :
+                                    policy == EVICT_COST ? STMT_EVICT_COST :
+                                    STMT_EVICT_LRU];
+
+    sqlite3_bind_int(stmt, 1, limit);
+
+    while (*count < limit && sqlite3_step(stmt) == SQLITE_ROW) {
+        cache_entry_t *entry = &(*entries)[*count];
+        column_entry(stmt, entry);
+        entry->hits = (uint32_t)sqlite3_column_int64(stmt, 8);
+        entry->rank = sqlite3_column_double(stmt, 9);
+        (*count)++;
+    }
+
+    sqlite3_reset(stmt);
     return 0;
 }
 
-int metadata_get_old_entries(int days, cache_entry_t **entries, int *count) {
+/* Age the GDSF priorities: later entries start from the evicted one's */
+int metadata_advance_clock(const cache_entry_t *evicted) {
     if (!db) return -1;
 
-    time_t cutoff = time(NULL) - (days * 24 * 3600);
+    sqlite3_stmt *stmt = statements[STMT_ADVANCE_CLOCK];
 
-    const char *sql = "SELECT hash, size FROM cache_entries WHERE accessed < ? ORDER BY accessed ASC;";
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)evicted->rank);
 
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+
+    return (rc == SQLITE_DONE) ? 0 : -1;
+}
+
+/* Compile time the entries now in the cache have saved, in ms: each
+ * one's compile time times its recorded hits */
+uint64_t metadata_time_saved(void) {
+    if (!db) return 0;
+
+    sqlite3_stmt *stmt = statements[STMT_TIME_SAVED];
+
+    uint64_t saved = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        saved = sqlite3_column_int64(stmt, 0);
     }
 
+    sqlite3_reset(stmt);
+    return saved;
+}
+
+int metadata_get_old_entries(int days, cache_entry_t **entries, int *count) {
+    if (!db) return -1;
+
+    time_t cutoff = time(NULL) - (days * 24 * 3600);
+
+    sqlite3_stmt *stmt = statements[STMT_OLD];
+
     sqlite3_bind_int64(stmt, 1, (sqlite3_int64)cutoff);
 
     *entries = NULL;
@@ -259,27 +865,21 @@ int metadata_get_old_entries(int days, cache_entry_t **entries, int *count) {
             *entries = realloc(*entries, capacity * sizeof(cache_entry_t));
         }
 
-        const char *hash = (const char *)sqlite3_column_text(stmt, 0);
-        size_t size = (size_t)sqlite3_column_int64(stmt, 1);
-
-        strncpy((*entries)[*count].hash, hash, sizeof((*entries)[*count].hash) - 1);
-        (*entries)[*count].size = size;
+        cache_entry_t *entry = &(*entries)[*count];
+        memset(entry, 0, sizeof(*entry));
+        column_key(stmt, 0, entry->hash);
+        entry->size = sqlite3_column_int64(stmt, 1);
         (*count)++;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 0;
 }
 
 int metadata_get_all_entries(cache_entry_t **entries, int *count) {
     if (!db) return -1;
 
-    const char *sql = "SELECT hash, size FROM cache_entries ORDER BY accessed ASC;";
-
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-        return -1;
-    }
+    sqlite3_stmt *stmt = statements[STMT_ALL];
 
     *entries = NULL;
     *count = 0;
@@ -291,20 +891,20 @@ int metadata_get_all_entries(cache_entry_t **entries, int *count) {
             *entries = realloc(*entries, capacity * sizeof(cache_entry_t));
         }
 
-        const char *hash = (const char *)sqlite3_column_text(stmt, 0);
-        size_t size = (size_t)sqlite3_column_int64(stmt, 1);
-
-        strncpy((*entries)[*count].hash, hash, sizeof((*entries)[*count].hash) - 1);
-        (*entries)[*count].size = size;
+        cache_entry_t *entry = &(*entries)[*count];
+        memset(entry, 0, sizeof(*entry));
+        column_key(stmt, 0, entry->hash);
+        entry->size = sqlite3_column_int64(stmt, 1);
         (*count)++;
     }
 
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
     return 0;
 }
 
 void metadata_close(void) {
     if (db) {
+        finalize_statements();
         sqlite3_close(db);
         db = NULL;
     }
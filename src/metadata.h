@@ -5,25 +5,48 @@
 #include <stddef.h>
 #include <time.h>
 #include <stdint.h>
+#include "config.h"
 #include "hash.h"
 
 typedef struct {
-    char hash[HASH_HEX_SIZE];
-    char path[4096];
+    char hash[HASH_HEX_SIZE];  /* the object is cache_get_object_path() of it */
     size_t size;
     size_t compressed_size;
-    time_t created;
     time_t accessed;
     int compressed;
+    int level;  /* zstd level of a compressed object; 0 if unknown */
+    uint32_t dict_id;  /* zstd dictionary it was compressed with, or 0 */
+    uint32_t compile_ms;  /* wall time of the compile that stored it, or 0 */
+    /* Filled in by metadata_get_eviction_candidates() only */
+    uint32_t hits;
+    double rank;
 } cache_entry_t;
 
 int metadata_init(void);
-int metadata_add(const char *hash, const char *path, size_t size, size_t compressed_size, int compressed);
+int metadata_add(const char *hash, size_t size, size_t compressed_size,
+                 int compressed, int level, const char *toolchain, uint32_t dict_id,
+                 uint32_t compile_ms);
 int metadata_get(const char *hash, cache_entry_t *entry);
-int metadata_update_access(const char *hash);
+int metadata_update_access(const char *hash, time_t accessed, int hits);
+int metadata_record_access(const cache_entry_t *entry);
+int metadata_fold_access(size_t min_size);
 int metadata_delete(const char *hash);
 uint64_t metadata_total_size(void);
-int metadata_get_lru_entries(cache_entry_t **entries, int *count, size_t limit);
+int metadata_set_compression(const char *hash, size_t compressed_size, int level);
+int metadata_get_recompress_candidates(int level, int limit, cache_entry_t **entries, int *count);
+int metadata_get_dictionary(const char *toolchain, uint32_t *dict_id);
+int metadata_set_dictionary(const char *toolchain, uint32_t dict_id);
+int metadata_get_toolchains(size_t max_size, char ***toolchains, int *count);
+int metadata_get_dict_samples(const char *toolchain, size_t max_size, int limit,
+                              cache_entry_t **entries, int *count);
+int metadata_get_eviction_candidates(eviction_policy_t policy, int limit,
+                                     cache_entry_t **entries, int *count);
+int metadata_advance_clock(const cache_entry_t *evicted);
+uint64_t metadata_time_saved(void);
+uint64_t metadata_entry_count(void);
+int metadata_for_each(int (*fn)(const cache_entry_t *entry, void *arg), void *arg);
+int metadata_begin(void);
+int metadata_commit(void);
 void metadata_close(void);
 
 #endif
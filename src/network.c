@@ -7,21 +7,80 @@
 #include <pthread.h>
 #include <curl/curl.h>
 #include "network.h"
+#include "bloom.h"
 #include "config.h"
 #include "hash.h"
+#include "spool.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
-typedef struct {
-    hash_t key;
-    char file_path[4096];
-} upload_job_t;
 
-static pthread_mutex_t upload_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
-static upload_job_t *upload_queue = NULL;
-static int upload_queue_size = 0;
-static int upload_queue_capacity = 0;
-static pthread_t upload_thread;
-static int upload_thread_running = 0;
+/* ---------- CONNECTION POOL ---------- */
+/* Easy handles are kept between requests instead of being created and
+ * destroyed for each one, and all of them share one connection cache,
+ * DNS cache and TLS session cache through a curl share object. A GET,
+ * the PUT after a miss and the uploads of a long-running daemon thus
+ * reuse a kept-alive connection (one HTTP/2 connection when the server
+ * offers h2 over TLS) instead of paying a new handshake each time. */
+#define POOL_SIZE 4
+
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CURL *pool[POOL_SIZE];
+static int pool_count = 0;
+
+/* Request headers, built once */
+static struct curl_slist *get_headers = NULL;
+static struct curl_slist *put_headers = NULL;
+static struct curl_slist *batch_headers = NULL;
+static int network_ready = 0;
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *arg) {
+    (void)handle; (void)access; (void)arg;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *arg) {
+    (void)handle; (void)arg;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+/* A handle with the options every request uses; the caller sets the rest */
+static CURL *handle_acquire(void) {
+    CURL *curl = NULL;
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_count > 0) curl = pool[--pool_count];
+    pthread_mutex_unlock(&pool_mutex);
+
+    /* A reset handle keeps its connections and caches */
+    if (curl) curl_easy_reset(curl);
+    else curl = curl_easy_init();
+    if (!curl) return NULL;
+
+    if (share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    return curl;
+}
+
+/* Return a handle after a request, counting whether it had to connect */
+static void handle_release(CURL *curl) {
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    stats_record_remote_request((uint64_t)connects);
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_count < POOL_SIZE) {
+        pool[pool_count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    if (curl) curl_easy_cleanup(curl);
+}
 
 // Callback for writing downloaded data
 static size_t write_callback(void *ptr, size_t size, size_t nmemb, FILE *stream) {
@@ -34,16 +93,37 @@ static size_t read_callback(void *ptr, size_t size, size_t nmemb, FILE *stream)
 }
 
 int network_init(void) {
+    if (network_ready) return 0;
+    network_ready = 1;
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    return 0;
-}
 
-void network_cleanup(void) {
-    if (upload_thread_running) {
-        upload_thread_running = 0;
-        pthread_join(upload_thread, NULL);
+    const quickcache_config_t *cfg = config_get();
+    /* Mapped now, before the daemon's threads can race to do it */
+    if (cfg->remote_enabled) bloom_init();
+
+    if (cfg->auth_token[0] != '\0') {
+        char auth_header[512];
+        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", cfg->auth_token);
+        get_headers = curl_slist_append(get_headers, auth_header);
+        put_headers = curl_slist_append(put_headers, auth_header);
+        batch_headers = curl_slist_append(batch_headers, auth_header);
     }
-    curl_global_cleanup();
+    put_headers = curl_slist_append(put_headers, "Content-Type: application/octet-stream");
+    batch_headers = curl_slist_append(batch_headers, "Content-Type: text/plain");
+
+    /* Without a share, each pooled handle still keeps its own connection */
+    share = curl_share_init();
+    if (share) {
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_init(&share_locks[i], NULL);
+        }
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    return 0;
 }
 
 int network_get(const hash_t key, const char *output_path) {
@@ -56,48 +136,54 @@ int network_get(const hash_t key, const char *output_path) {
     char url[1024];
     snprintf(url, sizeof(url), "%s/cache/%s", cfg->remote_url, hex);
 
-    CURL *curl = curl_easy_init();
+    CURL *curl = handle_acquire();
     if (!curl) return -1;
 
     FILE *f = fopen(output_path, "wb");
     if (!f) {
-        curl_easy_cleanup(curl);
+        handle_release(curl);
         return -1;
     }
 
-    struct curl_slist *headers = NULL;
-    if (cfg->auth_token[0] != '\0') {
-        char auth_header[512];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", cfg->auth_token);
-        headers = curl_slist_append(headers, auth_header);
-    }
-
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, f);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, cfg->timeout_seconds);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    if (headers) {
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (get_headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, get_headers);
     }
 
     CURLcode res = curl_easy_perform(curl);
     long http_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    handle_release(curl);
     fclose(f);
 
     if (res != CURLE_OK || http_code != 200) {
+        /* A 404 is an ordinary miss */
+        if (res != CURLE_OK || http_code != 404) stats_record_error(STAT_ERROR_REMOTE);
+        else stats_record_remote_miss();
         unlink(output_path);
         return -1;
     }
 
+    bloom_add(key);
     return 0;
 }
 
-int network_put(const hash_t key, const char *file_path) {
+/* ---------- UPLOADS ---------- */
+typedef struct {
+    CURL *curl;
+    FILE *file;
+    unsigned long id;  /* of its trace events */
+    hash_t key;
+    int spooled;       /* has a spool entry to remove once uploaded */
+} upload_t;
+
+/* Set up a PUT of file_path on a pooled handle */
+static int upload_start(upload_t *up, const hash_t key, const char *file_path) {
     const quickcache_config_t *cfg = config_get();
     if (!cfg->remote_enabled) return -1;
 
@@ -114,101 +200,615 @@ int network_put(const hash_t key, const char *file_path) {
     long file_size = ftell(f);
     fseek(f, 0, SEEK_SET);
 
-    CURL *curl = curl_easy_init();
+    CURL *curl = handle_acquire();
     if (!curl) {
         fclose(f);
         return -1;
     }
 
-    struct curl_slist *headers = NULL;
-    if (cfg->auth_token[0] != '\0') {
-        char auth_header[512];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", cfg->auth_token);
-        headers = curl_slist_append(headers, auth_header);
-    }
-    headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
-
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
     curl_easy_setopt(curl, CURLOPT_READFUNCTION, read_callback);
     curl_easy_setopt(curl, CURLOPT_READDATA, f);
     curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)file_size);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, cfg->timeout_seconds * 2);
-    if (headers) {
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, put_headers);
 
-    CURLcode res = curl_easy_perform(curl);
+    up->curl = curl;
+    up->file = f;
+    memcpy(up->key, key, HASH_SIZE);
+    up->spooled = 0;
+    return 0;
+}
+
+/* Collect the outcome of a finished PUT and give back its handle */
+static int upload_finish(upload_t *up, CURLcode res) {
     long http_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(up->curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    fclose(f);
+    handle_release(up->curl);
+    fclose(up->file);
 
     if (res != CURLE_OK || (http_code != 200 && http_code != 201)) {
+        stats_record_error(STAT_ERROR_REMOTE);
         return -1;
     }
-
+    bloom_add(up->key);
     return 0;
 }
 
-// Background upload thread
-static void* upload_worker(void *arg) {
+int network_put(const hash_t key, const char *file_path) {
+    upload_t up;
+    if (upload_start(&up, key, file_path) != 0) return -1;
+
+    trace_begin("upload", key);
+    CURLcode res = curl_easy_perform(up.curl);
+    trace_end("upload");
+    return upload_finish(&up, res);
+}
+
+/* Async uploads go through a fixed ring of jobs to one worker thread,
+ * which runs up to upload_concurrency of them at once on a curl multi
+ * handle (multiplexed over one connection when the server speaks
+ * HTTP/2). The worker sleeps on a condition variable while there is
+ * nothing to do, and curl_multi_wakeup() cuts its poll short when a job
+ * arrives mid-transfer. A full ring drops the new upload, or with
+ * upload_queue_full=block makes the caller wait for room. Uploads still
+ * queued or running upload_drain_ms after network_cleanup() starts are
+ * abandoned, so exit waits at most that long. Wrappers and the daemon
+ * normally hand uploads to the spool instead (see spool.c); the ring
+ * then runs in the detached uploader. */
+#define UPLOAD_POLL_MS 100
+#define UPLOAD_MAX_CONCURRENCY 64
+
+typedef struct {
+    hash_t key;
+    char file_path[4096];
+    int spooled;
+} upload_job_t;
+
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_ready = PTHREAD_COND_INITIALIZER;  /* a job, or stopping */
+static pthread_cond_t upload_room = PTHREAD_COND_INITIALIZER;   /* a free slot */
+static pthread_cond_t upload_idle = PTHREAD_COND_INITIALIZER;   /* nothing queued or running */
+static upload_job_t *upload_ring = NULL;
+static int ring_capacity = 0;
+static int ring_head = 0;
+static int ring_count = 0;
+static int upload_inflight = 0;  /* taken off the ring, not yet finished */
+static uint64_t upload_done = 0;  /* successful uploads */
+static pthread_t upload_thread;
+static int upload_thread_running = 0;
+static int upload_stopping = 0;
+static uint64_t upload_deadline_ns = 0;
+static CURLM *upload_multi = NULL;
+
+/* Account for a job that has finished, one way or another */
+static void upload_job_done(const hash_t key, int spooled, const char *file_path, int ok) {
+    /* Uploaded, or its object is gone: either way nothing is left to do */
+    if (spooled && (ok || (file_path && !file_exists(file_path)))) {
+        spool_remove(key);
+    }
+
+    pthread_mutex_lock(&upload_mutex);
+    upload_inflight--;
+    if (ok) upload_done++;
+    if (ring_count == 0 && upload_inflight == 0) pthread_cond_broadcast(&upload_idle);
+    pthread_mutex_unlock(&upload_mutex);
+}
+
+/* Abandon a transfer at the drain deadline */
+static void upload_abort(upload_t *up) {
+    curl_multi_remove_handle(upload_multi, up->curl);
+    curl_easy_cleanup(up->curl);
+    fclose(up->file);
+    trace_async_end("upload", up->id);
+}
+
+static void *upload_worker(void *arg) {
     (void)arg;
 
-    while (upload_thread_running) {
-        upload_job_t job;
-        int has_job = 0;
+    int concurrency = config_get()->upload_concurrency;
+    if (concurrency < 1) concurrency = 1;
+    if (concurrency > UPLOAD_MAX_CONCURRENCY) concurrency = UPLOAD_MAX_CONCURRENCY;
+    upload_t active[UPLOAD_MAX_CONCURRENCY];
+    int n_active = 0;
+    unsigned long next_id = 0;
+
+    pthread_mutex_lock(&upload_mutex);
+    for (;;) {
+        while (ring_count == 0 && n_active == 0 && !upload_stopping) {
+            pthread_cond_wait(&upload_ready, &upload_mutex);
+        }
+        int stopping = upload_stopping;
+        uint64_t now = stats_clock_ns();
+        if (stopping && ((ring_count == 0 && n_active == 0) || now >= upload_deadline_ns)) {
+            break;
+        }
+        int timeout_ms = UPLOAD_POLL_MS;
+        if (stopping && (upload_deadline_ns - now) / 1000000 < UPLOAD_POLL_MS) {
+            timeout_ms = (int)((upload_deadline_ns - now) / 1000000) + 1;
+        }
 
-        pthread_mutex_lock(&upload_queue_mutex);
-        if (upload_queue_size > 0) {
-            job = upload_queue[0];
-            for (int i = 1; i < upload_queue_size; i++) {
-                upload_queue[i - 1] = upload_queue[i];
+        while (ring_count > 0 && n_active < concurrency) {
+            upload_job_t job = upload_ring[ring_head];
+            ring_head = (ring_head + 1) % ring_capacity;
+            ring_count--;
+            upload_inflight++;
+            pthread_cond_signal(&upload_room);
+            pthread_mutex_unlock(&upload_mutex);
+
+            upload_t *up = &active[n_active];
+            if (upload_start(up, job.key, job.file_path) == 0) {
+                up->id = next_id++;
+                up->spooled = job.spooled;
+                trace_async_begin("upload", up->id, job.key);
+                curl_multi_add_handle(upload_multi, up->curl);
+                n_active++;
+            } else {
+                upload_job_done(job.key, job.spooled, job.file_path, 0);
+            }
+            pthread_mutex_lock(&upload_mutex);
+        }
+        pthread_mutex_unlock(&upload_mutex);
+
+        int running;
+        curl_multi_perform(upload_multi, &running);
+
+        CURLMsg *msg;
+        int left, finished = 0;
+        while ((msg = curl_multi_info_read(upload_multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            CURL *done = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            for (int i = 0; i < n_active; i++) {
+                if (active[i].curl != done) continue;
+                curl_multi_remove_handle(upload_multi, done);
+                trace_async_end("upload", active[i].id);
+                int ok = upload_finish(&active[i], res) == 0;
+                upload_job_done(active[i].key, active[i].spooled, NULL, ok);
+                active[i] = active[--n_active];
+                finished++;
+                break;
             }
-            upload_queue_size--;
-            has_job = 1;
         }
-        pthread_mutex_unlock(&upload_queue_mutex);
 
-        if (has_job) {
-            network_put(job.key, job.file_path);
-        } else {
-            // Fixed usleep issue
-            struct timespec ts = {0, 100000000}; // 100ms
-            nanosleep(&ts, NULL);
+        /* A freed slot is refilled before waiting on the others */
+        if (n_active > 0 && finished == 0) {
+            curl_multi_poll(upload_multi, NULL, 0, timeout_ms, NULL);
         }
+        pthread_mutex_lock(&upload_mutex);
     }
 
+    /* Past the deadline: whatever is left is not uploaded */
+    uint64_t dropped = (uint64_t)ring_count + (uint64_t)n_active;
+    ring_count = 0;
+    upload_inflight = 0;
+    pthread_cond_broadcast(&upload_room);
+    pthread_cond_broadcast(&upload_idle);
+    pthread_mutex_unlock(&upload_mutex);
+
+    for (int i = 0; i < n_active; i++) {
+        upload_abort(&active[i]);
+    }
+    if (dropped > 0) stats_record_upload_dropped(dropped);
     return NULL;
 }
 
+/* Called with upload_mutex held */
+static int uploads_start(void) {
+    const quickcache_config_t *cfg = config_get();
+    ring_capacity = cfg->upload_queue_size > 0 ? cfg->upload_queue_size : 1;
+    upload_ring = calloc((size_t)ring_capacity, sizeof(upload_job_t));
+    upload_multi = curl_multi_init();
+    if (!upload_ring || !upload_multi) goto fail;
+
+    curl_multi_setopt(upload_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    ring_head = ring_count = 0;
+    upload_stopping = 0;
+    if (pthread_create(&upload_thread, NULL, upload_worker, NULL) != 0) goto fail;
+    upload_thread_running = 1;
+    return 0;
+
+fail:
+    free(upload_ring);
+    upload_ring = NULL;
+    if (upload_multi) curl_multi_cleanup(upload_multi);
+    upload_multi = NULL;
+    return -1;
+}
+
+/* Let queued uploads finish, up to upload_drain_ms, then stop the worker */
+static void uploads_drain(void) {
+    if (!upload_thread_running) return;
+
+    pthread_mutex_lock(&upload_mutex);
+    upload_stopping = 1;
+    upload_deadline_ns = stats_clock_ns() + (uint64_t)config_get()->upload_drain_ms * 1000000u;
+    pthread_cond_broadcast(&upload_ready);
+    pthread_cond_broadcast(&upload_room);
+    pthread_mutex_unlock(&upload_mutex);
+    curl_multi_wakeup(upload_multi);
+
+    pthread_join(upload_thread, NULL);
+    upload_thread_running = 0;
+    curl_multi_cleanup(upload_multi);
+    upload_multi = NULL;
+    free(upload_ring);
+    upload_ring = NULL;
+}
+
+/* Queue an upload for the worker, starting it if needed. A full ring
+ * drops the job unless block is set. */
+static int upload_enqueue(const hash_t key, const char *file_path, int spooled, int block) {
+    pthread_mutex_lock(&upload_mutex);
+    if (!upload_thread_running && uploads_start() != 0) {
+        pthread_mutex_unlock(&upload_mutex);
+        return -1;
+    }
+
+    while (ring_count == ring_capacity) {
+        if (!block || upload_stopping) {
+            pthread_mutex_unlock(&upload_mutex);
+            stats_record_upload_dropped(1);
+            return 0;
+        }
+        pthread_cond_wait(&upload_room, &upload_mutex);
+    }
+
+    upload_job_t *job = &upload_ring[(ring_head + ring_count) % ring_capacity];
+    memcpy(job->key, key, HASH_SIZE);
+    snprintf(job->file_path, sizeof(job->file_path), "%s", file_path);
+    job->spooled = spooled;
+    ring_count++;
+    pthread_cond_signal(&upload_ready);
+    pthread_mutex_unlock(&upload_mutex);
+
+    /* The worker may be polling transfers rather than waiting */
+    curl_multi_wakeup(upload_multi);
+    return 0;
+}
+
+/* Upload in the background. The job is written to the spool and left to
+ * the detached uploader, so this process can exit at once; without a
+ * spool it runs on this process's own worker. A key the server is known
+ * to have is not uploaded at all. */
 void network_put_async(const hash_t key, const char *file_path) {
     const quickcache_config_t *cfg = config_get();
+    if (cfg->remote_enabled && bloom_contains(key)) {
+        stats_record_upload_skipped(1);
+        return;
+    }
     if (!cfg->remote_enabled || !cfg->async_upload) {
         network_put(key, file_path);
         return;
     }
 
-    if (!upload_thread_running) {
-        upload_thread_running = 1;
-        pthread_create(&upload_thread, NULL, upload_worker, NULL);
+    if (spool_add(key, file_path) == 0) {
+        spool_start_uploader();
+        return;
+    }
+
+    if (upload_enqueue(key, file_path, 0, cfg->upload_queue_block) != 0) {
+        network_put(key, file_path);
+    }
+}
+
+/* For the uploader: queue a spool entry, waiting for room; the entry is
+ * removed once the upload succeeds */
+void network_put_spooled(const hash_t key, const char *file_path) {
+    if (upload_enqueue(key, file_path, 1, 1) != 0 && network_put(key, file_path) == 0) {
+        spool_remove(key);
+    }
+}
+
+/* Wait until everything queued has finished; returns the number of
+ * successful uploads so far */
+uint64_t network_wait_uploads(void) {
+    pthread_mutex_lock(&upload_mutex);
+    while (upload_thread_running && !upload_stopping && (ring_count > 0 || upload_inflight > 0)) {
+        pthread_cond_wait(&upload_idle, &upload_mutex);
+    }
+    uint64_t done = upload_done;
+    pthread_mutex_unlock(&upload_mutex);
+    return done;
+}
+
+/* In a child forked from a process that may have used the network:
+ * threads did not survive the fork, and the inherited handles and
+ * connections still belong to the parent (closing a TLS connection here
+ * would end the parent's session too). They are abandoned, not freed. */
+void network_after_fork(void) {
+    upload_thread_running = 0;
+    upload_stopping = 0;
+    upload_multi = NULL;
+    upload_ring = NULL;
+    ring_count = upload_inflight = 0;
+    pthread_mutex_init(&upload_mutex, NULL);
+    pthread_mutex_init(&pool_mutex, NULL);
+    bloom_after_fork();
+
+    pool_count = 0;
+    share = NULL;
+    get_headers = put_headers = batch_headers = NULL;
+    network_ready = 0;
+    network_init();
+}
+
+void network_cleanup(void) {
+    uploads_drain();
+    if (!network_ready) return;
+
+    while (pool_count > 0) {
+        curl_easy_cleanup(pool[--pool_count]);
+    }
+    if (share) {
+        curl_share_cleanup(share);
+        share = NULL;
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+            pthread_mutex_destroy(&share_locks[i]);
+        }
+    }
+    curl_slist_free_all(get_headers);
+    curl_slist_free_all(put_headers);
+    curl_slist_free_all(batch_headers);
+    get_headers = put_headers = batch_headers = NULL;
+    network_ready = 0;
+    curl_global_cleanup();
+}
+
+/* ---------- BATCH REQUESTS ---------- */
+/* Servers may implement two batch endpoints; the request body of both is
+ * the hex keys, one per line:
+ *   POST /cache/batch-exists  -> 200, the keys the server has, one per line
+ *   POST /cache/batch-get     -> 200, for each key the server has:
+ *                                "<hex key> <size>\n" then size bytes
+ * A 404, 405 or 501 from either marks batching unsupported for the rest
+ * of the process. */
+static int batch_unsupported = 0;
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} buffer_t;
+
+static size_t buffer_callback(void *ptr, size_t size, size_t nmemb, buffer_t *buf) {
+    size_t n = size * nmemb;
+    if (buf->len + n + 1 > buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        while (cap < buf->len + n + 1) cap *= 2;
+        char *data = realloc(buf->data, cap);
+        if (!data) return 0;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, ptr, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+    return n;
+}
+
+static char *key_list(const hash_t *keys, int count) {
+    char *body = malloc((size_t)count * HASH_HEX_SIZE + 1);
+    if (!body) return NULL;
+    for (int i = 0; i < count; i++) {
+        hash_to_hex(keys[i], body + (size_t)i * HASH_HEX_SIZE);
+        body[(size_t)i * HASH_HEX_SIZE + HASH_HEX_SIZE - 1] = '\n';
+    }
+    body[(size_t)count * HASH_HEX_SIZE] = '\0';
+    return body;
+}
+
+/* Where a batch response body goes: to the caller's callback once the
+ * status is known to be 200, and nowhere otherwise, so the error page of
+ * a server without batch support is never parsed as a response */
+typedef struct {
+    CURL *curl;
+    curl_write_callback fn;
+    void *data;
+} batch_sink_t;
+
+static size_t batch_write_callback(char *ptr, size_t size, size_t nmemb, batch_sink_t *sink) {
+    long http_code = 0;
+    curl_easy_getinfo(sink->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 200) return size * nmemb;
+    return sink->fn(ptr, size, nmemb, sink->data);
+}
+
+/* POST the key list to a batch endpoint. Returns the HTTP status, or -1. */
+static long batch_post(const char *endpoint, const hash_t *keys, int count,
+                       curl_write_callback write_fn, void *write_data) {
+    const quickcache_config_t *cfg = config_get();
+    char url[1024];
+    snprintf(url, sizeof(url), "%s/cache/%s", cfg->remote_url, endpoint);
+
+    char *body = key_list(keys, count);
+    CURL *curl = body ? handle_acquire() : NULL;
+    if (!curl) {
+        free(body);
+        return -1;
+    }
+
+    batch_sink_t sink = { curl, write_fn, write_data };
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)strlen(body));
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, batch_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)cfg->timeout_seconds * 2);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, batch_headers);
+
+    CURLcode res = curl_easy_perform(curl);
+    long http_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    handle_release(curl);
+    free(body);
+
+    if (http_code == 404 || http_code == 405 || http_code == 501) {
+        batch_unsupported = 1;
+    }
+    if (res != CURLE_OK) {
+        stats_record_error(STAT_ERROR_REMOTE);
+        return -1;
     }
+    return http_code;
+}
 
-    pthread_mutex_lock(&upload_queue_mutex);
+/* Which of keys the remote cache has, in present[]: those the known-
+ * remote filter holds, and of the rest those the server reports, in one
+ * batch request or else a HEAD each. Returns -1 without an answer. */
+int network_exists_batch(const hash_t *keys, int count, int *present) {
+    if (!config_get()->remote_enabled) return -1;
+
+    int *unknown = malloc((size_t)(count > 0 ? count : 1) * sizeof(int));
+    hash_t *ask = malloc((size_t)(count > 0 ? count : 1) * sizeof(hash_t));
+    if (!unknown || !ask) {
+        free(unknown);
+        free(ask);
+        return -1;
+    }
 
-    if (upload_queue_size >= upload_queue_capacity) {
-        upload_queue_capacity = upload_queue_capacity == 0 ? 16 : upload_queue_capacity * 2;
-        upload_queue = realloc(upload_queue, upload_queue_capacity * sizeof(upload_job_t));
+    int asked = 0;
+    for (int i = 0; i < count; i++) {
+        present[i] = bloom_contains(keys[i]);
+        if (!present[i]) {
+            unknown[asked] = i;
+            memcpy(ask[asked++], keys[i], HASH_SIZE);
+        }
     }
 
-    memcpy(upload_queue[upload_queue_size].key, key, HASH_SIZE);
-    strncpy(upload_queue[upload_queue_size].file_path, file_path,
-            sizeof(upload_queue[upload_queue_size].file_path) - 1);
-    upload_queue_size++;
+    int rc = 0;
+    if (asked > 0 && !batch_unsupported) {
+        buffer_t buf = { NULL, 0, 0 };
+        long code = batch_post("batch-exists", ask, asked, (curl_write_callback)buffer_callback, &buf);
+        if (code == 200) {
+            for (char *line = buf.data; line && *line; ) {
+                char *next = strchr(line, '\n');
+                if (next) *next++ = '\0';
+                hash_t key;
+                if (strlen(line) == HASH_HEX_SIZE - 1 && hash_from_hex(line, key) == 0) {
+                    for (int j = 0; j < asked; j++) {
+                        if (memcmp(ask[j], key, HASH_SIZE) == 0) present[unknown[j]] = 1;
+                    }
+                    bloom_add(key);
+                }
+                line = next;
+            }
+            asked = 0;
+        } else if (!batch_unsupported) {
+            rc = -1;
+        }
+        free(buf.data);
+    }
 
-    pthread_mutex_unlock(&upload_queue_mutex);
+    if (rc == 0 && batch_unsupported) {
+        for (int j = 0; j < asked; j++) {
+            present[unknown[j]] = network_check_exists(ask[j]);
+        }
+    }
+
+    free(unknown);
+    free(ask);
+    return rc;
+}
+
+/* Parser state for a batch-get stream */
+typedef struct {
+    char header[128];
+    size_t header_len;
+    uint64_t remaining;
+    int in_body;
+    hash_t key;
+    FILE *out;
+    const char *tmp_path;
+    network_object_fn fn;
+    void *arg;
+    int objects;
+} batch_get_t;
+
+static int batch_object_done(batch_get_t *b) {
+    int ok = fclose(b->out) == 0;
+    b->out = NULL;
+    b->in_body = 0;
+    if (!ok) {
+        unlink(b->tmp_path);
+        return -1;
+    }
+    bloom_add(b->key);
+    b->fn(b->key, b->tmp_path, b->arg);
+    b->objects++;
+    return 0;
+}
+
+static size_t batch_get_callback(char *ptr, size_t size, size_t nmemb, batch_get_t *b) {
+    size_t n = size * nmemb, pos = 0;
+    while (pos < n) {
+        if (!b->in_body) {
+            char ch = ptr[pos++];
+            if (ch != '\n') {
+                if (b->header_len + 1 >= sizeof(b->header)) return 0;
+                b->header[b->header_len++] = ch;
+                continue;
+            }
+            b->header[b->header_len] = '\0';
+            b->header_len = 0;
+
+            char hex[HASH_HEX_SIZE];
+            unsigned long long length;
+            if (sscanf(b->header, "%64s %llu", hex, &length) != 2 ||
+                hash_from_hex(hex, b->key) != 0) {
+                return 0;
+            }
+            b->out = fopen(b->tmp_path, "wb");
+            if (!b->out) return 0;
+            b->remaining = length;
+            b->in_body = 1;
+        } else {
+            size_t chunk = n - pos;
+            if (chunk > b->remaining) chunk = (size_t)b->remaining;
+            if (fwrite(ptr + pos, 1, chunk, b->out) != chunk) return 0;
+            pos += chunk;
+            b->remaining -= chunk;
+        }
+        if (b->in_body && b->remaining == 0 && batch_object_done(b) != 0) return 0;
+    }
+    return n;
+}
+
+/* Fetch whichever of keys the server has. Each object is written to
+ * tmp_path and handed to fn, which must move or remove it before
+ * returning. Servers without batch support get one GET per key. Returns
+ * the number of objects delivered, or -1. */
+int network_get_batch(const hash_t *keys, int count, const char *tmp_path,
+                      network_object_fn fn, void *arg) {
+    if (!config_get()->remote_enabled) return -1;
+    if (count == 0) return 0;
+
+    if (!batch_unsupported) {
+        batch_get_t b;
+        memset(&b, 0, sizeof(b));
+        b.tmp_path = tmp_path;
+        b.fn = fn;
+        b.arg = arg;
+
+        long code = batch_post("batch-get", keys, count, (curl_write_callback)batch_get_callback, &b);
+        if (b.out) {
+            /* Cut off mid-object */
+            fclose(b.out);
+            unlink(tmp_path);
+        }
+        if (code == 200) return b.objects;
+        if (!batch_unsupported) return b.objects > 0 ? b.objects : -1;
+    }
+
+    int objects = 0;
+    for (int i = 0; i < count; i++) {
+        if (network_get(keys[i], tmp_path) == 0) {
+            fn(keys[i], tmp_path, arg);
+            objects++;
+        }
+    }
+    return objects;
 }
 
 int network_check_exists(const hash_t key) {
@@ -221,29 +821,23 @@ int network_check_exists(const hash_t key) {
     char url[1024];
     snprintf(url, sizeof(url), "%s/cache/%s", cfg->remote_url, hex);
 
-    CURL *curl = curl_easy_init();
+    CURL *curl = handle_acquire();
     if (!curl) return 0;
 
-    struct curl_slist *headers = NULL;
-    if (cfg->auth_token[0] != '\0') {
-        char auth_header[512];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", cfg->auth_token);
-        headers = curl_slist_append(headers, auth_header);
-    }
-
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
     curl_easy_setopt(curl, CURLOPT_TIMEOUT, cfg->timeout_seconds);
-    if (headers) {
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    if (get_headers) {
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, get_headers);
     }
 
     CURLcode res = curl_easy_perform(curl);
     long http_code = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    handle_release(curl);
 
-    return (res == CURLE_OK && http_code == 200) ? 1 : 0;
+    if (res != CURLE_OK || http_code != 200) return 0;
+    bloom_add(key);
+    return 1;
 }
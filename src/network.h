@@ -1,13 +1,23 @@
 #ifndef NETWORK_H
 #define NETWORK_H
 
+#include <stdint.h>
 #include "hash.h"
 
 int network_init(void);
 void network_cleanup(void);
 int network_get(const hash_t key, const char *output_path);
 int network_put(const hash_t key, const char *file_path);
+/* Receives an object fetched into path, which it must move or remove */
+typedef void (*network_object_fn)(const hash_t key, const char *path, void *arg);
+
 void network_put_async(const hash_t key, const char *file_path);
+void network_put_spooled(const hash_t key, const char *file_path);
+uint64_t network_wait_uploads(void);
+void network_after_fork(void);
 int network_check_exists(const hash_t key);
+int network_exists_batch(const hash_t *keys, int count, int *present);
+int network_get_batch(const hash_t *keys, int count, const char *tmp_path,
+                      network_object_fn fn, void *arg);
 
 #endif
@@ -0,0 +1,85 @@
+#define _POSIX_C_SOURCE 200809L  // strdup
+
+#include "pathset.h"
+#include <stdlib.h>
+#include <string.h>
+
+uint64_t fnv1a(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static int path_set_grow(path_set_t *set) {
+    int slot_count = set->slot_count == 0 ? 256 : set->slot_count * 2;
+    uint64_t *slots = calloc(slot_count, sizeof(uint64_t));
+    int *slot_index = malloc(slot_count * sizeof(int));
+    if (!slots || !slot_index) {
+        free(slots);
+        free(slot_index);
+        return -1;
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        uint64_t h = fnv1a(set->paths[i]);
+        int s = (int)(h & (uint64_t)(slot_count - 1));
+        while (slots[s]) s = (s + 1) & (slot_count - 1);
+        slots[s] = h;
+        slot_index[s] = i;
+    }
+
+    free(set->slots);
+    free(set->slot_index);
+    set->slots = slots;
+    set->slot_index = slot_index;
+    set->slot_count = slot_count;
+    return 0;
+}
+
+void path_set_init(path_set_t *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+/* Returns 1 if path was added, 0 if it was already present */
+int path_set_add(path_set_t *set, const char *path) {
+    if (set->count * 2 >= set->slot_count && path_set_grow(set) == -1) {
+        return -1;
+    }
+
+    uint64_t h = fnv1a(path);
+    int s = (int)(h & (uint64_t)(set->slot_count - 1));
+    while (set->slots[s]) {
+        if (set->slots[s] == h && strcmp(set->paths[set->slot_index[s]], path) == 0) {
+            return 0;
+        }
+        s = (s + 1) & (set->slot_count - 1);
+    }
+
+    if (set->count >= set->capacity) {
+        int capacity = set->capacity == 0 ? 64 : set->capacity * 2;
+        char **paths = realloc(set->paths, capacity * sizeof(char *));
+        if (!paths) return -1;
+        set->paths = paths;
+        set->capacity = capacity;
+    }
+
+    set->paths[set->count] = strdup(path);
+    if (!set->paths[set->count]) return -1;
+
+    set->slots[s] = h;
+    set->slot_index[s] = set->count;
+    set->count++;
+    return 1;
+}
+
+void path_set_free(path_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        free(set->paths[i]);
+    }
+    free(set->paths);
+    free(set->slots);
+    free(set->slot_index);
+}
@@ -0,0 +1,21 @@
+#ifndef PATHSET_H
+#define PATHSET_H
+
+#include <stdint.h>
+
+/* Set of file names, kept in first-seen order */
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+    uint64_t *slots;  /* open addressing: fnv hash, 0 = empty */
+    int *slot_index;
+    int slot_count;
+} path_set_t;
+
+uint64_t fnv1a(const char *s);
+void path_set_init(path_set_t *set);
+int path_set_add(path_set_t *set, const char *path);
+void path_set_free(path_set_t *set);
+
+#endif
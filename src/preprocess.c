@@ -0,0 +1,266 @@
+#define _POSIX_C_SOURCE 200809L  // strdup
+
+#include "preprocess.h"
+#include "exec.h"
+#include "memo.h"
+#include "pathset.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_ARGS 512
+#define PENDING_MAX 16
+#define MARKER_LINE_MAX 4096
+
+typedef enum {
+    PP_NORMAL,
+    PP_PENDING,  /* saw '#' at line start, not yet sure it is a marker */
+    PP_MARKER    /* inside a line marker, hashed once complete */
+} pp_state_t;
+
+typedef struct {
+    hash_ctx_t *ctx;
+    pp_state_t state;
+    int bol;
+    char pending[PENDING_MAX];
+    size_t pending_len;
+    char line[MARKER_LINE_MAX];
+    size_t line_len;
+    int truncated;  /* the marker was longer than line[] */
+    path_set_t *paths;
+} pp_filter_t;
+
+/* Classify the bytes buffered after a '#' at line start:
+ * 1 = line marker ("# 12 ..." or "#line 12 ..."), 0 = ordinary line,
+ * -1 = need more input. A prefix that fills pending[] without being
+ * decided is no marker the compiler writes, so it counts as ordinary. */
+static int classify_pending(const char *buf, size_t len) {
+    static const char kw[] = "line";
+    int more = len >= PENDING_MAX ? 0 : -1;
+    size_t i = 1;
+
+    while (i < len && (buf[i] == ' ' || buf[i] == '\t')) i++;
+    if (i == len) return more;
+
+    if (buf[i] >= '0' && buf[i] <= '9') return 1;
+
+    for (size_t k = 0; k < sizeof(kw) - 1; k++, i++) {
+        if (i == len) return more;
+        if (buf[i] != kw[k]) return 0;
+    }
+    if (i == len) return more;
+    return (buf[i] == ' ' || buf[i] == '\t') ? 1 : 0;
+}
+
+/* Find the quoted file name in a line marker: *name points at its first
+ * character and the return value at the closing quote, or NULL */
+static const char *marker_name(const char *line, const char **name) {
+    const char *q = strchr(line, '"');
+    if (!q) return NULL;
+    *name = q + 1;
+    for (q++; *q && *q != '"'; q++) {
+        if (*q == '\\' && q[1]) q++;
+    }
+    return *q == '"' ? q : NULL;
+}
+
+/* Hash a line marker with its file name cut down to the base name. The
+ * line number and flags stay in the key: they end up in __LINE__,
+ * diagnostics and the debug line table, so an edit that only moves code
+ * must still miss. The directory is dropped so the key does not depend
+ * on where the tree is checked out. */
+static int hash_marker(pp_filter_t *f) {
+    f->line[f->line_len] = '\0';
+
+    const char *name = NULL;
+    const char *close = marker_name(f->line, &name);
+    if (!close) {
+        /* No name, or one cut off by truncation: the number still counts */
+        size_t n = name ? (size_t)(name - f->line) : f->line_len;
+        if (hash_ctx_update(f->ctx, f->line, n) == -1) return -1;
+        return hash_ctx_update(f->ctx, "\n", 1);
+    }
+
+    const char *base = name;
+    for (const char *q = name; q < close; q++) {
+        if (*q == '/') base = q + 1;
+    }
+    if (hash_ctx_update(f->ctx, f->line, name - f->line) == -1 ||
+        hash_ctx_update(f->ctx, base, f->line_len - (base - f->line)) == -1) {
+        return -1;
+    }
+    return hash_ctx_update(f->ctx, "\n", 1);
+}
+
+/* Pull the quoted file name out of a line marker and remember it */
+static void record_marker(pp_filter_t *f) {
+    if (!f->paths || f->line_len == 0 || f->truncated) return;
+    f->line[f->line_len] = '\0';
+
+    char *q = strchr(f->line, '"');
+    if (!q) return;
+
+    char path[MARKER_LINE_MAX];
+    size_t n = 0;
+    for (q++; *q && *q != '"' && n < sizeof(path) - 1; q++) {
+        if (*q == '\\' && q[1]) q++;
+        path[n++] = *q;
+    }
+    path[n] = '\0';
+
+    /* Skip pseudo files such as <built-in> and <command-line>, and the
+     * working directory that -g adds as "dir//" */
+    if (n == 0 || path[0] == '<' || path[n - 1] == '/') return;
+    path_set_add(f->paths, path);
+}
+
+static int filter_sink(const void *data, size_t len, void *arg) {
+    pp_filter_t *f = arg;
+    const char *p = data;
+    const char *end = p + len;
+
+    while (p < end) {
+        switch (f->state) {
+        case PP_NORMAL: {
+            if (f->bol && *p == '#') {
+                f->state = PP_PENDING;
+                f->pending_len = 0;
+                break;
+            }
+            const char *nl = memchr(p, '\n', end - p);
+            const char *stop = nl ? nl + 1 : end;
+            if (hash_ctx_update(f->ctx, p, stop - p) == -1) return -1;
+            f->bol = nl != NULL;
+            p = stop;
+            break;
+        }
+        case PP_PENDING: {
+            char c = *p++;
+            f->pending[f->pending_len++] = c;
+
+            int kind = c == '\n' ? 0 : classify_pending(f->pending, f->pending_len);
+            if (kind == 1) {
+                memcpy(f->line, f->pending, f->pending_len);
+                f->line_len = f->pending_len;
+                f->truncated = 0;
+                f->state = PP_MARKER;
+            } else if (kind == 0) {
+                if (hash_ctx_update(f->ctx, f->pending, f->pending_len) == -1) return -1;
+                f->state = PP_NORMAL;
+                f->bol = c == '\n';
+            }
+            break;
+        }
+        case PP_MARKER: {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *stop = nl ? nl : end;
+            size_t n = stop - p;
+            if (f->line_len + n >= sizeof(f->line)) {
+                n = sizeof(f->line) - 1 - f->line_len;  /* too long, keep the start */
+                f->truncated = 1;
+            }
+            memcpy(f->line + f->line_len, p, n);
+            f->line_len += n;
+            if (nl) {
+                if (hash_marker(f) == -1) return -1;
+                record_marker(f);
+                f->state = PP_NORMAL;
+                f->bol = 1;
+                p = nl + 1;
+            } else {
+                p = end;
+            }
+            break;
+        }
+        }
+    }
+
+    return 0;
+}
+
+/* Rewrite a compile command into one that writes preprocessed output to
+ * stdout: drop -c/-S, the output file and dependency-file generation. */
+static int build_preprocess_args(char **argv, char **out, int max) {
+    int n = 0;
+
+    for (int i = 0; argv[i]; i++) {
+        const char *a = argv[i];
+
+        if (i > 0 && a[0] == '-') {
+            if (!strcmp(a, "-c") || !strcmp(a, "-S") ||
+                !strcmp(a, "-M") || !strcmp(a, "-MM") ||
+                !strcmp(a, "-MD") || !strcmp(a, "-MMD") ||
+                !strcmp(a, "-MP") || !strcmp(a, "-MG")) {
+                continue;
+            }
+            if (!strcmp(a, "-o") || !strcmp(a, "-MF") ||
+                !strcmp(a, "-MT") || !strcmp(a, "-MQ")) {
+                if (argv[i + 1]) i++;
+                continue;
+            }
+            if (!strncmp(a, "-o", 2) || !strncmp(a, "-MF", 3) ||
+                !strncmp(a, "-MT", 3) || !strncmp(a, "-MQ", 3)) {
+                continue;
+            }
+        }
+
+        if (n >= max - 2) return -1;
+        out[n++] = argv[i];
+    }
+
+    out[n++] = "-E";
+    out[n] = NULL;
+    return 0;
+}
+
+/* Hash the compiler's own -E output, streamed through a pipe, with the
+ * directories taken out of line markers so build-directory paths do not
+ * leak into the key.
+ * Files named in the markers are recorded in deps when it is non-NULL. */
+int preprocess_hash(char **compiler_argv, hash_t out, manifest_t *deps) {
+    char *args[MAX_ARGS];
+    if (build_preprocess_args(compiler_argv, args, MAX_ARGS) == -1) {
+        return -1;
+    }
+
+    path_set_t paths;
+    path_set_init(&paths);
+
+    pp_filter_t filter;
+    memset(&filter, 0, sizeof(filter));
+    filter.state = PP_NORMAL;
+    filter.bol = 1;
+    filter.paths = deps ? &paths : NULL;
+    filter.ctx = hash_ctx_new();
+    if (!filter.ctx) return -1;
+
+    int r = execute_compiler_stream(args, STDOUT_FILENO, filter_sink, &filter);
+
+    /* A '#' line cut short by end of output was never a marker */
+    if (r == 0 && filter.state == PP_PENDING &&
+        hash_ctx_update(filter.ctx, filter.pending, filter.pending_len) == -1) {
+        r = -1;
+    }
+    if (r == 0 && filter.state == PP_MARKER && hash_marker(&filter) == -1) {
+        r = -1;
+    }
+    if (r == 0 && hash_ctx_final(filter.ctx, out) == -1) {
+        r = -1;
+    }
+    hash_ctx_free(filter.ctx);
+
+    if (r == 0 && deps) {
+        /* A dependency we cannot fingerprint would make the manifest lie */
+        for (int i = 0; i < paths.count && r == 0; i++) {
+            hash_t h;
+            if (memo_hash_file(paths.paths[i], h) == -1 ||
+                manifest_add_dep(deps, paths.paths[i], h) == -1) {
+                r = -1;
+            }
+        }
+    }
+
+    path_set_free(&paths);
+    return r == 0 ? 0 : -1;
+}
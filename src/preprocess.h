@@ -0,0 +1,9 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include "hash.h"
+#include "manifest.h"
+
+int preprocess_hash(char **compiler_argv, hash_t out, manifest_t *deps);
+
+#endif
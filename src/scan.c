@@ -0,0 +1,418 @@
+#define _POSIX_C_SOURCE 200809L  // strdup
+
+#include "scan.h"
+#include "cache.h"
+#include "exec.h"
+#include "memo.h"
+#include "pathset.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_SEARCH_DIRS 256
+#define MAX_PROBE_ARGS 64
+#define MAX_INCLUDE_DEPTH 200
+
+/* Header search order, as the compiler applies it: -iquote directories
+ * (quoted includes only), then -I, -isystem, the compiler's built-in
+ * directories and finally -idirafter. */
+typedef struct {
+    const char *dirs[MAX_SEARCH_DIRS];
+    int count;
+    int quote_count;
+} search_path_t;
+
+typedef struct {
+    search_path_t search;
+    path_set_t visited;
+    manifest_t *found;
+    char *default_dirs;  /* newline-separated, owns the strings in search */
+} scan_ctx_t;
+
+/* ---------- SEARCH PATHS ---------- */
+
+static void add_dir(search_path_t *sp, const char *dir) {
+    if (sp->count < MAX_SEARCH_DIRS) sp->dirs[sp->count++] = dir;
+}
+
+/* Match "-Xdir" or "-X dir"; returns the directory or NULL */
+static const char *flag_value(char **argv, int *i, const char *flag) {
+    size_t n = strlen(flag);
+    if (strncmp(argv[*i], flag, n) != 0) return NULL;
+    if (argv[*i][n] != '\0') return argv[*i] + n;
+    if (!argv[*i + 1]) return NULL;
+    return argv[++*i];
+}
+
+static const char *source_language(char **argv, const char *source_file) {
+    for (int i = 1; argv[i]; i++) {
+        if (!strcmp(argv[i], "-x") && argv[i + 1]) return argv[i + 1];
+        if (!strncmp(argv[i], "-x", 2) && argv[i][2]) return argv[i] + 2;
+    }
+    const char *ext = strrchr(source_file, '.');
+    return (ext && !strcmp(ext, ".c")) ? "c" : "c++";
+}
+
+/* Flags that change which built-in include directories the compiler uses */
+static int affects_default_dirs(char **argv, int i, int *takes_value) {
+    const char *a = argv[i];
+    *takes_value = !strcmp(a, "-isysroot") || !strcmp(a, "-target") ||
+                   !strcmp(a, "--sysroot");
+    return *takes_value ||
+           !strncmp(a, "--sysroot=", 10) || !strncmp(a, "--target=", 9) ||
+           !strncmp(a, "-stdlib=", 8) || !strncmp(a, "--gcc-toolchain=", 16) ||
+           !strcmp(a, "-nostdinc++") || !strcmp(a, "-m32") ||
+           !strcmp(a, "-m64") || !strcmp(a, "-mx32") || !strcmp(a, "-m16");
+}
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} text_buf_t;
+
+static int collect_sink(const void *data, size_t len, void *arg) {
+    text_buf_t *t = arg;
+    if (t->len + len + 1 > t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 8192;
+        while (cap < t->len + len + 1) cap *= 2;
+        char *p = realloc(t->data, cap);
+        if (!p) return -1;
+        t->data = p;
+        t->cap = cap;
+    }
+    memcpy(t->data + t->len, data, len);
+    t->len += len;
+    t->data[t->len] = '\0';
+    return 0;
+}
+
+/* Extract the "#include <...> search starts here:" list from -v output */
+static char *parse_probe_output(const char *text) {
+    const char *start = strstr(text, "#include <...> search starts here:");
+    if (!start) return NULL;
+    start = strchr(start, '\n');
+    if (!start) return NULL;
+    start++;
+
+    const char *end = strstr(start, "End of search list.");
+    if (!end) return NULL;
+
+    char *dirs = malloc(end - start + 1);
+    if (!dirs) return NULL;
+    size_t n = 0;
+
+    for (const char *line = start; line < end; ) {
+        const char *nl = memchr(line, '\n', end - line);
+        const char *stop = nl ? nl : end;
+        while (line < stop && *line == ' ') line++;
+
+        /* clang marks macOS framework directories */
+        const char *suffix = " (framework directory)";
+        size_t slen = strlen(suffix);
+        const char *dend = stop;
+        if ((size_t)(dend - line) > slen && !memcmp(dend - slen, suffix, slen)) {
+            dend -= slen;
+        }
+
+        if (dend > line) {
+            memcpy(dirs + n, line, dend - line);
+            n += dend - line;
+            dirs[n++] = '\n';
+        }
+        line = stop + 1;
+    }
+    dirs[n] = '\0';
+    return dirs;
+}
+
+/* The compiler's built-in include directories, probed once with -E -v and
+ * then cached per (compiler binary, language, relevant flags). */
+static char *default_include_dirs(char **argv, const char *lang) {
+    char compiler[4096];
+    struct stat st;
+    if (resolve_compiler(argv[0], compiler, sizeof(compiler), &st) == -1) {
+        return NULL;
+    }
+
+    char *probe[MAX_PROBE_ARGS];
+    int n = 0;
+    probe[n++] = argv[0];
+
+    hash_ctx_t *ctx = hash_ctx_new();
+    if (!ctx) return NULL;
+    char ident[4200];
+    snprintf(ident, sizeof(ident), "%s|%lld|%lld|%s", compiler,
+             (long long)st.st_size, (long long)st.st_mtime, lang);
+    hash_ctx_update(ctx, ident, strlen(ident) + 1);
+
+    for (int i = 1; argv[i]; i++) {
+        int takes_value;
+        if (!affects_default_dirs(argv, i, &takes_value)) continue;
+        if (n < MAX_PROBE_ARGS - 8) probe[n++] = argv[i];
+        hash_ctx_update(ctx, argv[i], strlen(argv[i]) + 1);
+        if (takes_value && argv[i + 1]) {
+            i++;
+            if (n < MAX_PROBE_ARGS - 8) probe[n++] = argv[i];
+            hash_ctx_update(ctx, argv[i], strlen(argv[i]) + 1);
+        }
+    }
+
+    hash_t id;
+    int ok = hash_ctx_final(ctx, id) == 0;
+    hash_ctx_free(ctx);
+    if (!ok) return NULL;
+
+    char hex[HASH_HEX_SIZE];
+    char cache_dir[4096];
+    char cache_path[4096];
+    hash_to_hex(id, hex);
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(cache_path, sizeof(cache_path), "%s/compilers/%s", cache_dir, hex);
+
+    char *dirs = read_file(cache_path, NULL);
+    if (dirs) return dirs;
+
+    probe[n++] = "-x";
+    probe[n++] = (char *)lang;
+    probe[n++] = "-E";
+    probe[n++] = "-v";
+    probe[n++] = "/dev/null";
+    probe[n] = NULL;
+
+    text_buf_t out = { NULL, 0, 0 };
+    if (execute_compiler_stream(probe, STDERR_FILENO, collect_sink, &out) != 0 || !out.data) {
+        free(out.data);
+        return NULL;
+    }
+    dirs = parse_probe_output(out.data);
+    free(out.data);
+    if (!dirs) return NULL;
+
+    char tmp_path[4096];
+    snprintf(cache_path, sizeof(cache_path), "%s/compilers", cache_dir);
+    make_dirs(cache_path);
+    snprintf(cache_path, sizeof(cache_path), "%s/compilers/%s", cache_dir, hex);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid());
+    if (write_file(tmp_path, dirs, strlen(dirs)) == 0) {
+        rename(tmp_path, cache_path);
+    } else {
+        unlink(tmp_path);
+    }
+    return dirs;
+}
+
+static void build_search_path(scan_ctx_t *ctx, char **argv, const char *source_file) {
+    search_path_t *sp = &ctx->search;
+    const char *quote[MAX_SEARCH_DIRS], *angle[MAX_SEARCH_DIRS];
+    const char *system[MAX_SEARCH_DIRS], *after[MAX_SEARCH_DIRS];
+    int nq = 0, na = 0, ns = 0, nf = 0;
+    int nostdinc = 0;
+
+    for (int i = 1; argv[i]; i++) {
+        const char *dir;
+        if (!strcmp(argv[i], "-nostdinc")) {
+            nostdinc = 1;
+        } else if ((dir = flag_value(argv, &i, "-iquote"))) {
+            if (nq < MAX_SEARCH_DIRS) quote[nq++] = dir;
+        } else if ((dir = flag_value(argv, &i, "-isystem"))) {
+            if (ns < MAX_SEARCH_DIRS) system[ns++] = dir;
+        } else if ((dir = flag_value(argv, &i, "-idirafter"))) {
+            if (nf < MAX_SEARCH_DIRS) after[nf++] = dir;
+        } else if ((dir = flag_value(argv, &i, "-I"))) {
+            if (na < MAX_SEARCH_DIRS) angle[na++] = dir;
+        }
+    }
+
+    for (int i = 0; i < nq; i++) add_dir(sp, quote[i]);
+    sp->quote_count = sp->count;
+    for (int i = 0; i < na; i++) add_dir(sp, angle[i]);
+    for (int i = 0; i < ns; i++) add_dir(sp, system[i]);
+
+    if (!nostdinc) {
+        ctx->default_dirs = default_include_dirs(argv, source_language(argv, source_file));
+        for (char *d = ctx->default_dirs; d && *d; ) {
+            char *nl = strchr(d, '\n');
+            if (nl) *nl = '\0';
+            add_dir(sp, d);
+            if (!nl) break;
+            d = nl + 1;
+        }
+    }
+
+    for (int i = 0; i < nf; i++) add_dir(sp, after[i]);
+}
+
+/* ---------- INCLUDE GRAPH ---------- */
+
+static int try_candidate(const char *dir, size_t dir_len, const char *name,
+                         char *out, size_t len) {
+    if (dir_len == 0) {
+        snprintf(out, len, "%s", name);
+    } else {
+        snprintf(out, len, "%.*s/%s", (int)dir_len, dir, name);
+    }
+    struct stat st;
+    return stat(out, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* Resolve an include the way the preprocessor would. Returns the index of
+ * the search directory it was found in, -1 for the includer's directory,
+ * or -2 if it could not be found. */
+static int resolve_include(const scan_ctx_t *ctx, const char *name, int quoted,
+                           int next, const char *includer, int includer_idx,
+                           char *out, size_t len) {
+    const search_path_t *sp = &ctx->search;
+
+    if (name[0] == '/') {
+        return try_candidate(NULL, 0, name, out, len) ? -1 : -2;
+    }
+
+    int start = sp->quote_count;
+    if (next) {
+        if (includer_idx >= sp->quote_count) start = includer_idx + 1;
+    } else if (quoted) {
+        const char *slash = strrchr(includer, '/');
+        size_t dlen = slash ? (size_t)(slash - includer) : 0;
+        if (slash && dlen == 0) dlen = 1;  /* file in / */
+        if (try_candidate(includer, dlen, name, out, len)) return -1;
+
+        for (int i = 0; i < sp->quote_count; i++) {
+            if (try_candidate(sp->dirs[i], strlen(sp->dirs[i]), name, out, len)) return i;
+        }
+    }
+
+    for (int i = start; i < sp->count; i++) {
+        if (try_candidate(sp->dirs[i], strlen(sp->dirs[i]), name, out, len)) return i;
+    }
+    return -2;
+}
+
+static int scan_file(scan_ctx_t *ctx, const char *path, int found_at, int depth);
+
+/* Parse one "#include"-style line; returns 1 and fills name if it is one */
+static int parse_directive(const char *p, const char *end, char *name, size_t len,
+                           int *quoted, int *next) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end || *p != '#') return 0;
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+    if (end - p > 12 && !strncmp(p, "include_next", 12)) {
+        *next = 1;
+        p += 12;
+    } else if (end - p > 7 && !strncmp(p, "include", 7)) {
+        *next = 0;
+        p += 7;
+    } else if (end - p > 6 && !strncmp(p, "import", 6)) {
+        *next = 0;
+        p += 6;
+    } else {
+        return 0;
+    }
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end) return 0;
+
+    char close;
+    if (*p == '"') close = '"';
+    else if (*p == '<') close = '>';
+    else return 0;  /* computed includes are not followed */
+
+    *quoted = close == '"';
+    p++;
+    const char *stop = memchr(p, close, end - p);
+    if (!stop || stop == p || (size_t)(stop - p) >= len) return 0;
+    memcpy(name, p, stop - p);
+    name[stop - p] = '\0';
+    return 1;
+}
+
+/* Returns -1 if a header that was found could not be recorded */
+static int scan_text(scan_ctx_t *ctx, const char *path, int found_at,
+                     const char *text, size_t len, int depth) {
+    const char *p = text;
+    const char *end = text + len;
+
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *stop = nl ? nl : end;
+
+        /* Cheap pre-check before parsing the line properly */
+        const char *q = p;
+        while (q < stop && (*q == ' ' || *q == '\t')) q++;
+        if (q < stop && *q == '#') {
+            char name[1024];
+            int quoted, next;
+            if (parse_directive(q, stop, name, sizeof(name), &quoted, &next)) {
+                char resolved[4096];
+                int idx = resolve_include(ctx, name, quoted, next, path, found_at,
+                                          resolved, sizeof(resolved));
+                if (idx != -2 && scan_file(ctx, resolved, idx, depth + 1) == -1) return -1;
+            }
+        }
+
+        p = stop + 1;
+    }
+    return 0;
+}
+
+static int scan_file(scan_ctx_t *ctx, const char *path, int found_at, int depth) {
+    if (depth > MAX_INCLUDE_DEPTH) return 0;
+    int added = path_set_add(&ctx->visited, path);
+    if (added != 1) return added;
+
+    hash_t h;
+    if (memo_hash_file(path, h) == -1) return 0;
+    /* A header left out of the key would let a stale object hit */
+    if (manifest_add_dep(ctx->found, path, h) == -1) return -1;
+
+    size_t len;
+    char *text = read_file(path, &len);
+    if (!text) return 0;
+    int r = scan_text(ctx, path, found_at, text, len, depth);
+    free(text);
+    return r;
+}
+
+/* Walk the include graph of source_file transitively, resolving headers
+ * against the search paths on the command line and the compiler's own
+ * defaults. Every header reached is appended to found (in a stable,
+ * depth-first order) with its content hash; the source itself is not.
+ * Includes that cannot be resolved, e.g. behind an #if for another
+ * platform, are skipped. Returns -1 if the source cannot be read or a
+ * header cannot be recorded. */
+int scan_includes(const char *source_file, char **compiler_argv, manifest_t *found) {
+    scan_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.found = found;
+    path_set_init(&ctx.visited);
+
+    build_search_path(&ctx, compiler_argv, source_file);
+    path_set_add(&ctx.visited, source_file);
+
+    /* -include files are processed before the source, from the cwd first */
+    int r = 0;
+    for (int i = 1; compiler_argv[i] && r == 0; i++) {
+        const char *name = flag_value(compiler_argv, &i, "-include");
+        if (!name) continue;
+        char resolved[4096];
+        int idx = resolve_include(&ctx, name, 1, 0, "", -1, resolved, sizeof(resolved));
+        if (idx != -2) r = scan_file(&ctx, resolved, idx, 1);
+    }
+
+    size_t len;
+    char *text = r == 0 ? read_file(source_file, &len) : NULL;
+    if (text) {
+        r = scan_text(&ctx, source_file, -1, text, len, 0);
+        free(text);
+    } else {
+        r = -1;
+    }
+
+    path_set_free(&ctx.visited);
+    free(ctx.default_dirs);
+    return r;
+}
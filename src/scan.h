@@ -0,0 +1,8 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "manifest.h"
+
+int scan_includes(const char *source_file, char **compiler_argv, manifest_t *found);
+
+#endif
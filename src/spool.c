@@ -0,0 +1,289 @@
+#define _DEFAULT_SOURCE  // flock(), setsid()
+
+#include "spool.h"
+#include "cache.h"
+#include "network.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+
+/* Uploads waiting for the remote cache, one file per key in
+ * ~/.quickcache/spool holding the path of the object to send. A store
+ * writes its entry and returns; a detached uploader process, started on
+ * demand and serialized by a lock on the spool, sends the entries and
+ * removes each one only after the server has accepted it. An entry thus
+ * outlives a crash, a kill or an unreachable server and is sent when
+ * the next uploader runs (at least once; a PUT of the same key is
+ * idempotent). */
+
+#define SPOOL_LOCK_NAME ".lock"
+
+/* The running binary, for exec'ing the uploader */
+#define SELF_EXE "/proc/self/exe"
+
+static void spool_dir(char *buf, size_t len) {
+    char cache_dir[4096];
+    cache_get_base_dir(cache_dir, sizeof(cache_dir));
+    snprintf(buf, len, "%s/%s", cache_dir, SPOOL_DIR_NAME);
+}
+
+static void spool_entry_path(const char *hex, char *buf, size_t len) {
+    char dir[4096];
+    spool_dir(dir, sizeof(dir));
+    snprintf(buf, len, "%s/%s", dir, hex);
+}
+
+/* Entries are named by their key; anything else (the lock, temporary
+ * files) starts with a dot */
+static int is_entry(const char *name, hash_t key) {
+    return strlen(name) == HASH_HEX_SIZE - 1 && hash_from_hex(name, key) == 0;
+}
+
+int spool_add(const hash_t key, const char *file_path) {
+    char dir[4096], hex[HASH_HEX_SIZE], tmp[4096], path[4096];
+    spool_dir(dir, sizeof(dir));
+    hash_to_hex(key, hex);
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%d", dir, hex, (int)getpid());
+    spool_entry_path(hex, path, sizeof(path));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT && make_dirs(dir) == 0) {
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) return -1;
+
+    int rc = write_all(fd, file_path, strlen(file_path));
+    if (close(fd) != 0) rc = -1;
+    /* Rename so the uploader never reads a half-written entry */
+    if (rc != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void spool_remove(const hash_t key) {
+    char hex[HASH_HEX_SIZE], path[4096];
+    hash_to_hex(key, hex);
+    spool_entry_path(hex, path, sizeof(path));
+    unlink(path);
+}
+
+int spool_pending(void) {
+    char dir[4096];
+    spool_dir(dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    int count = 0;
+    hash_t key;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (is_entry(ent->d_name, key)) count++;
+    }
+    closedir(d);
+    return count;
+}
+
+/* Entries whose keys are checked against the server in one request */
+#define SPOOL_BATCH 256
+
+typedef struct {
+    hash_t keys[SPOOL_BATCH];
+    char paths[SPOOL_BATCH][4096];
+    int present[SPOOL_BATCH];
+    int count;
+} spool_batch_t;
+
+/* Queue a batch for upload, except keys the server already has (from
+ * another machine, or an upload whose acknowledgement was lost) */
+static void spool_send(spool_batch_t *b) {
+    int checked = network_exists_batch(b->keys, b->count, b->present) == 0;
+    uint64_t skipped = 0;
+    for (int i = 0; i < b->count; i++) {
+        if (checked && b->present[i]) {
+            spool_remove(b->keys[i]);
+            skipped++;
+        } else {
+            network_put_spooled(b->keys[i], b->paths[i]);
+        }
+    }
+    if (skipped > 0) stats_record_upload_skipped(skipped);
+    b->count = 0;
+}
+
+/* Queue every entry for upload; returns how many there were */
+static int spool_scan(void) {
+    char dir[4096];
+    spool_dir(dir, sizeof(dir));
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+
+    spool_batch_t *b = malloc(sizeof(*b));
+    if (!b) {
+        closedir(d);
+        return 0;
+    }
+    b->count = 0;
+
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (!is_entry(ent->d_name, b->keys[b->count])) continue;
+
+        char path[4096];
+        char *file_path = b->paths[b->count];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        ssize_t n = read(fd, file_path, sizeof(b->paths[0]) - 1);
+        close(fd);
+        if (n <= 0) {
+            unlink(path);
+            continue;
+        }
+        file_path[n] = '\0';
+
+        count++;
+        if (++b->count == SPOOL_BATCH) spool_send(b);
+    }
+    closedir(d);
+    if (b->count > 0) spool_send(b);
+    free(b);
+    return count;
+}
+
+/* Upload passes until the spool is empty. Returns -1 if a pass got
+ * nothing through, when the server is presumably down; the entries wait
+ * for the next uploader. */
+static int spool_drain(void) {
+    for (;;) {
+        uint64_t before = network_wait_uploads();
+        if (spool_scan() == 0) return 0;
+        if (network_wait_uploads() == before && spool_pending() > 0) return -1;
+    }
+}
+
+/* Run with the spool lock held on lock_fd, which this closes. An entry
+ * added while the lock was held was either seen by a pass or is seen by
+ * the check after unlocking, so none is stranded by our exit. */
+static int uploader_main(int lock_fd) {
+    int rc;
+    for (;;) {
+        rc = spool_drain();
+        flock(lock_fd, LOCK_UN);
+        if (rc != 0 || spool_pending() == 0) break;
+        /* Someone else may have taken over meanwhile */
+        if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) break;
+    }
+    close(lock_fd);
+    return rc;
+}
+
+static int open_lock(void) {
+    char dir[4096], lock_path[4096];
+    spool_dir(dir, sizeof(dir));
+    snprintf(lock_path, sizeof(lock_path), "%s/%s", dir, SPOOL_LOCK_NAME);
+    return open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/* The uploader itself, with the spool lock held on lock_fd */
+int spool_run_uploader(int lock_fd) {
+    /* A kill just leaves the entries for the next uploader */
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    trace_init();
+    trace_process_name("quickcache uploader");
+    int rc = uploader_main(lock_fd);
+    network_cleanup();
+    return rc;
+}
+
+/* Close everything but stdio and keep, such as the accepted client
+ * connections of a daemon, which are not close-on-exec */
+static void close_inherited(int keep) {
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 65536) max = 65536;
+    for (int fd = STDERR_FILENO + 1; fd < max; fd++) {
+        if (fd != keep) close(fd);
+    }
+}
+
+/* Start a detached uploader unless one is running. The lock is taken
+ * here and inherited, so two wrappers cannot both start one; a running
+ * uploader picks up entries added after it started.
+ *
+ * The uploader is a fresh exec of this binary (--run-uploader), so it
+ * holds none of the caller's descriptors, like the daemon's socket and
+ * lock, and none of the locks its other threads held at the fork.
+ * Without /proc to find the binary it runs in the forked child. */
+void spool_start_uploader(void) {
+    int lock_fd = open_lock();
+    if (lock_fd == -1) return;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+        close(lock_fd);
+        return;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(lock_fd);
+        return;
+    }
+
+    if (pid == 0) {
+        setsid();
+        if (fork() != 0) _exit(0);
+        if (chdir("/") == -1) _exit(1);
+
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull != -1) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+            if (devnull > STDERR_FILENO) close(devnull);
+        }
+
+        char self[4096];
+        ssize_t n = readlink(SELF_EXE, self, sizeof(self) - 1);
+        if (n > 0) {
+            self[n] = '\0';
+            close_inherited(lock_fd);
+            int flags = fcntl(lock_fd, F_GETFD);
+            if (flags != -1) fcntl(lock_fd, F_SETFD, flags & ~FD_CLOEXEC);
+
+            char fd_arg[16];
+            snprintf(fd_arg, sizeof(fd_arg), "%d", lock_fd);
+            char *args[] = { self, "--run-uploader", fd_arg, NULL };
+            execv(self, args);
+            _exit(1);
+        }
+
+        network_after_fork();
+        _exit(spool_run_uploader(lock_fd) == 0 ? 0 : 1);
+    }
+
+    close(lock_fd);
+    waitpid(pid, NULL, 0);
+}
+
+/* Upload everything in the spool from this process, waiting for a
+ * running uploader first; for the end of a CI job */
+int spool_flush(void) {
+    int lock_fd = open_lock();
+    if (lock_fd == -1) return spool_pending() == 0 ? 0 : -1;
+    while (flock(lock_fd, LOCK_EX) == -1 && errno == EINTR) {}
+    return uploader_main(lock_fd);
+}
@@ -0,0 +1,15 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "hash.h"
+
+#define SPOOL_DIR_NAME "spool"
+
+int spool_add(const hash_t key, const char *file_path);
+void spool_remove(const hash_t key);
+int spool_pending(void);
+void spool_start_uploader(void);
+int spool_run_uploader(int lock_fd);
+int spool_flush(void);
+
+#endif
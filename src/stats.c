@@ -1,10 +1,71 @@
+#define _DEFAULT_SOURCE  // flock, clock_gettime
+
 #include "stats.h"
 #include "cache.h"
+#include "metadata.h"
 #include "utils.h"
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Counters shared by every process through one small mmap'd file. Each
+ * counter has a cache line to itself and is bumped with an atomic add,
+ * so concurrent compiles neither lose updates nor contend on a line, and
+ * recording costs no system call. */
 
 #define STATS_FILE "stats.bin"
+#define STATS_MAGIC 0x53545351u  /* "QSTS" */
+#define STATS_VERSION 6
+#define STATS_SNAPSHOT_TRIES 100
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t created;
+    uint64_t reserved[6];
+} stats_header_t;
+
+typedef struct {
+    uint64_t value;
+    uint64_t pad[7];
+} stats_counter_t;
+
+typedef struct {
+    stats_header_t header;
+    stats_counter_t counters[STAT_COUNTERS];
+    /* Version 2 and later. Buckets are not padded: a phase ends at most a
+     * few times per compile, so they see little contention. */
+    uint64_t histograms[CLASS_COUNT][PHASE_COUNT][STAT_BUCKETS];
+    uint64_t latency_sum_us[CLASS_COUNT][PHASE_COUNT];  /* version 3 */
+} stats_file_t;
+
+_Static_assert(sizeof(stats_header_t) == 64, "stats header must stay 64 bytes");
+_Static_assert(sizeof(stats_counter_t) == 64, "stats counters must stay one cache line");
+
+/* stats.bin as written before the counters were shared */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_saved;
+    uint64_t total_lookups;
+    time_t created;
+    time_t last_updated;
+    uint64_t hits_by_method[4];
+} legacy_stats_t;
+
+static stats_file_t *stats_map = NULL;
+static int stats_unavailable = 0;
+
+/* Phase times of the current invocation (or daemon request, on the
+ * thread serving it), recorded once it is known whether it was a hit */
+static _Thread_local uint64_t phase_ns[PHASE_COUNT];
+static _Thread_local unsigned phase_timed;  /* bit per phase */
 
 static void get_stats_path(char *buf, size_t len) {
     char cache_dir[4096];
@@ -12,88 +73,500 @@ static void get_stats_path(char *buf, size_t len) {
     snprintf(buf, len, "%s/%s", cache_dir, STATS_FILE);
 }
 
-int stats_init(void) {
-    char path[4096];
-    get_stats_path(path, sizeof(path));
-    
-    if (!file_exists(path)) {
-        stats_t stats = {0};
-        stats.created = time(NULL);
-        stats.last_updated = time(NULL);
-        return stats_save(&stats);
+/* Counts from an old stats.bin, which the new layout then overwrites */
+static void import_legacy(stats_file_t *map, size_t old_size) {
+    legacy_stats_t old;
+    memset(&old, 0, sizeof(old));
+    memcpy(&old, map, old_size < sizeof(old) ? old_size : sizeof(old));
+    memset(map, 0, sizeof(*map));
+
+    uint64_t local = 0;
+    for (int i = 0; i < 4; i++) {
+        map->counters[STAT_HIT_METHOD + i].value = old.hits_by_method[i];
+        local += old.hits_by_method[i];
     }
-    return 0;
+    map->counters[STAT_LOCAL_HITS].value = local;
+    map->counters[STAT_REMOTE_HITS].value = old.hits > local ? old.hits - local : 0;
+    map->counters[STAT_MISSES].value = old.misses;
+    map->counters[STAT_BYTES_SAVED].value = old.bytes_saved;
+    map->header.created = old.created ? (int64_t)old.created : (int64_t)time(NULL);
 }
 
-int stats_load(stats_t *stats) {
+/* Bring a file of an older version of this layout up to date, keeping
+ * its counts */
+static void upgrade(stats_file_t *file) {
+    /* Counters in each version; new ones were appended, and from version
+     * 2 on, the histograms (then the sums, from 3) follow them */
+    static const int old_counters[STATS_VERSION] = { 0, 13, 13, 16, 18, 19 };
+    uint32_t version = file->header.version;
+    int counters = old_counters[version];
+    char *old_histograms = (char *)file->counters + counters * sizeof(stats_counter_t);
+
+    /* Everything moves up; the sums first, as the histograms land on them */
+    if (version >= 3) {
+        memmove(file->latency_sum_us, old_histograms + sizeof(file->histograms),
+                sizeof(file->latency_sum_us));
+    } else {
+        memset(file->latency_sum_us, 0, sizeof(file->latency_sum_us));
+    }
+    if (version >= 2) {
+        memmove(file->histograms, old_histograms, sizeof(file->histograms));
+    } else {
+        memset(file->histograms, 0, sizeof(file->histograms));
+    }
+    memset(&file->counters[counters], 0, (STAT_COUNTERS - counters) * sizeof(stats_counter_t));
+    file->header.version = STATS_VERSION;
+}
+
+static int stats_open(void) {
+    if (stats_map) return 0;
+    if (stats_unavailable) return -1;
+
     char path[4096];
     get_stats_path(path, sizeof(path));
-    
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        memset(stats, 0, sizeof(stats_t));
-        stats->created = time(NULL);
-        stats->last_updated = time(NULL);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        char cache_dir[4096];
+        cache_get_base_dir(cache_dir, sizeof(cache_dir));
+        make_dirs(cache_dir);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        stats_unavailable = 1;
         return -1;
     }
-    
-    size_t read = fread(stats, sizeof(stats_t), 1, f);
-    fclose(f);
-    return read == 1 ? 0 : -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        ((size_t)st.st_size >= sizeof(stats_file_t) || ftruncate(fd, sizeof(stats_file_t)) == 0)) {
+        map = mmap(NULL, sizeof(stats_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        stats_unavailable = 1;
+        return -1;
+    }
+
+    /* A new, old-format or foreign file is claimed under the lock, so two
+     * first users cannot both initialize it and drop each other's counts */
+    stats_file_t *file = map;
+    if (file->header.magic != STATS_MAGIC || file->header.version != STATS_VERSION) {
+        while (flock(fd, LOCK_EX) == -1 && errno == EINTR) {}
+        if (file->header.magic == STATS_MAGIC && file->header.version >= 1 &&
+            file->header.version < STATS_VERSION) {
+            upgrade(file);
+        } else if (file->header.magic != STATS_MAGIC || file->header.version != STATS_VERSION) {
+            import_legacy(file, (size_t)st.st_size);
+            file->header.version = STATS_VERSION;
+            __atomic_store_n(&file->header.magic, STATS_MAGIC, __ATOMIC_RELEASE);
+        }
+        flock(fd, LOCK_UN);
+    }
+    close(fd);
+
+    stats_map = file;
+    return 0;
 }
 
-int stats_save(const stats_t *stats) {
-    char path[4096];
-    get_stats_path(path, sizeof(path));
-    
-    FILE *f = fopen(path, "wb");
-    if (!f) return -1;
-    
-    size_t written = fwrite(stats, sizeof(stats_t), 1, f);
-    fclose(f);
-    return written == 1 ? 0 : -1;
+static void add(stat_counter_t counter, uint64_t n) {
+    if (stats_open() == -1) return;
+    __atomic_fetch_add(&stats_map->counters[counter].value, n, __ATOMIC_RELAXED);
 }
 
+int stats_init(void) {
+    return stats_open();
+}
+
+/* ---------- RECORDING ---------- */
 void stats_record_hit(size_t bytes) {
-    stats_t stats;
-    stats_load(&stats);
-    stats.hits++;
-    stats.total_lookups++;
-    stats.bytes_saved += bytes;
-    stats.last_updated = time(NULL);
-    stats_save(&stats);
+    add(STAT_REMOTE_HITS, 1);
+    add(STAT_BYTES_SAVED, bytes);
+}
+
+void stats_record_local_hit(size_t bytes, hit_method_t method, uint32_t compile_ms) {
+    add(STAT_LOCAL_HITS, 1);
+    add(STAT_BYTES_SAVED, bytes);
+    add(STAT_TIME_SAVED_MS, compile_ms);
+    add(STAT_HIT_METHOD + method, 1);
 }
 
 void stats_record_miss(void) {
-    stats_t stats;
-    stats_load(&stats);
-    stats.misses++;
-    stats.total_lookups++;
-    stats.last_updated = time(NULL);
-    stats_save(&stats);
-}
-
-void stats_print(void) {
-    stats_t stats;
-    if (stats_load(&stats) == -1) {
-        printf("No statistics available\n");
-        return;
-    }
-    
-    double hit_rate = stats.total_lookups > 0 
-        ? (100.0 * stats.hits / stats.total_lookups) 
-        : 0.0;
-    
-    double mb_saved = stats.bytes_saved / (1024.0 * 1024.0);
-    
+    add(STAT_MISSES, 1);
+}
+
+void stats_record_error(stat_error_t error) {
+    add(STAT_ERRORS + error, 1);
+}
+
+void stats_record_remote_miss(void) {
+    add(STAT_REMOTE_MISSES, 1);
+}
+
+void stats_record_eviction(uint64_t entries, uint64_t bytes) {
+    add(STAT_EVICTIONS, entries);
+    add(STAT_EVICTED_BYTES, bytes);
+}
+
+/* One remote request, and the connections it had to open (0 on reuse) */
+void stats_record_remote_request(uint64_t connects) {
+    add(STAT_REMOTE_REQUESTS, 1);
+    add(STAT_REMOTE_CONNECTS, connects);
+}
+
+void stats_record_upload_dropped(uint64_t uploads) {
+    add(STAT_UPLOADS_DROPPED, uploads);
+}
+
+void stats_record_upload_skipped(uint64_t uploads) {
+    add(STAT_UPLOADS_SKIPPED, uploads);
+}
+
+/* ---------- LATENCY ---------- */
+uint64_t stats_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Bucket b >= 8 covers [(4 + b%4) << (b/4 - 2), (5 + b%4) << (b/4 - 2))
+ * microseconds; 0-3 are single microseconds and 4-7 unused */
+static int bucket_for(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    if (us < 4) return (int)us;
+
+    int e = 63 - __builtin_clzll(us);
+    int b = e * 4 + (int)((us >> (e - 2)) & 3);
+    return b < STAT_BUCKETS ? b : STAT_BUCKETS - 1;
+}
+
+/* Upper end of a bucket, in microseconds */
+static uint64_t bucket_limit(int b) {
+    if (b < 4) return (uint64_t)b + 1;
+    return (uint64_t)(5 + b % 4) << (b / 4 - 2);
+}
+
+void stats_phase_add(stat_phase_t phase, uint64_t ns) {
+    phase_ns[phase] += ns;
+    phase_timed |= 1u << phase;
+}
+
+void stats_phase_commit(stat_class_t cls) {
+    if (phase_timed && stats_open() == 0) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            if (!(phase_timed & (1u << p))) continue;
+            __atomic_fetch_add(&stats_map->histograms[cls][p][bucket_for(phase_ns[p])], 1,
+                               __ATOMIC_RELAXED);
+            __atomic_fetch_add(&stats_map->latency_sum_us[cls][p], phase_ns[p] / 1000,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    memset(phase_ns, 0, sizeof(phase_ns));
+    phase_timed = 0;
+}
+
+/* ---------- READING ---------- */
+/* Counters that all held their values at one instant: read them until
+ * two passes in a row agree, which only fails under a sustained stream
+ * of updates (the last pass is used then). */
+int stats_snapshot(stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (stats_open() == -1) return -1;
+
+    stats_t check;
+    for (int tries = 0; tries < STATS_SNAPSHOT_TRIES; tries++) {
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            stats->counters[i] = __atomic_load_n(&stats_map->counters[i].value, __ATOMIC_ACQUIRE);
+        }
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            check.counters[i] = __atomic_load_n(&stats_map->counters[i].value, __ATOMIC_ACQUIRE);
+        }
+        if (memcmp(stats->counters, check.counters, sizeof(check.counters)) == 0) break;
+    }
+
+    /* Percentiles do not need the buckets to agree with each other */
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            for (int b = 0; b < STAT_BUCKETS; b++)
+                stats->histograms[c][p][b] =
+                    __atomic_load_n(&stats_map->histograms[c][p][b], __ATOMIC_RELAXED);
+            stats->latency_sum_us[c][p] =
+                __atomic_load_n(&stats_map->latency_sum_us[c][p], __ATOMIC_RELAXED);
+        }
+    }
+
+    stats->created = (time_t)__atomic_load_n(&stats_map->header.created, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Take a snapshot's counts off the counters; anything recorded since the
+ * snapshot is kept */
+void stats_reset(const stats_t *snapshot) {
+    if (stats_open() == -1) return;
+
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        __atomic_fetch_sub(&stats_map->counters[i].value, snapshot->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            for (int b = 0; b < STAT_BUCKETS; b++)
+                __atomic_fetch_sub(&stats_map->histograms[c][p][b],
+                                   snapshot->histograms[c][p][b], __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&stats_map->latency_sum_us[c][p],
+                               snapshot->latency_sum_us[c][p], __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&stats_map->header.created, (int64_t)time(NULL), __ATOMIC_RELAXED);
+}
+
+static void format_duration(double seconds, char *buf, size_t len) {
+    if (seconds < 60)
+        snprintf(buf, len, "%.1f s", seconds);
+    else if (seconds < 3600)
+        snprintf(buf, len, "%.1f min", seconds / 60);
+    else
+        snprintf(buf, len, "%.1f h", seconds / 3600);
+}
+
+void stats_print(const stats_t *stats) {
+    const uint64_t *c = stats->counters;
+    uint64_t hits = c[STAT_LOCAL_HITS] + c[STAT_REMOTE_HITS];
+    uint64_t lookups = hits + c[STAT_MISSES];
+    double hit_rate = lookups > 0 ? (100.0 * hits / lookups) : 0.0;
+
+    double mb_saved = c[STAT_BYTES_SAVED] / (1024.0 * 1024.0);
+
     printf("BuildCache Statistics\n");
     printf("=====================\n");
-    printf("Cache hits:     %lu\n", stats.hits);
-    printf("Cache misses:   %lu\n", stats.misses);
+    printf("Cache hits:     %lu (%lu local, %lu remote)\n",
+           hits, c[STAT_LOCAL_HITS], c[STAT_REMOTE_HITS]);
+    printf("Cache misses:   %lu\n", c[STAT_MISSES]);
     printf("Hit rate:       %.1f%%\n", hit_rate);
     printf("Data saved:     %.2f MB\n", mb_saved);
-    
+    printf("Local hits:     %lu reflink, %lu hardlink, %lu copy, %lu decompress\n",
+           c[STAT_HIT_METHOD + HIT_REFLINK], c[STAT_HIT_METHOD + HIT_HARDLINK],
+           c[STAT_HIT_METHOD + HIT_COPY], c[STAT_HIT_METHOD + HIT_DECOMPRESS]);
+
+    /* Local hits on entries with a known compile time; the second figure
+     * only counts recorded hits, at most one per entry per
+     * access_granularity */
+    char saved[32], held[32];
+    format_duration(c[STAT_TIME_SAVED_MS] / 1000.0, saved, sizeof(saved));
+    format_duration(metadata_time_saved() / 1000.0, held, sizeof(held));
+    printf("Time saved:     %s (%s by entries now in the cache)\n", saved, held);
+    printf("Remote:         %lu requests, %lu new connections, %lu uploads dropped, "
+           "%lu skipped\n",
+           c[STAT_REMOTE_REQUESTS], c[STAT_REMOTE_CONNECTS], c[STAT_UPLOADS_DROPPED],
+           c[STAT_UPLOADS_SKIPPED]);
+    printf("Errors:         %lu local, %lu remote, %lu key, %lu compiler\n",
+           c[STAT_ERRORS + STAT_ERROR_LOCAL], c[STAT_ERRORS + STAT_ERROR_REMOTE],
+           c[STAT_ERRORS + STAT_ERROR_KEY], c[STAT_ERRORS + STAT_ERROR_COMPILER]);
+
     time_t now = time(NULL);
-    double days = difftime(now, stats.created) / 86400.0;
-    printf("Cache age:      %.1f days\n", days);
+    double days = difftime(now, stats->created) / 86400.0;
+    printf("Stats age:      %.1f days\n", days);
+}
+
+static const char *phase_names[PHASE_COUNT] = {
+    "args", "key", "metadata", "materialize", "network_get", "store", "compile", "total"
+};
+
+static const char *class_names[CLASS_COUNT] = { "hit", "miss" };
+static const char *method_names[4] = { "copy", "reflink", "hardlink", "decompress" };
+static const char *error_names[4] = { "local", "remote", "key", "compiler" };
+
+static uint64_t histogram_count(const uint64_t *buckets) {
+    uint64_t total = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) total += buckets[b];
+    return total;
+}
+
+/* Smallest bucket limit with at least pct percent of the samples at or
+ * below it */
+static uint64_t percentile(const uint64_t *buckets, uint64_t total, int pct) {
+    uint64_t want = (total * pct + 99) / 100;
+    uint64_t seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= want) return bucket_limit(b);
+    }
+    return bucket_limit(STAT_BUCKETS - 1);
+}
+
+static void format_us(uint64_t us, char *buf, size_t len) {
+    if (us < 1000)
+        snprintf(buf, len, "%luus", us);
+    else if (us < 1000000)
+        snprintf(buf, len, "%.1fms", us / 1000.0);
+    else
+        snprintf(buf, len, "%.2fs", us / 1000000.0);
+}
+
+/* p50/p90/p99 of every timed phase. Percentiles are bucket upper ends,
+ * so within about 25% above the true value. In daemon mode the wrapper
+ * and the daemon each count the phases they run. */
+void stats_print_latency(const stats_t *stats) {
+    printf("\nLatency          class   count       p50       p90       p99\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        for (int c = 0; c < CLASS_COUNT; c++) {
+            const uint64_t *buckets = stats->histograms[c][p];
+            uint64_t total = histogram_count(buckets);
+            if (total == 0) continue;
+
+            char p50[16], p90[16], p99[16];
+            format_us(percentile(buckets, total, 50), p50, sizeof(p50));
+            format_us(percentile(buckets, total, 90), p90, sizeof(p90));
+            format_us(percentile(buckets, total, 99), p99, sizeof(p99));
+            printf("  %-14s %-5s %7lu %9s %9s %9s\n",
+                   phase_names[p], class_names[c], total, p50, p90, p99);
+        }
+    }
+}
+
+/* ---------- EXPORT ---------- */
+/* Everything --stats knows, for scraping. Counters are totals since the
+ * last reset; cache size, entries and the time saved by cached entries
+ * are current values from the metadata. */
+void stats_print_json(const stats_t *stats) {
+    const uint64_t *c = stats->counters;
+
+    printf("{\n");
+    printf("  \"created\": %ld,\n", (long)stats->created);
+    printf("  \"local_hits\": %lu,\n", c[STAT_LOCAL_HITS]);
+    printf("  \"remote_hits\": %lu,\n", c[STAT_REMOTE_HITS]);
+    printf("  \"remote_misses\": %lu,\n", c[STAT_REMOTE_MISSES]);
+    printf("  \"misses\": %lu,\n", c[STAT_MISSES]);
+    printf("  \"bytes_saved\": %lu,\n", c[STAT_BYTES_SAVED]);
+    printf("  \"time_saved_ms\": %lu,\n", c[STAT_TIME_SAVED_MS]);
+    printf("  \"local_hit_methods\": {");
+    for (int i = 0; i < 4; i++)
+        printf("%s\"%s\": %lu", i ? ", " : "", method_names[i], c[STAT_HIT_METHOD + i]);
+    printf("},\n");
+    printf("  \"errors\": {");
+    for (int i = 0; i < 4; i++)
+        printf("%s\"%s\": %lu", i ? ", " : "", error_names[i], c[STAT_ERRORS + i]);
+    printf("},\n");
+    printf("  \"remote_requests\": %lu,\n", c[STAT_REMOTE_REQUESTS]);
+    printf("  \"remote_connects\": %lu,\n", c[STAT_REMOTE_CONNECTS]);
+    printf("  \"uploads_dropped\": %lu,\n", c[STAT_UPLOADS_DROPPED]);
+    printf("  \"uploads_skipped\": %lu,\n", c[STAT_UPLOADS_SKIPPED]);
+    printf("  \"evictions\": %lu,\n", c[STAT_EVICTIONS]);
+    printf("  \"evicted_bytes\": %lu,\n", c[STAT_EVICTED_BYTES]);
+    printf("  \"cache_size_bytes\": %lu,\n", metadata_total_size());
+    printf("  \"cache_entries\": %lu,\n", metadata_entry_count());
+    printf("  \"cached_time_saved_ms\": %lu,\n", metadata_time_saved());
+
+    /* Non-empty buckets only, keyed by their upper end */
+    printf("  \"latency\": [");
+    int first = 1;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        for (int cls = 0; cls < CLASS_COUNT; cls++) {
+            const uint64_t *buckets = stats->histograms[cls][p];
+            uint64_t total = histogram_count(buckets);
+            if (total == 0) continue;
+
+            printf("%s\n    {\"phase\": \"%s\", \"class\": \"%s\", \"count\": %lu, "
+                   "\"sum_us\": %lu, \"p50_us\": %lu, \"p90_us\": %lu, \"p99_us\": %lu, "
+                   "\"buckets_us\": {",
+                   first ? "" : ",", phase_names[p], class_names[cls], total,
+                   stats->latency_sum_us[cls][p], percentile(buckets, total, 50),
+                   percentile(buckets, total, 90), percentile(buckets, total, 99));
+            int first_bucket = 1;
+            for (int b = 0; b < STAT_BUCKETS; b++) {
+                if (buckets[b] == 0) continue;
+                printf("%s\"%lu\": %lu", first_bucket ? "" : ", ", bucket_limit(b), buckets[b]);
+                first_bucket = 0;
+            }
+            printf("}}");
+            first = 0;
+        }
+    }
+    printf("%s]\n", first ? "" : "\n  ");
+    printf("}\n");
+}
+
+/* Prometheus buckets are every eighth of ours, powers of 4 from 16us to
+ * about 18 minutes (the last of ours also holds anything longer), so
+ * each series stays short and every agent exposes the same boundaries.
+ * Our bucket 8k+7 ends at 4^(k+1) us. */
+#define PROM_FIRST_BUCKET 15
+#define PROM_BUCKET_STEP 8
+
+static void prom_counter(const char *name, const char *help, uint64_t value) {
+    printf("# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+static void prom_gauge(const char *name, const char *help, uint64_t value) {
+    printf("# HELP %s %s\n# TYPE %s gauge\n%s %lu\n", name, help, name, name, value);
+}
+
+void stats_print_prometheus(const stats_t *stats) {
+    const uint64_t *c = stats->counters;
+
+    printf("# HELP quickcache_hits_total Cache hits.\n# TYPE quickcache_hits_total counter\n");
+    printf("quickcache_hits_total{source=\"local\"} %lu\n", c[STAT_LOCAL_HITS]);
+    printf("quickcache_hits_total{source=\"remote\"} %lu\n", c[STAT_REMOTE_HITS]);
+    prom_counter("quickcache_misses_total", "Lookups that missed both caches.", c[STAT_MISSES]);
+    prom_counter("quickcache_remote_misses_total", "Remote lookups answered with 404.",
+                 c[STAT_REMOTE_MISSES]);
+    prom_counter("quickcache_bytes_saved_total", "Output bytes served from the cache.",
+                 c[STAT_BYTES_SAVED]);
+    printf("# HELP quickcache_time_saved_seconds_total Compile time saved by local hits.\n"
+           "# TYPE quickcache_time_saved_seconds_total counter\n"
+           "quickcache_time_saved_seconds_total %.3f\n", c[STAT_TIME_SAVED_MS] / 1000.0);
+
+    printf("# HELP quickcache_local_hits_total Local hits by how the output was written.\n"
+           "# TYPE quickcache_local_hits_total counter\n");
+    for (int i = 0; i < 4; i++)
+        printf("quickcache_local_hits_total{method=\"%s\"} %lu\n", method_names[i],
+               c[STAT_HIT_METHOD + i]);
+    printf("# HELP quickcache_errors_total Failures by where they happened.\n"
+           "# TYPE quickcache_errors_total counter\n");
+    for (int i = 0; i < 4; i++)
+        printf("quickcache_errors_total{kind=\"%s\"} %lu\n", error_names[i], c[STAT_ERRORS + i]);
+
+    prom_counter("quickcache_remote_requests_total", "Requests made to the remote cache.",
+                 c[STAT_REMOTE_REQUESTS]);
+    prom_counter("quickcache_remote_connects_total", "Connections opened to the remote cache.",
+                 c[STAT_REMOTE_CONNECTS]);
+    prom_counter("quickcache_uploads_dropped_total", "Uploads dropped: queue full or exit deadline.",
+                 c[STAT_UPLOADS_DROPPED]);
+    prom_counter("quickcache_uploads_skipped_total", "Uploads skipped as the server had the key.",
+                 c[STAT_UPLOADS_SKIPPED]);
+    prom_counter("quickcache_evictions_total", "Entries evicted to enforce the size limit.",
+                 c[STAT_EVICTIONS]);
+    prom_counter("quickcache_evicted_bytes_total", "Stored bytes evicted.", c[STAT_EVICTED_BYTES]);
+    prom_gauge("quickcache_cache_size_bytes", "Stored size of the local cache.",
+               metadata_total_size());
+    prom_gauge("quickcache_cache_entries", "Entries in the local cache.", metadata_entry_count());
+    printf("# HELP quickcache_cached_time_saved_seconds Compile time saved by entries now cached.\n"
+           "# TYPE quickcache_cached_time_saved_seconds gauge\n"
+           "quickcache_cached_time_saved_seconds %.3f\n", metadata_time_saved() / 1000.0);
+    prom_gauge("quickcache_stats_reset_timestamp_seconds", "When the counters were last reset.",
+               (uint64_t)stats->created);
+
+    printf("# HELP quickcache_phase_duration_seconds Wrapper time per phase.\n"
+           "# TYPE quickcache_phase_duration_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        for (int cls = 0; cls < CLASS_COUNT; cls++) {
+            const uint64_t *buckets = stats->histograms[cls][p];
+            char labels[64];
+            snprintf(labels, sizeof(labels), "phase=\"%s\",class=\"%s\"", phase_names[p],
+                     class_names[cls]);
+
+            uint64_t cumulative = 0;
+            int b = 0;
+            for (int edge = PROM_FIRST_BUCKET; edge < STAT_BUCKETS - 1; edge += PROM_BUCKET_STEP) {
+                for (; b <= edge; b++) cumulative += buckets[b];
+                printf("quickcache_phase_duration_seconds_bucket{%s,le=\"%g\"} %lu\n",
+                       labels, bucket_limit(edge) / 1e6, cumulative);
+            }
+            uint64_t total = histogram_count(buckets);
+            printf("quickcache_phase_duration_seconds_bucket{%s,le=\"+Inf\"} %lu\n", labels, total);
+            printf("quickcache_phase_duration_seconds_sum{%s} %.6f\n", labels,
+                   stats->latency_sum_us[cls][p] / 1e6);
+            printf("quickcache_phase_duration_seconds_count{%s} %lu\n", labels, total);
+        }
+    }
 }
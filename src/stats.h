@@ -1,23 +1,100 @@
 #ifndef STATS_H
 #define STATS_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
+/* How a local hit was written to the output path */
+typedef enum {
+    HIT_COPY = 0,
+    HIT_REFLINK,
+    HIT_HARDLINK,
+    HIT_DECOMPRESS
+} hit_method_t;
+
+/* Failures, by where they happened */
+typedef enum {
+    STAT_ERROR_LOCAL = 0,   /* reading or writing the local store */
+    STAT_ERROR_REMOTE,      /* remote cache unreachable or refusing */
+    STAT_ERROR_KEY,         /* no cache key could be computed */
+    STAT_ERROR_COMPILER     /* the compiler failed, nothing to store */
+} stat_error_t;
+
+typedef enum {
+    STAT_LOCAL_HITS = 0,
+    STAT_REMOTE_HITS,
+    STAT_MISSES,
+    STAT_BYTES_SAVED,
+    STAT_TIME_SAVED_MS,
+    STAT_HIT_METHOD,                            /* + hit_method_t */
+    STAT_ERRORS = STAT_HIT_METHOD + 4,          /* + stat_error_t */
+    STAT_REMOTE_MISSES = STAT_ERRORS + 4,       /* remote answered 404 */
+    STAT_EVICTIONS,
+    STAT_EVICTED_BYTES,
+    STAT_REMOTE_REQUESTS,
+    STAT_REMOTE_CONNECTS,                       /* new connections they opened */
+    STAT_UPLOADS_DROPPED,                       /* queue full, or not done by exit */
+    STAT_UPLOADS_SKIPPED,                       /* the server already had the key */
+    STAT_COUNTERS
+} stat_counter_t;
+
+typedef enum {
+    STATS_FORMAT_TEXT = 0,
+    STATS_FORMAT_JSON,
+    STATS_FORMAT_PROMETHEUS
+} stats_format_t;
+
+/* Wrapper phases that are timed */
+typedef enum {
+    PHASE_ARGS = 0,      /* argument parsing and the command hash */
+    PHASE_KEY,           /* hashing the source and its dependencies */
+    PHASE_METADATA,      /* metadata_get */
+    PHASE_MATERIALIZE,   /* decompress, reflink, link or copy to the output */
+    PHASE_NETWORK_GET,
+    PHASE_STORE,         /* cache_store, through the daemon if enabled */
+    PHASE_COMPILE,
+    PHASE_TOTAL,
+    PHASE_COUNT
+} stat_phase_t;
+
+/* Phases are histogrammed separately for hits and misses */
+typedef enum {
+    CLASS_HIT = 0,
+    CLASS_MISS,
+    CLASS_COUNT
+} stat_class_t;
+
+/* Log-scale latency buckets: four per power of two of microseconds,
+ * up to about 70 minutes */
+#define STAT_BUCKETS 128
+
+/* A snapshot of the counters */
 typedef struct {
-    uint64_t hits;
-    uint64_t misses;
-    uint64_t bytes_saved;
-    uint64_t total_lookups;
-    time_t created;
-    time_t last_updated;
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t histograms[CLASS_COUNT][PHASE_COUNT][STAT_BUCKETS];
+    uint64_t latency_sum_us[CLASS_COUNT][PHASE_COUNT];
+    time_t created;  /* when counting started, or the last reset */
 } stats_t;
 
 int stats_init(void);
-int stats_load(stats_t *stats);
-int stats_save(const stats_t *stats);
+int stats_snapshot(stats_t *stats);
+void stats_reset(const stats_t *snapshot);
 void stats_record_hit(size_t bytes);
+void stats_record_local_hit(size_t bytes, hit_method_t method, uint32_t compile_ms);
 void stats_record_miss(void);
-void stats_print(void);
+void stats_record_error(stat_error_t error);
+void stats_record_remote_miss(void);
+void stats_record_eviction(uint64_t entries, uint64_t bytes);
+void stats_record_remote_request(uint64_t connects);
+void stats_record_upload_dropped(uint64_t uploads);
+void stats_record_upload_skipped(uint64_t uploads);
+uint64_t stats_clock_ns(void);
+void stats_phase_add(stat_phase_t phase, uint64_t ns);
+void stats_phase_commit(stat_class_t cls);
+void stats_print(const stats_t *stats);
+void stats_print_latency(const stats_t *stats);
+void stats_print_json(const stats_t *stats);
+void stats_print_prometheus(const stats_t *stats);
 
 #endif
@@ -0,0 +1,204 @@
+#define _GNU_SOURCE  // syscall(SYS_gettid), getline
+
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Chrome trace events, one JSON object per line, appended to a file per
+ * process in $QUICKCACHE_TRACE_DIR. Each event is a single write() to an
+ * O_APPEND descriptor, so the daemon's threads can share it and a crash
+ * leaves every earlier line intact. Timestamps come from CLOCK_MONOTONIC,
+ * which all processes share, so merged files line up on one timeline.
+ * Without the variable every call returns at the first test. */
+
+#define TRACE_SUFFIX ".trace"
+
+static int trace_fd = -1;
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+}
+
+/* Copy s into buf as the inside of a JSON string */
+static void json_escape(const char *s, char *buf, size_t len) {
+    size_t o = 0;
+    for (; *s && o + 7 < len; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') {
+            buf[o++] = '\\';
+            buf[o++] = (char)ch;
+        } else if (ch < 0x20) {
+            o += snprintf(buf + o, len - o, "\\u%04x", ch);
+        } else {
+            buf[o++] = (char)ch;
+        }
+    }
+    buf[o] = '\0';
+}
+
+/* Open this process's trace file if tracing is on. A file inherited
+ * from a parent (the daemon is forked from a wrapper) is replaced. */
+int trace_init(void) {
+    trace_close();
+
+    const char *dir = getenv(TRACE_DIR_ENV);
+    if (!dir || !*dir) return 0;
+    if (make_dirs(dir) == -1) return -1;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/quickcache-%d-%llu" TRACE_SUFFIX, dir, (int)getpid(),
+             now_ns() / 1000);
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return trace_fd == -1 ? -1 : 0;
+}
+
+static void emit(const char *line, int n) {
+    if (n > 0) write_all(trace_fd, line, (size_t)n);
+}
+
+void trace_process_name(const char *name) {
+    if (trace_fd == -1) return;
+
+    char escaped[1024], line[1280];
+    json_escape(name, escaped, sizeof(escaped));
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,"
+                     "\"args\":{\"name\":\"%s\"}}\n",
+                     (int)getpid(), (long)syscall(SYS_gettid), escaped);
+    emit(line, n < (int)sizeof(line) ? n : 0);
+}
+
+/* Start a span; key, if given, is attached to it */
+void trace_begin(const char *name, const hash_t key) {
+    if (trace_fd == -1) return;
+
+    unsigned long long ns = now_ns();
+    char args[128] = "";
+    if (key) {
+        char hex[HASH_HEX_SIZE];
+        hash_to_hex(key, hex);
+        snprintf(args, sizeof(args), ",\"args\":{\"key\":\"%s\"}", hex);
+    }
+
+    char line[512];
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"quickcache\",\"ph\":\"B\",\"ts\":%llu.%03llu,"
+                     "\"pid\":%d,\"tid\":%ld%s}\n",
+                     name, ns / 1000, ns % 1000, (int)getpid(), (long)syscall(SYS_gettid), args);
+    emit(line, n < (int)sizeof(line) ? n : 0);
+}
+
+void trace_end(const char *name) {
+    if (trace_fd == -1) return;
+
+    unsigned long long ns = now_ns();
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"quickcache\",\"ph\":\"E\",\"ts\":%llu.%03llu,"
+                     "\"pid\":%d,\"tid\":%ld}\n",
+                     name, ns / 1000, ns % 1000, (int)getpid(), (long)syscall(SYS_gettid));
+    emit(line, n < (int)sizeof(line) ? n : 0);
+}
+
+/* Spans that overlap on one thread, such as parallel uploads, are async
+ * events told apart by id */
+void trace_async_begin(const char *name, unsigned long id, const hash_t key) {
+    if (trace_fd == -1) return;
+
+    unsigned long long ns = now_ns();
+    char hex[HASH_HEX_SIZE];
+    hash_to_hex(key, hex);
+
+    char line[512];
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"quickcache\",\"ph\":\"b\",\"id\":%lu,"
+                     "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%ld,\"args\":{\"key\":\"%s\"}}\n",
+                     name, id, ns / 1000, ns % 1000, (int)getpid(), (long)syscall(SYS_gettid), hex);
+    emit(line, n < (int)sizeof(line) ? n : 0);
+}
+
+void trace_async_end(const char *name, unsigned long id) {
+    if (trace_fd == -1) return;
+
+    unsigned long long ns = now_ns();
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "{\"name\":\"%s\",\"cat\":\"quickcache\",\"ph\":\"e\",\"id\":%lu,"
+                     "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%ld}\n",
+                     name, id, ns / 1000, ns % 1000, (int)getpid(), (long)syscall(SYS_gettid));
+    emit(line, n < (int)sizeof(line) ? n : 0);
+}
+
+/* ---------- MERGE ---------- */
+/* Join every trace file in dir into one Chrome/Perfetto JSON document,
+ * written to output or stdout. A line cut short by a crash is dropped. */
+int trace_merge(const char *dir, const char *output) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return -1;
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        perror(output);
+        closedir(d);
+        return -1;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    size_t events = 0;
+    int files = 0;
+    char *line = NULL;
+    size_t cap = 0;
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t name_len = strlen(ent->d_name);
+        size_t suffix_len = strlen(TRACE_SUFFIX);
+        if (name_len <= suffix_len ||
+            strcmp(ent->d_name + name_len - suffix_len, TRACE_SUFFIX) != 0) {
+            continue;
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        files++;
+
+        ssize_t n;
+        while ((n = getline(&line, &cap, f)) > 0) {
+            if (line[n - 1] != '\n' || n < 3) continue;
+            line[n - 1] = '\0';
+            fprintf(out, "%s\n%s", events ? "," : "", line);
+            events++;
+        }
+        fclose(f);
+    }
+    free(line);
+    closedir(d);
+
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    int rc = ferror(out) ? -1 : 0;
+    if (output && fclose(out) != 0) rc = -1;
+
+    fprintf(stderr, "Merged %zu events from %d trace files\n", events, files);
+    return rc;
+}
+
+void trace_close(void) {
+    if (trace_fd != -1) {
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "hash.h"
+
+/* Directory that turns tracing on; each process writes its own file */
+#define TRACE_DIR_ENV "QUICKCACHE_TRACE_DIR"
+
+int trace_init(void);
+void trace_process_name(const char *name);
+void trace_begin(const char *name, const hash_t key);
+void trace_end(const char *name);
+void trace_async_begin(const char *name, unsigned long id, const hash_t key);
+void trace_async_end(const char *name, unsigned long id);
+int trace_merge(const char *dir, const char *output);
+void trace_close(void);
+
+#endif
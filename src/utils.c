@@ -1,12 +1,28 @@
+#define _GNU_SOURCE  // syscall, madvise
+
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <libgen.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+/* Below these sizes a plain read()/write() is cheaper than setting up a
+ * mapping or a kernel-side copy. */
+#define VIEW_MAP_MIN (64 * 1024)
+#define COPY_KERNEL_MIN (16 * 1024)
+#define COPY_BUF_SIZE (128 * 1024)
 
 int file_exists(const char *path) {
     return access(path, F_OK) == 0;
@@ -41,53 +57,239 @@ int make_dirs(const char *path) {
     return 0;
 }
 
+/* A name next to path for a file about to be renamed over it, unique
+ * across processes and across the daemon's threads */
+void temp_path(const char *path, const char *suffix, char *buf, size_t len) {
+    static unsigned counter = 0;
+    snprintf(buf, len, "%s.%d.%u.%s", path, (int)getpid(),
+             __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED), suffix);
+}
+
+int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Read everything from fd into a NUL-terminated heap buffer. size_hint is
+ * the expected length (st_size); pipes and /proc files grow as needed. */
+static char *read_fd(int fd, size_t size_hint, size_t *len) {
+    size_t cap = size_hint + 1;
+    size_t used = 0;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+
+    for (;;) {
+        if (used + 1 == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + used, cap - used - 1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) break;
+        used += (size_t)n;
+    }
+
+    buf[used] = 0;
+    if (len) *len = used;
+    return buf;
+}
+
+#ifdef __linux__
+/* Let the kernel move the bytes: copy_file_range can share extents or do
+ * a server-side copy, sendfile at least avoids the user-space bounce. */
+static int copy_in_kernel(int in, int out, off_t size) {
+    off_t done = 0;
+
+#ifdef __NR_copy_file_range
+    while (done < size) {
+        ssize_t n = syscall(__NR_copy_file_range, in, NULL, out, NULL, (size_t)(size - done), 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done == size) return 0;
+#endif
+
+    while (done < size) {
+        ssize_t n = sendfile(out, in, NULL, (size_t)(size - done));
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+#endif
+
+static int copy_buffered(int in, int out) {
+    char *buf = malloc(COPY_BUF_SIZE);
+    if (!buf) return -1;
+
+    int rc = 0;
+    for (;;) {
+        ssize_t n = read(in, buf, COPY_BUF_SIZE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == -1) rc = -1;
+            break;
+        }
+        if (write_all(out, buf, (size_t)n) == -1) {
+            rc = -1;
+            break;
+        }
+    }
+
+    free(buf);
+    return rc;
+}
+
 int copy_file(const char *src, const char *dst) {
-    FILE *fs = fopen(src, "rb");
-    if (!fs) return -1;
-    
-    FILE *fd = fopen(dst, "wb");
-    if (!fd) {
-        fclose(fs);
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return -1;
+
+    struct stat st;
+    if (fstat(in, &st) == -1) {
+        close(in);
         return -1;
     }
-    
-    unsigned char buf[8192];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fs)) > 0) {
-        if (fwrite(buf, 1, n, fd) != n) {
-            fclose(fs);
-            fclose(fd);
-            return -1;
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+
+    int rc = -1;
+#ifdef __linux__
+    if (S_ISREG(st.st_mode) && st.st_size >= COPY_KERNEL_MIN) {
+        rc = copy_in_kernel(in, out, st.st_size);
+        if (rc == -1) {
+            /* Start over in user space (e.g. a filesystem without support) */
+            if (lseek(in, 0, SEEK_SET) == -1 || lseek(out, 0, SEEK_SET) == -1 ||
+                ftruncate(out, 0) == -1) {
+                close(in);
+                close(out);
+                return -1;
+            }
         }
     }
-    
-    fclose(fs);
-    fclose(fd);
+#endif
+    if (rc == -1) {
+        rc = copy_buffered(in, out);
+    }
+
+    close(in);
+    if (close(out) != 0) rc = -1;
+    return rc;
+}
+
+/* Make dst share src's extents (btrfs, xfs, bcachefs). Fails with no
+ * data written on filesystems without reflink support. */
+int reflink_file(const char *src, const char *dst) {
+#if defined(__linux__) && defined(FICLONE)
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in == -1) return -1;
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+
+    int rc = ioctl(out, FICLONE, in) == 0 ? 0 : -1;
+    close(in);
+    if (close(out) != 0) rc = -1;
+    if (rc == -1) unlink(dst);
+    return rc;
+#else
+    (void)src;
+    (void)dst;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/* An output hardlinked from the store must never be written in place,
+ * or the cached object would change with it. Remove such a link so the
+ * next writer creates a fresh file. */
+int break_hardlink(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        return unlink(path);
+    }
     return 0;
 }
 
 char* read_file(const char *path, size_t *len) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return NULL;
-    
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    char *buf = malloc(fsize + 1);
-    if (!buf) {
-        fclose(f);
-        return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    size_t hint = 4096;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        hint = (size_t)st.st_size;
     }
-    
-    size_t n = fread(buf, 1, fsize, f);
-    buf[n] = 0;
-    
-    if (len) *len = n;
-    fclose(f);
+
+    char *buf = read_fd(fd, hint, len);
+    close(fd);
     return buf;
 }
 
+int file_view_open(const char *path, file_view_t *view) {
+    memset(view, 0, sizeof(*view));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size >= VIEW_MAP_MIN) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            view->data = map;
+            view->len = (size_t)st.st_size;
+            view->mapped = 1;
+            return 0;
+        }
+    }
+
+    char *buf = read_fd(fd, S_ISREG(st.st_mode) ? (size_t)st.st_size : 4096, &view->len);
+    close(fd);
+    if (!buf) return -1;
+    view->data = (const unsigned char *)buf;
+    return 0;
+}
+
+void file_view_close(file_view_t *view) {
+    if (view->mapped) {
+        munmap((void *)view->data, view->len);
+    } else {
+        free((void *)view->data);
+    }
+    memset(view, 0, sizeof(*view));
+}
+
 int write_file(const char *path, const void *data, size_t len) {
     FILE *f = fopen(path, "wb");
     if (!f) return -1;
@@ -6,8 +6,23 @@
 int file_exists(const char *path);
 int make_dirs(const char *path);
 int copy_file(const char *src, const char *dst);
+int reflink_file(const char *src, const char *dst);
+int break_hardlink(const char *path);
 char* read_file(const char *path, size_t *len);
 int write_file(const char *path, const void *data, size_t len);
 void get_home_dir(char *buf, size_t len);
 
+/* Read-only view of a whole file. Large regular files are mmap'd for a
+ * single sequential pass; small files and pipes are read into memory. */
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    int mapped;
+} file_view_t;
+
+int file_view_open(const char *path, file_view_t *view);
+void file_view_close(file_view_t *view);
+int write_all(int fd, const void *data, size_t len);
+void temp_path(const char *path, const char *suffix, char *buf, size_t len);
+
 #endif
@@ -0,0 +1,40 @@
+#!/bin/bash
+# Keys in key_mode=preprocessor, computed from the -E output of a
+# stand-in compiler that prints whatever a test puts in $T/pp. Run from
+# the repository root.
+
+. "$(dirname "$0")/testlib.sh"
+
+mkdir -p "$T/p/.quickcache" "$T/src" "$T/out"
+printf 'key_mode=preprocessor\ndirect_mode=false\n' > "$T/p/.quickcache/config"
+echo 'int f;' > "$T/src/f.c"
+
+cat > "$T/cc" <<'CC'
+#!/bin/sh
+for a; do [ "$a" = -E ] && exec cat "$PP_OUTPUT"; done
+while [ $# -gt 0 ]; do [ "$1" = -o ] && out=$2; shift; done
+echo object > "$out"
+CC
+chmod +x "$T/cc"
+
+pp_compile() {
+    PP_OUTPUT="$T/pp" on p "$T/cc" -c "$T/src/f.c" -o "$T/out/f.o" 2>&1 |
+        grep -E "\[quickcache\] (MISS|LOCAL HIT)"
+}
+
+# A '#' line whose prefix fills the classifier's buffer before it can
+# tell whether the line is a marker is hashed as an ordinary line
+printf '# 1 "%s"\n#           linex 1\nint f;\n' "$T/src/f.c" > "$T/pp"
+check "a long '#   line' prefix is stored" "$(pp_compile)" "[quickcache] MISS"
+check "and gives the same key again" "$(pp_compile)" "[quickcache] LOCAL HIT"
+printf '# 1 "%s"\n#           linex 2\nint f;\n' "$T/src/f.c" > "$T/pp"
+check "the rest of that line is in the key" "$(pp_compile)" "[quickcache] MISS"
+
+# Nothing but the line itself is hashed: the marker before it, which
+# differs only in its directory, leaves the key alone
+mkdir -p "$T/src2"
+cp "$T/src/f.c" "$T/src2/f.c"
+printf '# 1 "%s"\n#           linex 2\nint f;\n' "$T/src2/f.c" > "$T/pp"
+check "nothing else leaks into the key" "$(pp_compile)" "[quickcache] LOCAL HIT"
+
+exit $FAILED
@@ -0,0 +1,566 @@
+#define _POSIX_C_SOURCE 200809L  // getopt, strncasecmp
+
+/* Reference remote cache server for tests. It speaks plain HTTP/1.1 with
+ * keep-alive and implements the whole protocol QuickCache uses:
+ *
+ *   GET|HEAD|PUT /cache/<key>        one object
+ *   POST /cache/batch-exists         the listed keys it has, one per line
+ *   POST /cache/batch-get            "<key> <size>\n" and the bytes, per key
+ *   GET /stats                       request and connection counters,
+ *                                    not counting /stats itself
+ *
+ * Objects are files named by key in the store directory, so a test can
+ * seed or inspect them directly. Each connection gets its own thread.
+ * The port (0 picks a free one) is printed on stdout once listening.
+ *
+ * Faults for exercising the client's batch-get parser, given as -f:
+ *   cut=<key>        stop the stream halfway through that object
+ *   badheader=<key>  send a header line for it with no valid size
+ *
+ * With -n it plays a server without the batch endpoints, answering them
+ * with a 404 and an HTML error page.
+ *
+ * Usage: refserver -d <dir> [-p <port>] [-n] [-f <fault>]... */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define KEY_LEN 64
+#define HEAD_MAX 8192
+#define MAX_FAULTS 16
+
+typedef enum {
+    FAULT_CUT,
+    FAULT_BAD_HEADER
+} fault_type_t;
+
+typedef struct {
+    fault_type_t type;
+    char key[KEY_LEN + 1];
+} fault_t;
+
+static const char *store_dir = NULL;
+static fault_t faults[MAX_FAULTS];
+static int fault_count = 0;
+static int no_batch = 0;
+
+/* ---------- COUNTERS ---------- */
+
+typedef struct {
+    unsigned long connections;
+    unsigned long requests;
+    unsigned long get;
+    unsigned long head;
+    unsigned long put;
+    unsigned long batch_exists;
+    unsigned long batch_get;
+} counters_t;
+
+static counters_t counters;
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void bump(unsigned long *counter) {
+    pthread_mutex_lock(&counters_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&counters_mutex);
+}
+
+/* ---------- CONNECTION ---------- */
+
+typedef struct {
+    int fd;
+    char buf[16384];
+    size_t start;
+    size_t end;
+    int counted;   /* in counters.connections */
+} conn_t;
+
+typedef struct {
+    char method[16];
+    char path[512];
+    long long content_length;
+    int keep_alive;
+    int expect_continue;
+    int chunked;
+} request_t;
+
+static int write_full(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int fill(conn_t *c) {
+    if (c->start > 0) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+    if (c->end == sizeof(c->buf)) return -1;
+    ssize_t n;
+    do {
+        n = read(c->fd, c->buf + c->end, sizeof(c->buf) - c->end);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+    c->end += (size_t)n;
+    return 0;
+}
+
+/* Read exactly len body bytes, into out when it is not NULL */
+static int read_body(conn_t *c, FILE *out, char *buf, long long len) {
+    while (len > 0) {
+        if (c->start == c->end && fill(c) == -1) return -1;
+        size_t chunk = c->end - c->start;
+        if ((long long)chunk > len) chunk = (size_t)len;
+        if (out && fwrite(c->buf + c->start, 1, chunk, out) != chunk) return -1;
+        if (buf) {
+            memcpy(buf, c->buf + c->start, chunk);
+            buf += chunk;
+        }
+        c->start += chunk;
+        len -= (long long)chunk;
+    }
+    return 0;
+}
+
+/* Parse one request head. Returns -1 on EOF or a malformed request. */
+static int read_request(conn_t *c, request_t *req) {
+    char *head_end;
+    for (;;) {
+        head_end = NULL;
+        for (size_t i = c->start; i + 3 < c->end; i++) {
+            if (memcmp(c->buf + i, "\r\n\r\n", 4) == 0) {
+                head_end = c->buf + i;
+                break;
+            }
+        }
+        if (head_end) break;
+        if (c->end - c->start >= HEAD_MAX || fill(c) == -1) return -1;
+    }
+
+    *head_end = '\0';
+    char *line = c->buf + c->start;
+    c->start = (size_t)(head_end - c->buf) + 4;
+
+    memset(req, 0, sizeof(*req));
+    req->keep_alive = 1;
+
+    char version[16];
+    if (sscanf(line, "%15s %511s %15s", req->method, req->path, version) != 3) return -1;
+    if (strcmp(version, "HTTP/1.1") != 0) req->keep_alive = 0;
+
+    for (line = strstr(line, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        char *colon = strchr(line, ':');
+        char *eol = strstr(line, "\r\n");
+        if (!colon || (eol && colon > eol)) continue;
+        const char *value = colon + 1;
+        while (*value == ' ') value++;
+        size_t name_len = (size_t)(colon - line);
+
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+            req->content_length = atoll(value);
+        } else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+            if (strncasecmp(value, "close", 5) == 0) req->keep_alive = 0;
+        } else if (name_len == 6 && strncasecmp(line, "Expect", 6) == 0) {
+            req->expect_continue = strncasecmp(value, "100-continue", 12) == 0;
+        } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+            req->chunked = strncasecmp(value, "chunked", 7) == 0;
+        }
+    }
+    return 0;
+}
+
+static int send_head(conn_t *c, int status, const char *reason, long long length, int keep_alive) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %d %s\r\nContent-Length: %lld\r\nConnection: %s\r\n\r\n",
+                     status, reason, length, keep_alive ? "keep-alive" : "close");
+    return write_full(c->fd, head, (size_t)n);
+}
+
+static int send_status(conn_t *c, int status, const char *reason, int keep_alive) {
+    return send_head(c, status, reason, 0, keep_alive);
+}
+
+/* ---------- STORE ---------- */
+
+static int valid_key(const char *key) {
+    if (strlen(key) != KEY_LEN) return 0;
+    for (int i = 0; i < KEY_LEN; i++) {
+        char ch = key[i];
+        if (!((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f'))) return 0;
+    }
+    return 1;
+}
+
+static void object_path(const char *key, char *buf, size_t len) {
+    snprintf(buf, len, "%s/%s", store_dir, key);
+}
+
+static long long object_size(const char *key) {
+    char path[4096];
+    struct stat st;
+    object_path(key, path, sizeof(path));
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) ? (long long)st.st_size : -1;
+}
+
+static int send_file(conn_t *c, const char *path, long long len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    char buf[16384];
+    while (len > 0) {
+        ssize_t n = read(fd, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf));
+        if (n <= 0 || write_full(c->fd, buf, (size_t)n) == -1) {
+            close(fd);
+            return -1;
+        }
+        len -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+static const fault_t *find_fault(const char *key) {
+    for (int i = 0; i < fault_count; i++) {
+        if (strcmp(faults[i].key, key) == 0) return &faults[i];
+    }
+    return NULL;
+}
+
+/* ---------- HANDLERS ---------- */
+
+static int handle_get(conn_t *c, const request_t *req, const char *key, int with_body) {
+    char path[4096];
+    object_path(key, path, sizeof(path));
+    long long size = object_size(key);
+    if (size < 0) return send_status(c, 404, "Not Found", req->keep_alive);
+    if (send_head(c, 200, "OK", size, req->keep_alive) == -1) return -1;
+    return with_body ? send_file(c, path, size) : 0;
+}
+
+/* Written under a temporary name and renamed, so a reader never sees
+ * half an object */
+static int handle_put(conn_t *c, const request_t *req, const char *key) {
+    if (req->chunked) {
+        send_status(c, 411, "Length Required", 0);
+        return -1;
+    }
+    if (req->expect_continue &&
+        write_full(c->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) == -1) {
+        return -1;
+    }
+
+    char path[4096], tmp[4200];
+    object_path(key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%lu", store_dir, key, (unsigned long)pthread_self());
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        read_body(c, NULL, NULL, req->content_length);
+        return send_status(c, 500, "Internal Server Error", req->keep_alive);
+    }
+
+    int ok = read_body(c, out, NULL, req->content_length) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return send_status(c, 201, "Created", req->keep_alive);
+}
+
+/* Split a request body into the valid keys it lists, in place */
+static int parse_keys(char *body, char **keys, int max) {
+    int n = 0;
+    for (char *line = strtok(body, "\r\n"); line && n < max; line = strtok(NULL, "\r\n")) {
+        if (valid_key(line)) keys[n++] = line;
+    }
+    return n;
+}
+
+static int handle_batch_exists(conn_t *c, const request_t *req, char **keys, int count) {
+    char *out = malloc((size_t)count * (KEY_LEN + 1) + 1);
+    if (!out) return -1;
+    size_t len = 0;
+    for (int i = 0; i < count; i++) {
+        if (object_size(keys[i]) < 0) continue;
+        memcpy(out + len, keys[i], KEY_LEN);
+        out[len + KEY_LEN] = '\n';
+        len += KEY_LEN + 1;
+    }
+
+    int r = send_head(c, 200, "OK", (long long)len, req->keep_alive);
+    if (r == 0) r = write_full(c->fd, out, len);
+    free(out);
+    return r;
+}
+
+static int batch_header(const char *key, long long size, char *buf, size_t len) {
+    const fault_t *fault = find_fault(key);
+    if (fault && fault->type == FAULT_BAD_HEADER) return snprintf(buf, len, "%s size\n", key);
+    return snprintf(buf, len, "%s %lld\n", key, size);
+}
+
+/* The Content-Length is worked out first, from the object sizes, so a
+ * cut stream falls short of it and the client sees a partial transfer */
+static int handle_batch_get(conn_t *c, const request_t *req, char **keys, int count) {
+    long long *sizes = malloc((size_t)(count > 0 ? count : 1) * sizeof(long long));
+    if (!sizes) return -1;
+
+    long long total = 0;
+    for (int i = 0; i < count; i++) {
+        sizes[i] = object_size(keys[i]);
+        if (sizes[i] < 0) continue;
+        char header[128];
+        total += batch_header(keys[i], sizes[i], header, sizeof(header)) + sizes[i];
+    }
+
+    int r = send_head(c, 200, "OK", total, req->keep_alive);
+    for (int i = 0; i < count && r == 0; i++) {
+        if (sizes[i] < 0) continue;
+        const fault_t *fault = find_fault(keys[i]);
+        char header[128], path[4096];
+        int n = batch_header(keys[i], sizes[i], header, sizeof(header));
+        object_path(keys[i], path, sizeof(path));
+        r = write_full(c->fd, header, (size_t)n);
+        if (r == 0 && fault && fault->type == FAULT_CUT) {
+            send_file(c, path, sizes[i] / 2);
+            r = -1;
+        } else if (r == 0) {
+            r = send_file(c, path, sizes[i]);
+        }
+    }
+    free(sizes);
+    return r;
+}
+
+static int handle_batch(conn_t *c, const request_t *req, const char *endpoint) {
+    if (req->chunked || req->content_length < 0 || req->content_length > (64 << 20)) {
+        send_status(c, 413, "Payload Too Large", 0);
+        return -1;
+    }
+    char *body = malloc((size_t)req->content_length + 1);
+    if (!body) return -1;
+    if (read_body(c, NULL, body, req->content_length) == -1) {
+        free(body);
+        return -1;
+    }
+    body[req->content_length] = '\0';
+
+    int max = (int)(req->content_length / KEY_LEN) + 1;
+    char **keys = malloc((size_t)max * sizeof(char *));
+    int r = -1;
+    if (keys) {
+        int count = parse_keys(body, keys, max);
+        if (strcmp(endpoint, "batch-exists") == 0) {
+            bump(&counters.batch_exists);
+            r = handle_batch_exists(c, req, keys, count);
+        } else {
+            bump(&counters.batch_get);
+            r = handle_batch_get(c, req, keys, count);
+        }
+    }
+    free(keys);
+    free(body);
+    return r;
+}
+
+static int handle_stats(conn_t *c, const request_t *req) {
+    pthread_mutex_lock(&counters_mutex);
+    counters_t snapshot = counters;
+    pthread_mutex_unlock(&counters_mutex);
+
+    char body[512];
+    int n = snprintf(body, sizeof(body),
+                     "connections %lu\nrequests %lu\nget %lu\nhead %lu\nput %lu\n"
+                     "batch_exists %lu\nbatch_get %lu\n",
+                     snapshot.connections, snapshot.requests, snapshot.get, snapshot.head,
+                     snapshot.put, snapshot.batch_exists, snapshot.batch_get);
+    if (send_head(c, 200, "OK", n, req->keep_alive) == -1) return -1;
+    return write_full(c->fd, body, (size_t)n);
+}
+
+/* What a web server without the batch endpoints sends back */
+static int send_not_found_page(conn_t *c, const request_t *req) {
+    static const char page[] =
+        "<html><head><title>404 Not Found</title></head>\n"
+        "<body><h1>Not Found</h1></body></html>\n";
+    read_body(c, NULL, NULL, req->content_length);
+    if (send_head(c, 404, "Not Found", (long long)sizeof(page) - 1, req->keep_alive) == -1) {
+        return -1;
+    }
+    return write_full(c->fd, page, sizeof(page) - 1);
+}
+
+/* Serve one request. Returns -1 when the connection must be closed. */
+static int handle_request(conn_t *c, const request_t *req) {
+    const char *prefix = "/cache/";
+    size_t prefix_len = strlen(prefix);
+
+    if (strcmp(req->path, "/stats") == 0 && strcmp(req->method, "GET") == 0) {
+        return handle_stats(c, req);
+    }
+
+    /* A connection only asking for /stats is the test's, not a client's */
+    if (!c->counted) {
+        bump(&counters.connections);
+        c->counted = 1;
+    }
+    bump(&counters.requests);
+
+    if (strncmp(req->path, prefix, prefix_len) != 0) {
+        read_body(c, NULL, NULL, req->content_length);
+        return send_status(c, 404, "Not Found", req->keep_alive);
+    }
+    const char *name = req->path + prefix_len;
+
+    if (strcmp(req->method, "POST") == 0 &&
+        (strcmp(name, "batch-exists") == 0 || strcmp(name, "batch-get") == 0)) {
+        if (no_batch) return send_not_found_page(c, req);
+        return handle_batch(c, req, name);
+    }
+    if (!valid_key(name)) {
+        read_body(c, NULL, NULL, req->content_length);
+        return send_status(c, 400, "Bad Request", req->keep_alive);
+    }
+
+    if (strcmp(req->method, "GET") == 0) {
+        bump(&counters.get);
+        return handle_get(c, req, name, 1);
+    }
+    if (strcmp(req->method, "HEAD") == 0) {
+        bump(&counters.head);
+        return handle_get(c, req, name, 0);
+    }
+    if (strcmp(req->method, "PUT") == 0) {
+        bump(&counters.put);
+        return handle_put(c, req, name);
+    }
+    read_body(c, NULL, NULL, req->content_length);
+    return send_status(c, 405, "Method Not Allowed", req->keep_alive);
+}
+
+static void *connection_main(void *arg) {
+    conn_t *c = arg;
+    request_t req;
+    while (read_request(c, &req) == 0) {
+        if (handle_request(c, &req) == -1 || !req.keep_alive) break;
+    }
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+/* ---------- MAIN ---------- */
+
+static int parse_fault(const char *spec) {
+    const char *eq = strchr(spec, '=');
+    if (!eq || fault_count == MAX_FAULTS || !valid_key(eq + 1)) return -1;
+
+    fault_t *fault = &faults[fault_count];
+    size_t name_len = (size_t)(eq - spec);
+    if (name_len == 3 && strncmp(spec, "cut", 3) == 0) {
+        fault->type = FAULT_CUT;
+    } else if (name_len == 9 && strncmp(spec, "badheader", 9) == 0) {
+        fault->type = FAULT_BAD_HEADER;
+    } else {
+        return -1;
+    }
+    snprintf(fault->key, sizeof(fault->key), "%s", eq + 1);
+    fault_count++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int port = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:p:nf:")) != -1) {
+        switch (opt) {
+        case 'd':
+            store_dir = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            no_batch = 1;
+            break;
+        case 'f':
+            if (parse_fault(optarg) == -1) {
+                fprintf(stderr, "Bad fault: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s -d <dir> [-p <port>] [-n] [-f cut=<key>|badheader=<key>]...\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (!store_dir) {
+        fprintf(stderr, "Missing store directory (-d)\n");
+        return 1;
+    }
+    mkdir(store_dir, 0755);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    socklen_t addr_len = sizeof(addr);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 128) == -1 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("refserver");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            return 1;
+        }
+
+        conn_t *c = calloc(1, sizeof(*c));
+        pthread_t thread;
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        if (pthread_create(&thread, NULL, connection_main, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,78 @@
+#!/bin/bash
+# Upload dedup and --prefetch against the reference server, including
+# the batch-get parser's handling of zero-length objects, a stream cut
+# off mid-object, a malformed header and a server without batch support.
+# Run from the repository root.
+
+. "$(dirname "$0")/testlib.sh"
+
+start_server
+for n in 1 2 3; do source_file $n; done
+
+# Machine a compiles and uploads everything
+machine a
+for n in 1 2 3; do compile a $n > /dev/null; done
+on a --flush-uploads > /dev/null
+check "uploads reach the server" "$(server_count put)" 3
+
+# Machine b stores the same objects while the server is unreachable,
+# then finds at upload time that the server already has them
+machine b http://127.0.0.1:1
+for n in 1 2 3; do compile b $n > /dev/null; done
+on b --flush-uploads > /dev/null 2>&1
+machine b
+asked=$(server_count batch_exists)
+on b --flush-uploads > /dev/null
+check "spooled keys the server has are not uploaded" "$(server_count put)" 3
+check "one batch-exists request covers them" "$(($(server_count batch_exists) - asked))" 1
+check "they are counted as skipped" \
+    "$(on b --stats | grep -o '[0-9]* skipped')" "3 skipped"
+
+# The key list to prefetch: three real objects, one empty object and
+# one the server does not have
+on a --list-keys > "$T/keys"
+mapfile -t KEYS < "$T/keys"
+EMPTY=$(printf '0%.0s' $(seq 63))e
+MISSING=$(printf 'f%.0s' $(seq 64))
+: > "$T/store/$EMPTY"
+printf '%s\n%s\n' "$EMPTY" "$MISSING" >> "$T/keys"
+
+machine c
+gets=$(server_count get)
+check "prefetch fetches what the server has" \
+    "$(on c --prefetch "$T/keys")" "Prefetched 4 of 5 keys"
+check "in one batch-get request" "$(server_count batch_get)" 1
+check "without falling back to GET" "$(($(server_count get) - gets))" 0
+check "the empty object is stored" "$(on c --list-keys | grep -c "$EMPTY")" 1
+check "prefetched objects are local hits" "$(compile c 2)" "[quickcache] LOCAL HIT"
+
+# A stream cut off inside the second object keeps the first and
+# leaves nothing half-written
+stop_server
+start_server -f "cut=${KEYS[1]}"
+machine d
+check "a cut stream keeps the objects before the cut" \
+    "$(on d --prefetch "$T/keys")" "Prefetched 1 of 5 keys"
+check "the cut object is not stored" "$(on d --list-keys | grep -c "${KEYS[1]}")" 0
+check "no partial file is left" "$(find "$T/d/.quickcache/objects" -name '.*' | wc -l)" 0
+
+# So does a header line without a size
+stop_server
+start_server -f "badheader=${KEYS[1]}"
+machine e
+check "a bad header keeps the objects before it" \
+    "$(on e --prefetch "$T/keys")" "Prefetched 1 of 5 keys"
+check "the object after it is not stored" "$(on e --list-keys | grep -c "${KEYS[1]}")" 0
+check "no partial file is left" "$(find "$T/e/.quickcache/objects" -name '.*' | wc -l)" 0
+
+# A server without the batch endpoints answers them with an error page,
+# which is not parsed as a response or counted as a remote error
+stop_server
+start_server -n
+machine f
+check "prefetch falls back to one GET per key" \
+    "$(on f --prefetch "$T/keys")" "Prefetched 4 of 5 keys"
+check "the error page is not a remote error" \
+    "$(on f --stats | grep -o '[0-9]* remote,')" "0 remote,"
+
+exit $FAILED
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Round-trips to the remote cache per compile, as counted by the
+# reference server, for each way a compile can go. Each must match the
+# client's own --stats counters. Run from the repository root.
+
+. "$(dirname "$0")/testlib.sh"
+
+N=4
+start_server
+for n in $(seq $N); do source_file $n; done
+
+# client_counts <name>: that machine's remote request and connection
+# counters, as "<requests> <connections>"
+client_counts() {
+    on $1 --stats | sed -n 's/^Remote: *\([0-9]*\) requests, \([0-9]*\) new connections.*/\1 \2/p'
+}
+
+# measure <name> <label> <requests> <connections> <command>...: run the
+# command, report the server's counts per compile and check the totals
+measure() {
+    local name=$1 label=$2 want_requests=$3 want_connections=$4
+    shift 4
+    local requests=$(server_count requests) connections=$(server_count connections)
+    local client=($(client_counts $name))
+    "$@" > /dev/null
+    requests=$(($(server_count requests) - requests))
+    connections=$(($(server_count connections) - connections))
+    local client_after=($(client_counts $name))
+
+    awk -v l="$label" -v r=$requests -v c=$connections -v n=$N \
+        'BEGIN { printf "  %-30s %4.1f requests, %4.1f connections per compile\n", l, r / n, c / n }'
+    check "$label: requests" $requests $want_requests
+    check "$label: new connections" $connections $want_connections
+    check "$label: client counters agree" \
+        "$((client_after[0] - client[0])) $((client_after[1] - client[1]))" "$requests $connections"
+}
+
+compile_all() {
+    for n in $(seq $N); do compile $1 $n; done
+}
+
+# A miss looks the key up and, uploading in-process, PUTs the object
+# over the same kept-alive connection
+machine a
+configure a async_upload=false
+measure a "miss, upload in-process" $((2 * N)) $N compile_all a
+
+# Another machine finds every object with one GET
+machine b
+measure b "remote hit" $N $N compile_all b
+
+# And then needs the server no more
+measure b "local hit" 0 0 compile_all b
+
+# The daemon keeps one connection open across compiles
+machine c
+configure c daemon=true
+measure c "remote hit through the daemon" $N 1 compile_all c
+on c --stop-daemon > /dev/null
+
+exit $FAILED
@@ -0,0 +1,81 @@
+# Helpers for the remote cache tests, sourced by tools/*_test.sh.
+# Each test gets a scratch directory with its own HOME per simulated
+# machine, and talks to tools/refserver on a free local port.
+
+BC=${BC:-./buildcache}
+SERVER=${SERVER:-./tools/refserver}
+
+T=$(mktemp -d)
+SERVER_PID=
+PORT=
+FAILED=0
+
+cleanup() {
+    stop_server
+    rm -rf "${T:?}"
+}
+trap cleanup EXIT
+
+# start_server [-f fault]...: serve $T/store, setting PORT
+start_server() {
+    : > "$T/port"
+    "$SERVER" -d "$T/store" "$@" > "$T/port" &
+    SERVER_PID=$!
+    for _ in $(seq 50); do
+        [ -s "$T/port" ] && break
+        sleep 0.1
+    done
+    PORT=$(cat "$T/port")
+    [ -n "$PORT" ] || { echo "refserver did not start"; exit 1; }
+}
+
+stop_server() {
+    [ -n "$SERVER_PID" ] || return 0
+    kill "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+}
+
+# machine <name> [remote_url]: a fresh HOME with that remote configured
+machine() {
+    mkdir -p "$T/$1/.quickcache"
+    printf 'remote_url=%s\n' "${2:-http://127.0.0.1:$PORT}" > "$T/$1/.quickcache/config"
+}
+
+# configure <name> <key=value>: add a config line for that machine
+configure() {
+    echo "$2" >> "$T/$1/.quickcache/config"
+}
+
+# on <name> <args>...: run buildcache as that machine
+on() {
+    local name=$1
+    shift
+    HOME="$T/$name" "$BC" "$@"
+}
+
+# server_count <counter>: one of the counters from the server's /stats
+server_count() {
+    curl -s "http://127.0.0.1:$PORT/stats" | awk -v k="$1" '$1 == k { print $2 }'
+}
+
+# source_file <n>: a small distinct translation unit, $T/src/f<n>.c
+source_file() {
+    mkdir -p "$T/src" "$T/out"
+    printf 'int f%d(int x) { return x * %d; }\n' "$1" "$1" > "$T/src/f$1.c"
+}
+
+# compile <name> <n>: compile $T/src/f<n>.c on that machine, printing
+# the cache outcome
+compile() {
+    on "$1" gcc -c "$T/src/f$2.c" -o "$T/out/f$2.o" 2>&1 | grep "\[quickcache\]" | head -1
+}
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "✓ $1"
+    else
+        echo "✗ $1: expected '$3', got '$2'"
+        FAILED=1
+    fi
+}